@@ -0,0 +1,406 @@
+// batched block I/O straight to the image. a whole batch of requests
+// is handed to the kernel at once through io_uring, so the device sees
+// them all instead of one 4 KiB pread() at a time. without io_uring a
+// small pool of threads issues them in parallel instead. either way
+// async_submit() returns once the whole batch is done
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+// the kernel headers have a BLOCK_SIZE of their own
+#undef BLOCK_SIZE
+#include "block.h"
+#include "image.h"
+#include "async.h"
+
+// the ring and its shared memory. the kernel's head and tail indexes
+// are read and written with acquire/release ordering
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// a piece of a request small enough for one system call
+struct segment {
+    int op;
+    int block_num;
+    int count;
+    unsigned char **blocks;
+    struct iovec *iov;
+};
+
+static int engine_choice = ASYNC_AUTO;
+static int engine = -1;  // -1 until the first batch picks one
+static struct uring ring = {.fd = -1};
+
+// one batch at a time goes through the engine
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    pthread_t threads[ASYNC_POOL_THREADS];
+    int running;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct segment *segments;
+    int count;
+    int next;
+    int finished;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void uring_teardown(void)
+{
+    if (ring.fd == -1)
+        return;
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != ring.sq_ring)
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+// create the ring. returns FAILED if the kernel doesn't have io_uring
+// or won't let us use it
+static int uring_setup(void)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, ASYNC_QUEUE_DEPTH, &p);
+    if (fd < 0)
+        return FAILED;
+
+    ring.fd = fd;
+    ring.entries = p.sq_entries;
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    // newer kernels put both rings in one mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_size > ring.sq_ring_size)
+            ring.sq_ring_size = ring.cq_ring_size;
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        close(fd);
+        ring.fd = -1;
+        return FAILED;
+    }
+    ring.cq_ring = ring.sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED) {
+            munmap(ring.sq_ring, ring.sq_ring_size);
+            close(fd);
+            ring.fd = -1;
+            return FAILED;
+        }
+    }
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes_size = 0;
+        ring.sqes = NULL;
+        uring_teardown();
+        return FAILED;
+    }
+
+    unsigned char *sq = ring.sq_ring;
+    unsigned char *cq = ring.cq_ring;
+    ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// reads past the end of the image come back short, the rest of the
+// buffers read as zeros the same as block_readv_disk()
+static void segment_complete(struct segment *seg, int res)
+{
+    if (res < 0)
+        exit(1);
+    if (seg->op == BLOCK_IO_WRITE) {
+        if (res != seg->count * BLOCK_SIZE)
+            exit(1);
+        return;
+    }
+    for (int i = 0; i < seg->count; i++) {
+        int done = res - i * BLOCK_SIZE;
+        if (done < 0)
+            done = 0;
+        if (done < BLOCK_SIZE)
+            memset(seg->blocks[i] + done, 0, BLOCK_SIZE - done);
+    }
+}
+
+// keep the ring as full as the batch allows, refilling it as
+// completions come in
+static void uring_run(struct segment *segs, int count)
+{
+    int next = 0;
+    int inflight = 0;
+    unsigned int unsubmitted = 0;
+
+    while (next < count || inflight > 0) {
+        unsigned int tail = *ring.sq_tail;
+        while (next < count && inflight + (int)unsubmitted < (int)ring.entries) {
+            unsigned int index = tail & *ring.sq_mask;
+            struct io_uring_sqe *sqe = &ring.sqes[index];
+            struct segment *seg = &segs[next];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = seg->op == BLOCK_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->fd = image_fd;
+            sqe->addr = (unsigned long)seg->iov;
+            sqe->len = seg->count;
+            sqe->off = get_block_position(seg->block_num);
+            sqe->user_data = next;
+            ring.sq_array[index] = index;
+            tail++;
+            next++;
+            unsubmitted++;
+        }
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        int ret = syscall(__NR_io_uring_enter, ring.fd, unsubmitted, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            exit(1);
+        }
+        unsubmitted -= ret;
+        inflight += ret;
+
+        unsigned int head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            segment_complete(&segs[cqe->user_data], cqe->res);
+            head++;
+            inflight--;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// each pool thread takes the next segment until the batch runs out
+static void *pool_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.stop && pool.next >= pool.count)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        if (pool.stop)
+            break;
+
+        struct segment *seg = &pool.segments[pool.next++];
+        pthread_mutex_unlock(&pool.lock);
+        if (seg->op == BLOCK_IO_READ)
+            block_readv_disk(seg->block_num, seg->blocks, seg->count);
+        else
+            block_writev_disk(seg->block_num, seg->blocks, seg->count);
+        pthread_mutex_lock(&pool.lock);
+
+        if (++pool.finished == pool.count)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    pool.stop = 0;
+    pool.count = pool.next = pool.finished = 0;
+    for (int i = 0; i < ASYNC_POOL_THREADS; i++) {
+        if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL) != 0)
+            exit(1);
+    }
+    pool.running = 1;
+}
+
+static void pool_stop(void)
+{
+    if (!pool.running)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < ASYNC_POOL_THREADS; i++)
+        pthread_join(pool.threads[i], NULL);
+    pool.running = 0;
+}
+
+static void pool_run(struct segment *segs, int count)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.segments = segs;
+    pool.count = count;
+    pool.next = 0;
+    pool.finished = 0;
+    pthread_cond_broadcast(&pool.work);
+    while (pool.finished < pool.count)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pool.segments = NULL;
+    pool.count = pool.next = pool.finished = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// bring up whichever engine was asked for. under ASYNC_AUTO a kernel
+// without io_uring (or a sandbox that blocks it) gets the pool
+static int engine_start(int choice)
+{
+    if (choice != ASYNC_POOL && uring_setup() == 0) {
+        engine = ASYNC_URING;
+        return 0;
+    }
+    if (choice == ASYNC_URING)
+        return FAILED;
+    pool_start();
+    engine = ASYNC_POOL;
+    return 0;
+}
+
+static void engine_stop(void)
+{
+    uring_teardown();
+    pool_stop();
+    engine = -1;
+}
+
+// choose the engine for later batches. returns FAILED, leaving the
+// engine as it was, if io_uring was asked for and isn't available
+int async_set_engine(int choice)
+{
+    int status = 0;
+
+    pthread_mutex_lock(&submit_lock);
+    int old = engine_choice;
+    engine_stop();
+    if (choice == ASYNC_URING) {
+        status = engine_start(choice);
+        if (status == FAILED)
+            choice = old;
+    }
+    if (status == 0)
+        engine_choice = choice;
+    pthread_mutex_unlock(&submit_lock);
+    return status;
+}
+
+// the engine batches are going through, started on demand
+int async_engine(void)
+{
+    pthread_mutex_lock(&submit_lock);
+    if (engine == -1)
+        engine_start(engine_choice);
+    int current = engine;
+    pthread_mutex_unlock(&submit_lock);
+    return current;
+}
+
+// run a batch of requests and wait for all of them. the requests may
+// be in any order and are issued concurrently, so two in one batch
+// mustn't touch the same block unless both are reads. I/O errors end
+// the program, the same as the synchronous calls in block.c
+void async_submit(struct block_io *ios, int count)
+{
+    int segment_count = 0;
+    int block_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        segment_count += (ios[i].count + BLOCK_IOV_MAX - 1) / BLOCK_IOV_MAX;
+        block_count += ios[i].count;
+    }
+    if (segment_count == 0)
+        return;
+
+    struct segment *segs = malloc(sizeof(struct segment) * segment_count);
+    struct iovec *iov = malloc(sizeof(struct iovec) * block_count);
+    if (segs == NULL || iov == NULL)
+        exit(1);
+
+    // split requests that are too long for one readv into segments
+    int s = 0;
+    int b = 0;
+    for (int i = 0; i < count; i++) {
+        for (int done = 0; done < ios[i].count; done += BLOCK_IOV_MAX) {
+            int len = ios[i].count - done;
+            if (len > BLOCK_IOV_MAX)
+                len = BLOCK_IOV_MAX;
+            segs[s].op = ios[i].op;
+            segs[s].block_num = ios[i].block_num + done;
+            segs[s].count = len;
+            segs[s].blocks = ios[i].blocks + done;
+            segs[s].iov = iov + b;
+            for (int j = 0; j < len; j++) {
+                iov[b + j].iov_base = segs[s].blocks[j];
+                iov[b + j].iov_len = BLOCK_SIZE;
+            }
+            b += len;
+            s++;
+        }
+    }
+
+    pthread_mutex_lock(&submit_lock);
+    if (engine == -1)
+        engine_start(engine_choice);
+    // a single request gains nothing from the engine
+    if (segment_count == 1 && segs[0].op == BLOCK_IO_READ)
+        block_readv_disk(segs[0].block_num, segs[0].blocks, segs[0].count);
+    else if (segment_count == 1)
+        block_writev_disk(segs[0].block_num, segs[0].blocks, segs[0].count);
+    else if (engine == ASYNC_URING)
+        uring_run(segs, segment_count);
+    else
+        pool_run(segs, segment_count);
+    pthread_mutex_unlock(&submit_lock);
+
+    free(iov);
+    free(segs);
+}
+
+// release the ring and stop the pool threads. called when the image is
+// closed, the next batch starts the engine again
+void async_shutdown(void)
+{
+    pthread_mutex_lock(&submit_lock);
+    engine_stop();
+    pthread_mutex_unlock(&submit_lock);
+}
@@ -0,0 +1,29 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+// engines for async_set_engine()
+#define ASYNC_AUTO 0   // io_uring if the kernel has it, the pool if not
+#define ASYNC_URING 1
+#define ASYNC_POOL 2
+
+#define ASYNC_QUEUE_DEPTH 64
+#define ASYNC_POOL_THREADS 4
+
+#define BLOCK_IO_READ 0
+#define BLOCK_IO_WRITE 1
+
+// one request in a batch: count contiguous blocks from block_num,
+// to or from the buffers in blocks
+struct block_io {
+    int op;
+    int block_num;
+    int count;
+    unsigned char **blocks;
+};
+
+int async_set_engine(int engine);
+int async_engine(void);
+void async_submit(struct block_io *ios, int count);
+void async_shutdown(void);
+
+#endif
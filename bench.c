@@ -0,0 +1,483 @@
+// benchmarks for the library. each one times its operations one at a
+// time and reports throughput, median and 99th percentile latency, and
+// read/write system calls per operation from /proc/self/io.
+//
+//   simfs_bench [--json] [name...]
+//
+// runs every benchmark, or only the named ones. --json prints one JSON
+// array instead of a table so runs can be saved and compared
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "image.h"
+#include "block.h"
+#include "cache.h"
+#include "free.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "directory.h"
+#include "dcache.h"
+#include "ls.h"
+
+#define BENCH_IMAGE "bench_image"
+#define BENCH_IMAGE_SIZE (128LL * 1024 * 1024)
+#define BENCH_INODES 8192
+#define MICRO_OPS 20000
+#define BIG_DIR_ENTRIES 4000
+#define MAKE_DIRS 2000
+#define DEEP_LEVELS 32
+#define MAX_OPS (MICRO_OPS * 4)
+
+struct run {
+    const char *name;
+    int ops;
+    long long *latency;  // ns per operation
+    long long started;   // the operation being timed
+    long long total;
+    unsigned long long syscalls;
+};
+
+static int json = 0;
+static int printed = 0;
+static unsigned long long io_overhead = 0;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// read and write system calls made by this process so far, 0 if the
+// kernel doesn't say
+static unsigned long long io_syscalls(void)
+{
+    char buf[512];
+    unsigned long long syscr = 0, syscw = 0;
+    int fd = open("/proc/self/io", O_RDONLY);
+
+    if (fd == -1)
+        return 0;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    char *p = strstr(buf, "syscr:");
+    if (p != NULL)
+        syscr = strtoull(p + 6, NULL, 10);
+    p = strstr(buf, "syscw:");
+    if (p != NULL)
+        syscw = strtoull(p + 6, NULL, 10);
+    return syscr + syscw;
+}
+
+static void run_begin(struct run *r, const char *name)
+{
+    r->name = name;
+    r->ops = 0;
+    r->total = 0;
+    r->syscalls = io_syscalls();
+}
+
+static void op_begin(struct run *r)
+{
+    r->started = now_ns();
+}
+
+static void op_end(struct run *r)
+{
+    long long elapsed = now_ns() - r->started;
+
+    if (r->ops < MAX_OPS)
+        r->latency[r->ops] = elapsed;
+    r->ops++;
+    r->total += elapsed;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void run_end(struct run *r)
+{
+    unsigned long long syscalls = io_syscalls() - r->syscalls;
+    int kept = r->ops < MAX_OPS ? r->ops : MAX_OPS;
+
+    syscalls = syscalls > io_overhead ? syscalls - io_overhead : 0;
+    qsort(r->latency, kept, sizeof(long long), compare_latency);
+    double seconds = r->total / 1e9;
+    double ops_per_sec = seconds > 0 ? r->ops / seconds : 0;
+    double p50 = kept ? r->latency[kept / 2] / 1000.0 : 0;
+    double p99 = kept ? r->latency[(int)(kept * 0.99)] / 1000.0 : 0;
+    double per_op = r->ops ? (double)syscalls / r->ops : 0;
+
+    if (json) {
+        printf("%s\n  {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+               "\"p50_us\": %.3f, \"p99_us\": %.3f, \"syscalls_per_op\": %.3f}",
+               printed ? "," : "[", r->name, r->ops, seconds, ops_per_sec, p50, p99, per_op);
+    } else {
+        if (!printed)
+            printf("%-16s %8s %14s %10s %10s %12s\n", "benchmark", "ops", "ops/sec", "p50 us", "p99 us", "syscalls/op");
+        printf("%-16s %8d %14.1f %10.3f %10.3f %12.3f\n", r->name, r->ops, ops_per_sec, p50, p99, per_op);
+    }
+    printed = 1;
+    fflush(stdout);
+}
+
+// a new large image, closed and reopened so the caches start cold
+static void fresh_image(void)
+{
+    struct mkfs_options options;
+
+    image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+    mkfs_default_options(&options);
+    options.image_size = BENCH_IMAGE_SIZE;
+    options.inode_count = BENCH_INODES;
+    if (mkfs_with_options(&options) == FAILED) {
+        fprintf(stderr, "simfs_bench: mkfs failed\n");
+        exit(1);
+    }
+    image_close();
+    image_open(BENCH_IMAGE, 0);
+}
+
+// a directory with count entries, returning its inode number
+static int make_big_directory(char *path, int count)
+{
+    char name[64];
+
+    directory_make(path);
+    for (int i = 0; i < count; i++) {
+        sprintf(name, "%s/e%05d", path, i);
+        directory_make(name);
+    }
+    struct inode *in = namei(path);
+    int inode_num = in->inode_num;
+    iput(in);
+    return inode_num;
+}
+
+// ---- microbenchmarks
+
+static void bench_bread(struct run *r)
+{
+    unsigned char block[BLOCK_SIZE];
+
+    fresh_image();
+    srand(1);
+    run_begin(r, "bread");
+    for (int i = 0; i < MICRO_OPS; i++) {
+        // mostly a working set that fits the cache, some misses
+        int block_num = i % 8 == 0 ? 1000 + rand() % 30000 : 1000 + rand() % 48;
+        op_begin(r);
+        bread(block_num, block);
+        op_end(r);
+    }
+    run_end(r);
+    image_close();
+}
+
+static void bench_bwrite(struct run *r)
+{
+    unsigned char block[BLOCK_SIZE];
+
+    fresh_image();
+    memset(block, 0xa5, sizeof(block));
+    srand(2);
+    run_begin(r, "bwrite");
+    for (int i = 0; i < MICRO_OPS; i++) {
+        int block_num = 1000 + rand() % 30000;
+        op_begin(r);
+        bwrite(block_num, block);
+        op_end(r);
+    }
+    // the writes aren't done until they're on the image
+    op_begin(r);
+    bflush();
+    op_end(r);
+    run_end(r);
+    image_close();
+}
+
+static void bench_find_free(struct run *r)
+{
+    static unsigned char map[BLOCK_SIZE];
+
+    // the first half of the map taken, then every other bit
+    memset(map, 0xff, sizeof(map) / 2);
+    for (int i = sizeof(map) / 2; i < (int)sizeof(map); i++)
+        map[i] = 0x55;
+    run_begin(r, "find_free");
+    for (int i = 0; i < MICRO_OPS; i++) {
+        op_begin(r);
+        int bit = find_free(map);
+        op_end(r);
+        if (bit == FAILED)
+            exit(1);
+    }
+    run_end(r);
+}
+
+static void bench_alloc(struct run *r)
+{
+    static int blocks[MICRO_OPS];
+
+    fresh_image();
+    run_begin(r, "alloc");
+    for (int i = 0; i < MICRO_OPS; i++) {
+        op_begin(r);
+        blocks[i] = alloc();
+        op_end(r);
+    }
+    run_end(r);
+    for (int i = 0; i < MICRO_OPS; i++)
+        free_map_free(&block_map, blocks[i]);
+    image_close();
+}
+
+static void bench_ialloc(struct run *r)
+{
+    fresh_image();
+    run_begin(r, "ialloc");
+    for (int i = 0; i < BENCH_INODES - 1; i++) {
+        op_begin(r);
+        struct inode *in = ialloc();
+        op_end(r);
+        if (in == NULL)
+            break;
+        iput(in);
+    }
+    run_end(r);
+    image_close();
+}
+
+static void bench_iget_iput(struct run *r)
+{
+    fresh_image();
+    srand(3);
+    run_begin(r, "iget_iput");
+    for (int i = 0; i < MICRO_OPS; i++) {
+        int inode_num = rand() % BENCH_INODES;
+        op_begin(r);
+        iput(iget(inode_num));
+        op_end(r);
+    }
+    run_end(r);
+    image_close();
+}
+
+static void bench_read_inode(struct run *r)
+{
+    struct inode in;
+
+    fresh_image();
+    srand(4);
+    run_begin(r, "read_inode");
+    for (int i = 0; i < MICRO_OPS; i++) {
+        int inode_num = rand() % BENCH_INODES;
+        op_begin(r);
+        read_inode(&in, inode_num);
+        op_end(r);
+    }
+    run_end(r);
+    image_close();
+}
+
+static void bench_write_inode(struct run *r)
+{
+    fresh_image();
+    srand(5);
+    run_begin(r, "write_inode");
+    for (int i = 0; i < MICRO_OPS; i++) {
+        struct inode *in = iget(1 + rand() % (BENCH_INODES - 1));
+        in->size = i;
+        op_begin(r);
+        write_inode(in);
+        op_end(r);
+        iput(in);
+    }
+    op_begin(r);
+    bflush();
+    op_end(r);
+    run_end(r);
+    image_close();
+}
+
+static void bench_directory_get(struct run *r)
+{
+    struct directory_entry ent;
+
+    fresh_image();
+    int inode_num = make_big_directory("/big", BIG_DIR_ENTRIES);
+    run_begin(r, "directory_get");
+    for (int pass = 0; pass < 5; pass++) {
+        struct directory *dir = directory_open(inode_num);
+        for (;;) {
+            op_begin(r);
+            int status = directory_get(dir, &ent);
+            op_end(r);
+            if (status == -1)
+                break;
+        }
+        directory_close(dir);
+    }
+    run_end(r);
+    image_close();
+}
+
+// ---- macrobenchmarks
+
+static void bench_mkfs(struct run *r)
+{
+    struct mkfs_options options;
+
+    image_open(BENCH_IMAGE, IMAGE_TRUNCATE);
+    mkfs_default_options(&options);
+    options.image_size = BENCH_IMAGE_SIZE;
+    options.inode_count = BENCH_INODES;
+    run_begin(r, "mkfs");
+    for (int i = 0; i < 50; i++) {
+        op_begin(r);
+        mkfs_with_options(&options);
+        op_end(r);
+    }
+    run_end(r);
+    image_close();
+}
+
+static void bench_directory_make(struct run *r)
+{
+    char path[64];
+
+    fresh_image();
+    directory_make("/m");
+    run_begin(r, "directory_make");
+    for (int i = 0; i < MAKE_DIRS; i++) {
+        sprintf(path, "/m/d%05d", i);
+        op_begin(r);
+        directory_make(path);
+        op_end(r);
+    }
+    op_begin(r);
+    image_close();
+    op_end(r);
+    run_end(r);
+}
+
+static void list_big_dir(struct run *r, const char *name, int flags)
+{
+    fresh_image();
+    int inode_num = make_big_directory("/big", BIG_DIR_ENTRIES);
+    // the listing itself goes nowhere
+    int null = open("/dev/null", O_WRONLY);
+
+    run_begin(r, name);
+    for (int i = 0; i < 20; i++) {
+        op_begin(r);
+        ls_with_options(inode_num, flags, null);
+        op_end(r);
+    }
+    run_end(r);
+    close(null);
+    image_close();
+}
+
+static void bench_ls(struct run *r)
+{
+    list_big_dir(r, "ls_big_dir", 0);
+}
+
+// sorted, with every entry's inode looked up
+static void bench_ls_long(struct run *r)
+{
+    list_big_dir(r, "ls_long_big_dir", LS_SORT | LS_LONG);
+}
+
+static void bench_namei_deep(struct run *r)
+{
+    char path[DEEP_LEVELS * 3 + 1] = "";
+
+    fresh_image();
+    for (int i = 0; i < DEEP_LEVELS; i++) {
+        strcat(path, "/d");
+        directory_make(path);
+    }
+    run_begin(r, "namei_deep");
+    for (int i = 0; i < MICRO_OPS / 10; i++) {
+        // every tenth walk starts from an empty dentry cache
+        if (i % 10 == 0)
+            dcache_clear();
+        op_begin(r);
+        struct inode *in = namei(path);
+        op_end(r);
+        if (in == NULL)
+            exit(1);
+        iput(in);
+    }
+    run_end(r);
+    image_close();
+}
+
+struct benchmark {
+    const char *name;
+    void (*run)(struct run *r);
+};
+
+static struct benchmark benchmarks[] = {
+    {"bread", bench_bread},
+    {"bwrite", bench_bwrite},
+    {"find_free", bench_find_free},
+    {"alloc", bench_alloc},
+    {"ialloc", bench_ialloc},
+    {"iget_iput", bench_iget_iput},
+    {"read_inode", bench_read_inode},
+    {"write_inode", bench_write_inode},
+    {"directory_get", bench_directory_get},
+    {"mkfs", bench_mkfs},
+    {"directory_make", bench_directory_make},
+    {"ls_big_dir", bench_ls},
+    {"ls_long_big_dir", bench_ls_long},
+    {"namei_deep", bench_namei_deep},
+};
+
+int main(int argc, char **argv)
+{
+    static long long latency[MAX_OPS];
+    struct run r = {.latency = latency};
+    int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    int names = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0)
+            json = 1;
+        else
+            names++;
+    }
+
+    // what reading /proc/self/io costs, so it isn't charged to the runs
+    unsigned long long first = io_syscalls();
+    io_overhead = io_syscalls() - first;
+
+    for (int b = 0; b < count; b++) {
+        int wanted = names == 0;
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], benchmarks[b].name) == 0)
+                wanted = 1;
+        }
+        if (wanted)
+            benchmarks[b].run(&r);
+    }
+    if (json)
+        printf("%s]\n", printed ? "\n" : "[");
+    unlink(BENCH_IMAGE);
+    return 0;
+}
@@ -1,59 +1,298 @@
 // reading and writing blocks.
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "block.h"
+#include "cache.h"
 #include "image.h"
 #include "free.h"
+#include "async.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 
-// helper function to check block position
+// helper function to check block position. this only computes the
+// byte offset; all transfers are positional so the shared file offset
+// is never moved
 off_t get_block_position(int block_num){
-    off_t offset = block_num * BLOCK_SIZE;
-    off_t block_position = lseek(image_fd, offset, SEEK_SET);
+    off_t block_position = (off_t)block_num * BLOCK_SIZE;
     return block_position;
 }
 
+// read a run of blocks straight from the image, bypassing the cache,
+// with one preadv() per BLOCK_IOV_MAX blocks. blocks past the end of the
+// image read back as zeros
+void block_readv_disk(int block_num, unsigned char **blocks, int count){
+    struct iovec iov[BLOCK_IOV_MAX];
+
+    while (count > 0) {
+        int run = count < BLOCK_IOV_MAX ? count : BLOCK_IOV_MAX;
+        for (int i = 0; i < run; i++) {
+            iov[i].iov_base = blocks[i];
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+        ssize_t read_bytes = preadv(image_fd, iov, run, get_block_position(block_num));
+        if (read_bytes == FAILED) {
+            exit(1);
+        }
+        // zero whatever the short read didn't reach
+        for (int i = 0; i < run; i++) {
+            ssize_t done = read_bytes - (ssize_t)i * BLOCK_SIZE;
+            if (done < 0)
+                done = 0;
+            if (done < BLOCK_SIZE)
+                memset(blocks[i] + done, 0, BLOCK_SIZE - done);
+        }
+        block_num += run;
+        blocks += run;
+        count -= run;
+    }
+}
+
+// write a run of blocks straight to the image, bypassing the cache
+void block_writev_disk(int block_num, unsigned char **blocks, int count){
+    struct iovec iov[BLOCK_IOV_MAX];
+
+    while (count > 0) {
+        int run = count < BLOCK_IOV_MAX ? count : BLOCK_IOV_MAX;
+        for (int i = 0; i < run; i++) {
+            iov[i].iov_base = blocks[i];
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+        ssize_t write_bytes = pwritev(image_fd, iov, run, get_block_position(block_num));
+        if (write_bytes != (ssize_t)run * BLOCK_SIZE) {
+            exit(1);
+        }
+        block_num += run;
+        blocks += run;
+        count -= run;
+    }
+}
+
+// read a block straight from the image, bypassing the cache.
+// blocks past the end of the image read back as zeros
+void block_read_disk(int block_num, unsigned char *block){
+    ssize_t read_bytes = pread(image_fd, block, BLOCK_SIZE, get_block_position(block_num));
+    if (read_bytes == FAILED) {
+        exit(1);
+    }
+    memset(block + read_bytes, 0, BLOCK_SIZE - read_bytes);
+}
+
+// write a block straight to the image, bypassing the cache
+void block_write_disk(int block_num, unsigned char *block){
+    ssize_t write_bytes = pwrite(image_fd, block, BLOCK_SIZE, get_block_position(block_num));
+    if (write_bytes != BLOCK_SIZE){
+        exit(1);
+    }
+}
+
 // allow us to read and write blocks.
 // this function should take a block number and a pointer to a block
 // sized unsigned char buffer to load the data into
 unsigned char *bread(int block_num, unsigned char *block){
-    off_t block_position = get_block_position(block_num);
-    if (block_position == FAILED) {
-        exit(1);
-    }
-    int read_bytes = read(image_fd, block, BLOCK_SIZE);
-    if (read_bytes == FAILED) {
-        exit(1);
+    STATS_START(started);
+    TRACE_BLOCK(TRACE_READ, block_num);
+    if (image_map != NULL) {
+        unsigned char *mapped = image_map_block(block_num, IMAGE_MAP_READ);
+        if (mapped != NULL)
+            memcpy(block, mapped, BLOCK_SIZE);
+        else
+            memset(block, 0, BLOCK_SIZE);
+    } else {
+        cache_read(block_num, block);
     }
+    STATS_END(STAT_BREAD, started, BLOCK_SIZE);
     return block;
 }
 
 // takes a block number and a pointer to the data to write.
+// the write lands in the buffer cache (or the mapping) and reaches the
+// image when the slot is evicted or on the next bflush()
 void bwrite(int block_num, unsigned char *block){
-    off_t block_position = get_block_position(block_num);
-    if (block_position == FAILED) {
-        exit(1);
+    STATS_START(started);
+    TRACE_BLOCK(TRACE_WRITE, block_num);
+    if (image_map != NULL) {
+        memcpy(image_map_block(block_num, IMAGE_MAP_WRITE), block, BLOCK_SIZE);
+        image_map_dirty(block_num);
+    } else if (journal_active()) {
+        journal_write(block_num, block);
+    } else {
+        cache_write(block_num, block);
     }
-    int write_bytes = write(image_fd, block, BLOCK_SIZE);
-    if (write_bytes == FAILED){
-        exit(1);
+    STATS_END(STAT_BWRITE, started, BLOCK_SIZE);
+}
+
+// bwrite() for file data, which isn't journaled. the block stays out
+// of the caller's handle and goes home whenever the cache likes
+void bwrite_data(int block_num, unsigned char *block){
+    STATS_START(started);
+    TRACE_BLOCK(TRACE_WRITE, block_num);
+    if (image_map != NULL) {
+        memcpy(image_map_block(block_num, IMAGE_MAP_WRITE), block, BLOCK_SIZE);
+        image_map_dirty(block_num);
+    } else {
+        cache_write(block_num, block);
+    }
+    STATS_END(STAT_BWRITE, started, BLOCK_SIZE);
+}
+
+// read count contiguous blocks starting at block_num into the
+// buffers in blocks with a single vectored read. cached copies are
+// newer than the image, so they win over what came off the disk
+void breadv(int block_num, unsigned char **blocks, int count){
+    if (image_map != NULL) {
+        for (int i = 0; i < count; i++)
+            bread(block_num + i, blocks[i]);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+        TRACE_BLOCK(TRACE_READ, block_num + i);
+    block_readv_disk(block_num, blocks, count);
+    for (int i = 0; i < count; i++)
+        cache_copy(block_num + i, blocks[i]);
+}
+
+// write count contiguous blocks starting at block_num with a single
+// vectored write. any cached copies are refreshed and marked clean
+void bwritev(int block_num, unsigned char **blocks, int count){
+    if (image_map != NULL) {
+        for (int i = 0; i < count; i++)
+            bwrite(block_num + i, blocks[i]);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+        TRACE_BLOCK(TRACE_WRITE, block_num + i);
+    block_writev_disk(block_num, blocks, count);
+    for (int i = 0; i < count; i++)
+        cache_refresh(block_num + i, blocks[i]);
+}
+
+// hint that count blocks from block_num on are about to be read, so
+// they can be fetched in one go instead of one miss at a time
+void breadahead(int block_num, int count){
+    if (count <= 0)
+        return;
+    if (image_map != NULL) {
+        // nothing to fetch past the end of the image
+        if (image_map_block(block_num + count - 1, IMAGE_MAP_READ) == NULL)
+            return;
+        madvise(image_map + get_block_position(block_num), (size_t)count * BLOCK_SIZE, MADV_WILLNEED);
+        return;
     }
-    // write(image_fd, block, BLOCK_SIZE);
-    return;
+    cache_readahead(block_num, count);
+}
+
+// hint that a scattered set of blocks is about to be read. the ones
+// that aren't cached are fetched together in one batch
+void bprefetch(int *block_nums, int count){
+    if (image_map != NULL) {
+        for (int i = 0; i < count; i++)
+            breadahead(block_nums[i], 1);
+        return;
+    }
+    cache_prefetch(block_nums, count);
+}
+
+// a batch of reads and writes handed to the async engine together and
+// all finished on return. as with breadv() and bwritev(), cached copies
+// win over what's read and are refreshed by what's written
+void bsubmit(struct block_io *ios, int count){
+    if (image_map != NULL) {
+        for (int i = 0; i < count; i++) {
+            if (ios[i].op == BLOCK_IO_READ)
+                breadv(ios[i].block_num, ios[i].blocks, ios[i].count);
+            else
+                bwritev(ios[i].block_num, ios[i].blocks, ios[i].count);
+        }
+        return;
+    }
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < ios[i].count; j++)
+            TRACE_BLOCK(ios[i].op == BLOCK_IO_READ ? TRACE_READ : TRACE_WRITE, ios[i].block_num + j);
+    async_submit(ios, count);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < ios[i].count; j++) {
+            if (ios[i].op == BLOCK_IO_READ)
+                cache_copy(ios[i].block_num + j, ios[i].blocks[j]);
+            else
+                cache_refresh(ios[i].block_num + j, ios[i].blocks[j]);
+        }
+    }
+}
+
+// zero-copy access: return a pointer to the block's bytes in place,
+// either inside the mapping or inside a pinned cache slot. the pointer
+// stays valid until the matching brelse()
+unsigned char *bget(int block_num){
+    TRACE_BLOCK(TRACE_READ, block_num);
+    // the caller may change the block in place, so it's mapped for writing
+    if (image_map != NULL)
+        return image_map_block(block_num, IMAGE_MAP_WRITE);
+    return cache_pin(block_num);
+}
+
+// the block returned by bget() was modified in place
+void bdirty(int block_num){
+    bdirty_data(block_num);
+    if (image_map == NULL)
+        journal_dirty(block_num);
+}
+
+// bdirty() for file data, left out of the caller's handle
+void bdirty_data(int block_num){
+    TRACE_BLOCK(TRACE_WRITE, block_num);
+    if (image_map != NULL)
+        image_map_dirty(block_num);
+    else
+        cache_mark_dirty(block_num);
+}
+
+// done with a block returned by bget()
+void brelse(int block_num){
+    if (image_map == NULL)
+        cache_unpin(block_num);
+}
+
+// sync point: push every dirty block out to the image
+void bflush(void){
+    if (image_map != NULL)
+        image_map_sync();
+    else
+        cache_flush();
 }
 
 // allocate a previous-free data block from the block map
 int alloc(void){
-   unsigned char block[BLOCK_SIZE];
-   bread(FREE_DATA, block);
-   int free_bit = find_free(block);
-   if (free_bit != FAILED) {
-        set_free(block, free_bit, 1);
-        bwrite(FREE_DATA, block);
-        
-        return free_bit;
-   } else {
-        return FAILED;
-   }
-}
\ No newline at end of file
+    return alloc_near(FAILED);
+}
+
+// allocate a data block as close after goal as there's one free, so
+// blocks used together end up together
+int alloc_near(int goal){
+    STATS_START(started);
+    int block_num = free_map_alloc_near(&block_map, goal);
+    STATS_END(STAT_ALLOC, started, 0);
+    return block_num;
+}
+
+// allocate count data blocks into out in one pass over the block map.
+// returns count, or FAILED without allocating anything
+int alloc_n(int count, int *out){
+    return free_map_alloc_n(&block_map, count, out);
+}
+
+// allocate count contiguous data blocks, returning the first one
+int alloc_run(int count){
+    return free_map_alloc_run(&block_map, count);
+}
+
+// allocate count contiguous data blocks, the first free run at or
+// after goal in goal's group if there is one
+int alloc_run_near(int count, int goal){
+    return free_map_alloc_run_near(&block_map, count, goal);
+}
@@ -3,13 +3,36 @@
 
 #include <unistd.h>
 
+#define FREE_INODE 1
 #define FREE_DATA 2
 #define BLOCK_SIZE 4096
 #define FAILED -1
+#define BLOCK_IOV_MAX 1024
+
+struct block_io;
 
 unsigned char *bread(int block_num, unsigned char *block);
 void bwrite(int block_num, unsigned char *block);
+void bwrite_data(int block_num, unsigned char *block);
+void breadv(int block_num, unsigned char **blocks, int count);
+void bwritev(int block_num, unsigned char **blocks, int count);
+void breadahead(int block_num, int count);
+void bprefetch(int *block_nums, int count);
+void bsubmit(struct block_io *ios, int count);
+unsigned char *bget(int block_num);
+void bdirty(int block_num);
+void bdirty_data(int block_num);
+void brelse(int block_num);
+void bflush(void);
 int alloc(void);
+int alloc_near(int goal);
+int alloc_run(int count);
+int alloc_run_near(int count, int goal);
+int alloc_n(int count, int *out);
 off_t get_block_position(int block_num);
+void block_read_disk(int block_num, unsigned char *block);
+void block_write_disk(int block_num, unsigned char *block);
+void block_readv_disk(int block_num, unsigned char **blocks, int count);
+void block_writev_disk(int block_num, unsigned char **blocks, int count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,549 @@
+// write-back lru buffer cache that sits underneath bread() and bwrite()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "block.h"
+#include "cache.h"
+#include "async.h"
+
+static struct cache_slot *slots = NULL;
+static unsigned char *slot_data = NULL;
+static int *hash_heads = NULL;
+static int slot_count = 0;
+static int hash_mask = 0;
+
+// most recently used slot at the head, eviction candidate at the tail
+static int lru_head = CACHE_EMPTY;
+static int lru_tail = CACHE_EMPTY;
+
+static struct cache_stats stats = {0};
+
+// dirty blocks of journal transactions newer than this aren't in the
+// log yet, so they must not be written home
+static unsigned int committed_tid = 0;
+
+// one lock covers the slots, the hash and the lru list. callers that
+// keep a pointer into a slot past a call pin it first
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cache_flush_locked(void);
+static void cache_invalidate_locked(void);
+
+static int hash_block(int block_num)
+{
+    return (unsigned int)block_num * 2654435761u & hash_mask;
+}
+
+static void lru_unlink(int i)
+{
+    struct cache_slot *s = &slots[i];
+
+    if (s->lru_prev != CACHE_EMPTY)
+        slots[s->lru_prev].lru_next = s->lru_next;
+    else
+        lru_head = s->lru_next;
+
+    if (s->lru_next != CACHE_EMPTY)
+        slots[s->lru_next].lru_prev = s->lru_prev;
+    else
+        lru_tail = s->lru_prev;
+}
+
+static void lru_push_front(int i)
+{
+    slots[i].lru_prev = CACHE_EMPTY;
+    slots[i].lru_next = lru_head;
+    if (lru_head != CACHE_EMPTY)
+        slots[lru_head].lru_prev = i;
+    lru_head = i;
+    if (lru_tail == CACHE_EMPTY)
+        lru_tail = i;
+}
+
+static void hash_remove(int i)
+{
+    int *link = &hash_heads[hash_block(slots[i].block_num)];
+
+    while (*link != CACHE_EMPTY) {
+        if (*link == i) {
+            *link = slots[i].hash_next;
+            return;
+        }
+        link = &slots[*link].hash_next;
+    }
+}
+
+static void hash_insert(int i)
+{
+    int bucket = hash_block(slots[i].block_num);
+
+    slots[i].hash_next = hash_heads[bucket];
+    hash_heads[bucket] = i;
+}
+
+// a dirty slot that has to wait for its transaction to commit
+static int cache_held(struct cache_slot *s)
+{
+    return s->dirty && s->tid > committed_tid;
+}
+
+static int cache_find(int block_num)
+{
+    for (int i = hash_heads[hash_block(block_num)]; i != CACHE_EMPTY; i = slots[i].hash_next) {
+        if (slots[i].block_num == block_num)
+            return i;
+    }
+    return CACHE_EMPTY;
+}
+
+static int cache_setup(int count)
+{
+    if (slots != NULL) {
+        // pinned blocks are in use and can't be moved
+        for (int i = 0; i < slot_count; i++) {
+            if (slots[i].pins > 0)
+                return FAILED;
+        }
+        cache_flush_locked();
+        free(slots);
+        free(slot_data);
+        free(hash_heads);
+    }
+
+    int buckets = 1;
+    while (buckets < count * 2)
+        buckets <<= 1;
+
+    slots = malloc(sizeof(struct cache_slot) * count);
+    slot_data = malloc((size_t)count * BLOCK_SIZE);
+    hash_heads = malloc(sizeof(int) * buckets);
+    if (slots == NULL || slot_data == NULL || hash_heads == NULL)
+        exit(1);
+
+    slot_count = count;
+    hash_mask = buckets - 1;
+
+    for (int i = 0; i < count; i++)
+        slots[i].data = slot_data + (size_t)i * BLOCK_SIZE;
+
+    cache_invalidate_locked();
+
+    return 0;
+}
+
+// set up the cache with the given number of 4 KiB slots. anything
+// already cached is written back first
+int cache_init(int count)
+{
+    if (count <= 0)
+        return FAILED;
+
+    pthread_mutex_lock(&cache_lock);
+    int status = cache_setup(count);
+    pthread_mutex_unlock(&cache_lock);
+    return status;
+}
+
+int cache_slot_count(void)
+{
+    return slot_count;
+}
+
+static void cache_invalidate_locked(void)
+{
+    if (slots == NULL)
+        return;
+
+    for (int i = 0; i <= hash_mask; i++)
+        hash_heads[i] = CACHE_EMPTY;
+
+    // every slot starts empty and sits on the lru list so the first
+    // misses fill slots in order
+    lru_head = lru_tail = CACHE_EMPTY;
+    committed_tid = 0;
+    for (int i = 0; i < slot_count; i++) {
+        slots[i].block_num = CACHE_EMPTY;
+        slots[i].dirty = 0;
+        slots[i].pins = 0;
+        slots[i].tid = 0;
+        slots[i].hash_next = CACHE_EMPTY;
+        lru_push_front(i);
+    }
+}
+
+// drop every cached block without writing anything back
+void cache_invalidate(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_invalidate_locked();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// take the least recently used unpinned slot, writing it back if
+// it's dirty
+static int cache_evict(void)
+{
+    int i = lru_tail;
+    while (i != CACHE_EMPTY && (slots[i].pins > 0 || cache_held(&slots[i])))
+        i = slots[i].lru_prev;
+    // every slot is pinned, the cache is too small for the caller
+    if (i == CACHE_EMPTY)
+        exit(1);
+
+    struct cache_slot *s = &slots[i];
+
+    if (s->block_num != CACHE_EMPTY) {
+        if (s->dirty) {
+            block_write_disk(s->block_num, s->data);
+            stats.writebacks++;
+        }
+        hash_remove(i);
+        stats.evictions++;
+    }
+    s->block_num = CACHE_EMPTY;
+    s->dirty = 0;
+    s->tid = 0;
+
+    return i;
+}
+
+// find the slot for block_num, claiming one if it isn't cached.
+// load says whether a miss has to fetch the old contents from disk
+static struct cache_slot *cache_get(int block_num, int load)
+{
+    if (slots == NULL)
+        cache_setup(CACHE_DEFAULT_SLOTS);
+
+    int i = cache_find(block_num);
+
+    if (i != CACHE_EMPTY) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        i = cache_evict();
+        slots[i].block_num = block_num;
+        hash_insert(i);
+        if (load)
+            block_read_disk(block_num, slots[i].data);
+    }
+
+    lru_unlink(i);
+    lru_push_front(i);
+
+    return &slots[i];
+}
+
+// copy the contents of block_num into block, read from disk on a miss
+void cache_read(int block_num, unsigned char *block)
+{
+    pthread_mutex_lock(&cache_lock);
+    memcpy(block, cache_get(block_num, 1)->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// a full-block write of block_num. all of the block is replaced, so a
+// miss doesn't read the old contents
+void cache_write(int block_num, unsigned char *block)
+{
+    pthread_mutex_lock(&cache_lock);
+    struct cache_slot *s = cache_get(block_num, 0);
+
+    memcpy(s->data, block, BLOCK_SIZE);
+    s->dirty = 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// copy block_num into block if it's cached. returns 1 if it was, 0 if
+// not. doesn't count as a use for lru purposes. a copy rather than a
+// pointer into the slot, which another thread may reuse as soon as the
+// lock is dropped; to look at a block in place, pin it with bget()
+int cache_copy(int block_num, unsigned char *block)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i = slots == NULL ? CACHE_EMPTY : cache_find(block_num);
+
+    if (i != CACHE_EMPTY)
+        memcpy(block, slots[i].data, BLOCK_SIZE);
+    pthread_mutex_unlock(&cache_lock);
+    return i != CACHE_EMPTY;
+}
+
+// block_num was just written to the image behind the cache's back, so
+// bring a cached copy up to date and mark it clean
+void cache_refresh(int block_num, unsigned char *block)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i = slots == NULL ? CACHE_EMPTY : cache_find(block_num);
+
+    if (i != CACHE_EMPTY) {
+        memcpy(slots[i].data, block, BLOCK_SIZE);
+        slots[i].dirty = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// cached contents of block_num, read on a miss and pinned so the slot
+// can't be evicted until cache_unpin()
+unsigned char *cache_pin(int block_num)
+{
+    pthread_mutex_lock(&cache_lock);
+    struct cache_slot *s = cache_get(block_num, 1);
+
+    s->pins++;
+    pthread_mutex_unlock(&cache_lock);
+    return s->data;
+}
+
+void cache_unpin(int block_num)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i = cache_find(block_num);
+
+    if (i != CACHE_EMPTY && slots[i].pins > 0)
+        slots[i].pins--;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// a pinned block was modified in place
+void cache_mark_dirty(int block_num)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i = cache_find(block_num);
+
+    if (i != CACHE_EMPTY)
+        slots[i].dirty = 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+// claim slots for whichever of the count blocks (sorted, no repeats)
+// aren't cached and read them in as one batch, a request per stretch
+// of adjacent blocks. at most half the cache is used so prefetching
+// can't push out everything else
+static void cache_prefetch_locked(int *block_nums, int count)
+{
+    if (slots == NULL)
+        cache_setup(CACHE_DEFAULT_SLOTS);
+
+    int limit = slot_count / 2;
+    int claimed[limit > 0 ? limit : 1];
+    unsigned char *data[limit > 0 ? limit : 1];
+    struct block_io ios[limit > 0 ? limit : 1];
+    int claimed_count = 0;
+    int io_count = 0;
+
+    for (int i = 0; i < count && claimed_count < limit; i++) {
+        if (cache_find(block_nums[i]) != CACHE_EMPTY)
+            continue;
+        int slot = cache_evict();
+        slots[slot].block_num = block_nums[i];
+        hash_insert(slot);
+        lru_unlink(slot);
+        lru_push_front(slot);
+        // held until the batch is in so later evictions pass it by
+        slots[slot].pins++;
+        claimed[claimed_count] = slot;
+        data[claimed_count] = slots[slot].data;
+
+        if (io_count > 0 &&
+            ios[io_count - 1].block_num + ios[io_count - 1].count == block_nums[i]) {
+            ios[io_count - 1].count++;
+        } else {
+            ios[io_count].op = BLOCK_IO_READ;
+            ios[io_count].block_num = block_nums[i];
+            ios[io_count].count = 1;
+            ios[io_count].blocks = &data[claimed_count];
+            io_count++;
+        }
+        claimed_count++;
+    }
+
+    async_submit(ios, io_count);
+    for (int i = 0; i < claimed_count; i++)
+        slots[claimed[i]].pins--;
+    stats.readahead += claimed_count;
+}
+
+// pull count blocks from block_num on into the cache before they're
+// asked for. each stretch that isn't cached yet comes in with a single
+// vectored read
+void cache_readahead(int block_num, int count)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (slots == NULL)
+        cache_setup(CACHE_DEFAULT_SLOTS);
+    if (count > slot_count / 2)
+        count = slot_count / 2;
+
+    int block_nums[count > 0 ? count : 1];
+    for (int i = 0; i < count; i++)
+        block_nums[i] = block_num + i;
+    cache_prefetch_locked(block_nums, count);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// the same for a scattered set of blocks, in any order and possibly
+// with repeats. the misses are read in one batch through the async
+// engine, so the disk sees them all at once
+void cache_prefetch(int *block_nums, int count)
+{
+    if (count <= 0)
+        return;
+
+    int *sorted = malloc(sizeof(int) * count);
+    if (sorted == NULL)
+        exit(1);
+    memcpy(sorted, block_nums, sizeof(int) * count);
+    qsort(sorted, count, sizeof(int), compare_ints);
+
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || sorted[unique - 1] != sorted[i])
+            sorted[unique++] = sorted[i];
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    cache_prefetch_locked(sorted, unique);
+    pthread_mutex_unlock(&cache_lock);
+    free(sorted);
+}
+
+static int compare_slot_blocks(const void *a, const void *b)
+{
+    int x = slots[*(const int *)a].block_num;
+    int y = slots[*(const int *)b].block_num;
+
+    return (x > y) - (x < y);
+}
+
+static void cache_flush_locked(void)
+{
+    if (slots == NULL)
+        return;
+
+    int *dirty = malloc(sizeof(int) * slot_count);
+    int dirty_count = 0;
+
+    if (dirty == NULL)
+        exit(1);
+
+    for (int i = 0; i < slot_count; i++) {
+        if (slots[i].block_num != CACHE_EMPTY && slots[i].dirty && !cache_held(&slots[i]))
+            dirty[dirty_count++] = i;
+    }
+
+    qsort(dirty, dirty_count, sizeof(int), compare_slot_blocks);
+
+    unsigned char **run = malloc(sizeof(unsigned char *) * (dirty_count + 1));
+    struct block_io *ios = malloc(sizeof(struct block_io) * (dirty_count + 1));
+    if (run == NULL || ios == NULL)
+        exit(1);
+
+    int io_count = 0;
+    int i = 0;
+    while (i < dirty_count) {
+        int start = slots[dirty[i]].block_num;
+        int len = 0;
+        while (i + len < dirty_count && slots[dirty[i + len]].block_num == start + len) {
+            run[i + len] = slots[dirty[i + len]].data;
+            slots[dirty[i + len]].dirty = 0;
+            len++;
+        }
+        ios[io_count].op = BLOCK_IO_WRITE;
+        ios[io_count].block_num = start;
+        ios[io_count].count = len;
+        ios[io_count].blocks = run + i;
+        io_count++;
+        stats.writebacks += len;
+        i += len;
+    }
+    async_submit(ios, io_count);
+
+    free(ios);
+    free(run);
+    free(dirty);
+}
+
+// tag a cached block as dirtied by journal transaction tid, which holds
+// it in the cache until the transaction commits. returns the tid it had
+// before, or FAILED if it isn't cached
+int cache_journal(int block_num, unsigned int tid)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i = slots == NULL ? CACHE_EMPTY : cache_find(block_num);
+    int previous = FAILED;
+
+    if (i != CACHE_EMPTY) {
+        previous = slots[i].tid;
+        slots[i].tid = tid;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return previous;
+}
+
+// cache_write() and cache_journal() in one step, so the block can't be
+// written home in between
+int cache_write_journaled(int block_num, unsigned char *block, unsigned int tid)
+{
+    pthread_mutex_lock(&cache_lock);
+    struct cache_slot *s = cache_get(block_num, 0);
+    int previous = s->tid;
+
+    memcpy(s->data, block, BLOCK_SIZE);
+    s->dirty = 1;
+    s->tid = tid;
+    pthread_mutex_unlock(&cache_lock);
+    return previous;
+}
+
+// transactions up to tid are in the log, their blocks may go home
+void cache_journal_committed(unsigned int tid)
+{
+    pthread_mutex_lock(&cache_lock);
+    committed_tid = tid;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// block_num is dirty for a transaction that isn't committed yet, so
+// it can't go home. returns 1 if so, 0 if not
+int cache_journal_held(int block_num)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i = slots == NULL ? CACHE_EMPTY : cache_find(block_num);
+    int held = i != CACHE_EMPTY && cache_held(&slots[i]);
+    pthread_mutex_unlock(&cache_lock);
+    return held;
+}
+
+// write every dirty slot back to the image. runs of adjacent dirty
+// blocks become one vectored write each, and all the runs are handed to
+// the async engine as a single batch. blocks of uncommitted journal
+// transactions stay behind
+void cache_flush(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_flush_locked();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_get_stats(struct cache_stats *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_reset_stats(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&cache_lock);
+}
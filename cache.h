@@ -0,0 +1,48 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_DEFAULT_SLOTS 64
+#define CACHE_EMPTY -1
+
+// one cached 4 KiB block. slots live in a fixed array and are
+// linked by index into a hash chain and the lru list
+struct cache_slot {
+    int block_num;
+    int dirty;
+    int pins;
+    unsigned int tid;  // journal transaction that last dirtied it, 0 if none
+    int lru_prev;
+    int lru_next;
+    int hash_next;
+    unsigned char *data;
+};
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+    unsigned long readahead;
+};
+
+int cache_init(int slots);
+int cache_slot_count(void);
+void cache_read(int block_num, unsigned char *block);
+void cache_write(int block_num, unsigned char *block);
+int cache_copy(int block_num, unsigned char *block);
+unsigned char *cache_pin(int block_num);
+void cache_unpin(int block_num);
+void cache_mark_dirty(int block_num);
+void cache_refresh(int block_num, unsigned char *block);
+void cache_readahead(int block_num, int count);
+void cache_prefetch(int *block_nums, int count);
+void cache_flush(void);
+int cache_journal(int block_num, unsigned int tid);
+int cache_write_journaled(int block_num, unsigned char *block, unsigned int tid);
+void cache_journal_committed(unsigned int tid);
+int cache_journal_held(int block_num);
+void cache_invalidate(void);
+void cache_get_stats(struct cache_stats *stats);
+void cache_reset_stats(void);
+
+#endif
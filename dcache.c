@@ -0,0 +1,198 @@
+// dentry cache: remembers what namei() found in each directory,
+// including names that weren't there
+#include <string.h>
+#include <pthread.h>
+#include "dcache.h"
+
+#define DCACHE_EMPTY -1
+#define DCACHE_BUCKETS (DCACHE_SIZE * 2)
+
+static struct dentry dentries[DCACHE_SIZE];
+static int hash_heads[DCACHE_BUCKETS];
+static int lru_head = DCACHE_EMPTY;
+static int lru_tail = DCACHE_EMPTY;
+static int ready = 0;
+
+static struct dcache_stats stats = {0};
+
+// one lock for the whole cache, every operation is a short hash probe
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// fnv-1a over the name, mixed with the parent inode number
+static int dcache_hash(int parent, const char *name)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)parent * 2654435761u;
+
+    for (int i = 0; i < DCACHE_NAME_LEN && name[i] != '\0'; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h % DCACHE_BUCKETS;
+}
+
+static void lru_unlink(int i)
+{
+    struct dentry *d = &dentries[i];
+
+    if (d->lru_prev != DCACHE_EMPTY)
+        dentries[d->lru_prev].lru_next = d->lru_next;
+    else
+        lru_head = d->lru_next;
+
+    if (d->lru_next != DCACHE_EMPTY)
+        dentries[d->lru_next].lru_prev = d->lru_prev;
+    else
+        lru_tail = d->lru_prev;
+}
+
+static void lru_push(int i, int front)
+{
+    struct dentry *d = &dentries[i];
+
+    if (front) {
+        d->lru_prev = DCACHE_EMPTY;
+        d->lru_next = lru_head;
+        if (lru_head != DCACHE_EMPTY)
+            dentries[lru_head].lru_prev = i;
+        lru_head = i;
+        if (lru_tail == DCACHE_EMPTY)
+            lru_tail = i;
+    } else {
+        d->lru_next = DCACHE_EMPTY;
+        d->lru_prev = lru_tail;
+        if (lru_tail != DCACHE_EMPTY)
+            dentries[lru_tail].lru_next = i;
+        lru_tail = i;
+        if (lru_head == DCACHE_EMPTY)
+            lru_head = i;
+    }
+}
+
+static void hash_remove(int i)
+{
+    int *link = &hash_heads[dcache_hash(dentries[i].parent, dentries[i].name)];
+
+    while (*link != DCACHE_EMPTY) {
+        if (*link == i) {
+            *link = dentries[i].hash_next;
+            return;
+        }
+        link = &dentries[*link].hash_next;
+    }
+}
+
+static void dcache_reset(void)
+{
+    for (int i = 0; i < DCACHE_BUCKETS; i++)
+        hash_heads[i] = DCACHE_EMPTY;
+
+    lru_head = lru_tail = DCACHE_EMPTY;
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dentries[i].parent = DCACHE_EMPTY;
+        lru_push(i, 0);
+    }
+    ready = 1;
+}
+
+// forget everything, e.g. when the image is closed or reformatted
+void dcache_clear(void)
+{
+    pthread_mutex_lock(&dcache_lock);
+    dcache_reset();
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// names this long aren't cached, lookups of them always go to the
+// directory. they're rare and would make every entry bigger
+static int too_long(const char *name)
+{
+    return strnlen(name, DCACHE_NAME_LEN) == DCACHE_NAME_LEN;
+}
+
+static int dcache_find(int parent, const char *name)
+{
+    if (!ready)
+        dcache_reset();
+    if (too_long(name))
+        return DCACHE_EMPTY;
+
+    for (int i = hash_heads[dcache_hash(parent, name)]; i != DCACHE_EMPTY; i = dentries[i].hash_next) {
+        if (dentries[i].parent == parent &&
+            strncmp(dentries[i].name, name, DCACHE_NAME_LEN) == 0)
+            return i;
+    }
+    return DCACHE_EMPTY;
+}
+
+// the cached child inode for name in parent, DCACHE_NEGATIVE if the
+// name is known to be missing, or DCACHE_MISS if nothing is cached
+int dcache_lookup(int parent, const char *name)
+{
+    pthread_mutex_lock(&dcache_lock);
+    int i = dcache_find(parent, name);
+
+    if (i == DCACHE_EMPTY) {
+        stats.misses++;
+        pthread_mutex_unlock(&dcache_lock);
+        return DCACHE_MISS;
+    }
+
+    lru_unlink(i);
+    lru_push(i, 1);
+
+    if (dentries[i].child == DCACHE_NEGATIVE)
+        stats.negative_hits++;
+    else
+        stats.hits++;
+    int child = dentries[i].child;
+    pthread_mutex_unlock(&dcache_lock);
+    return child;
+}
+
+// remember that name in parent is child, or DCACHE_NEGATIVE for missing
+void dcache_add(int parent, const char *name, int child)
+{
+    if (too_long(name))
+        return;
+    pthread_mutex_lock(&dcache_lock);
+    int i = dcache_find(parent, name);
+
+    if (i == DCACHE_EMPTY) {
+        // reuse the least recently used entry
+        i = lru_tail;
+        if (dentries[i].parent != DCACHE_EMPTY)
+            hash_remove(i);
+        dentries[i].parent = parent;
+        strncpy(dentries[i].name, name, DCACHE_NAME_LEN);
+        int bucket = dcache_hash(parent, name);
+        dentries[i].hash_next = hash_heads[bucket];
+        hash_heads[bucket] = i;
+    }
+
+    dentries[i].child = child;
+    lru_unlink(i);
+    lru_push(i, 1);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// name in parent changed on disk, drop whatever was cached for it
+void dcache_invalidate(int parent, const char *name)
+{
+    pthread_mutex_lock(&dcache_lock);
+    int i = dcache_find(parent, name);
+
+    if (i != DCACHE_EMPTY) {
+        hash_remove(i);
+        dentries[i].parent = DCACHE_EMPTY;
+        lru_unlink(i);
+        lru_push(i, 0);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_get_stats(struct dcache_stats *out)
+{
+    pthread_mutex_lock(&dcache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,33 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#define DCACHE_SIZE 1024
+#define DCACHE_NAME_LEN 16
+
+// dcache_lookup() results besides an inode number
+#define DCACHE_NEGATIVE -1  // name is known not to exist
+#define DCACHE_MISS -2      // nothing cached, scan the directory
+
+// one cached (parent inode, name) -> child inode mapping
+struct dentry {
+    int parent;
+    int child;
+    char name[DCACHE_NAME_LEN];
+    int hash_next;
+    int lru_prev;
+    int lru_next;
+};
+
+struct dcache_stats {
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+};
+
+int dcache_lookup(int parent, const char *name);
+void dcache_add(int parent, const char *name, int child);
+void dcache_invalidate(int parent, const char *name);
+void dcache_clear(void);
+void dcache_get_stats(struct dcache_stats *stats);
+
+#endif
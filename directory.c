@@ -6,6 +6,14 @@
 #include "block.h"
 #include "mkfs.h"
 #include "pack.h"
+#include "free.h"
+#include "dcache.h"
+#include "dirindex.h"
+#include "extent.h"
+#include "superblock.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 
 
@@ -62,37 +70,441 @@ struct directory *directory_open(int inode_num)
     // set the inode pointer to point to the inode returned by iget()
     open_directory->inode = directory_inode;
     open_directory->offset = 0;
+    open_directory->block_num = -1;
+    open_directory->block = NULL;
     // return the point to the struct
     return open_directory;
 }
 
-// reading a dictionary
-int directory_get(struct directory *dir, struct directory_entry *ent)
+// longest name an entry can have on the open image
+unsigned int directory_name_max(void)
 {
-    // check the offset against the size of directory
-    unsigned int offset = dir->offset;
-    unsigned int size = dir->inode->size;
-    // if offset greater than or equal to directory size, return -1 to
-    // indicate we are at the end
-    if (offset >= size) {
-        return -1;
+    if (sb.features & FEATURE_VARIABLE_DIRENTS)
+        return DIRECTORY_NAME_MAX;
+    return FIXED_NAME_MAX;
+}
+
+// bytes an entry for name takes up in a directory
+static unsigned int directory_entry_len(char *name)
+{
+    if (sb.features & FEATURE_VARIABLE_DIRENTS)
+        return DIRENT_LEN(strlen(name));
+    return FIXED_LENGTH_RECORD_SIZE;
+}
+
+// write an entry for inode_num under name at record, in the open
+// image's format. returns the record's length
+unsigned int directory_entry_put(unsigned char *record, int inode_num, char *name)
+{
+    unsigned int len = directory_entry_len(name);
+
+    memset(record, 0, len);
+    write_u16(record, inode_num);
+    if (sb.features & FEATURE_VARIABLE_DIRENTS) {
+        write_u16(record + DIRENT_REC_LEN_OFFSET, len);
+        write_u8(record + DIRENT_NAME_LEN_OFFSET, strlen(name));
+        memcpy(record + DIRENT_NAME_OFFSET, name, strlen(name));
+    } else {
+        strcpy((char *)record + FILE_OFFSET, name);
+    }
+    return len;
+}
+
+// bytes from offset to the end of its block or of the directory,
+// whichever comes first. no record runs past either
+static unsigned int directory_room(struct inode *dir, unsigned int offset)
+{
+    unsigned int room = BLOCK_SIZE - offset % BLOCK_SIZE;
+
+    if (offset >= dir->size)
+        return 0;
+    if (room > dir->size - offset)
+        room = dir->size - offset;
+    return room;
+}
+
+// parse the entry at record, which has room bytes to itself at most.
+// returns the distance to the next one, or 0 if the record is corrupt:
+// a variable length one claiming to be shorter than its name, or longer
+// than its room. the entry then has no name, so it matches nothing
+static unsigned int directory_entry_get(unsigned char *record, unsigned int room, struct directory_entry *ent)
+{
+    ent->inode_num = 0;
+    ent->name[0] = '\0';
+    if (sb.features & FEATURE_VARIABLE_DIRENTS) {
+        if (room < DIRENT_NAME_OFFSET)
+            return 0;
+        unsigned int rec_len = read_u16(record + DIRENT_REC_LEN_OFFSET);
+        unsigned int name_len = read_u8(record + DIRENT_NAME_LEN_OFFSET);
+        if (rec_len == 0 || rec_len < DIRENT_LEN(name_len) || rec_len > room)
+            return 0;
+        ent->inode_num = read_u16(record);
+        memcpy(ent->name, record + DIRENT_NAME_OFFSET, name_len);
+        ent->name[name_len] = '\0';
+        return rec_len;
+    }
+    if (room < FIXED_LENGTH_RECORD_SIZE)
+        return 0;
+    ent->inode_num = read_u16(record);
+    memcpy(ent->name, record + FILE_OFFSET, FIXED_LENGTH_RECORD_SIZE - FILE_OFFSET);
+    ent->name[FIXED_LENGTH_RECORD_SIZE - FILE_OFFSET] = '\0';
+    return FIXED_LENGTH_RECORD_SIZE;
+}
+
+// read the entry that starts offset bytes into the directory dir.
+// returns the distance to the next one, 0 if the record is corrupt
+unsigned int directory_entry_at(struct inode *dir, unsigned int offset, struct directory_entry *ent)
+{
+    unsigned int room = directory_room(dir, offset);
+
+    // an offset past the end, from a damaged index say, has no block
+    // to read and is as bad as a corrupt record
+    if (room == 0) {
+        return directory_entry_get(dir->inline_buf, 0, ent);
+    }
+    // a small directory's entries are right there in its inode
+    if (dir->inline_data) {
+        return directory_entry_get(dir->inline_buf + offset, room, ent);
     }
     // computer the block in the directory we need to read
-    int data_block_index = offset / BLOCK_SIZE;
-    // from project spec
-    short data_block_num = dir->inode->block_ptr[data_block_index] / BLOCK_SIZE;
-    // read to the appropriate data block before giving it to bread()
-    unsigned char block[BLOCK_SIZE];
-    bread(data_block_num, block);
+    int data_block_num = bmap(dir, offset / BLOCK_SIZE, NULL);
+    // look at the data block in place rather than copying it out
+    unsigned char *block = bget(data_block_num);
     // Calculate the offset within the block
     int offset_in_block = offset % BLOCK_SIZE;
-    // read to extract the inode number and store it in ent->inode_num
-    ent->inode_num = read_u16(block + offset_in_block);
-    // copy the file name and store it in ent-> name
-    strcpy(ent->name, (char *)block + FILE_OFFSET);
+    unsigned int len = directory_entry_get(block + offset_in_block, room, ent);
+    brelse(data_block_num);
+    return len;
+}
+
+// make sure the data block holding offset is the one the directory
+// has in hand, swapping blocks only when we cross into a new one.
+// the next directory_get() finds its block again from the offset
+static unsigned char *directory_block_for(struct directory *dir, unsigned int offset)
+{
+    // an inline directory has no block to hold. it only ever moves out
+    // to a block, so one in hand is never stale
+    if (dir->inode->inline_data) {
+        return dir->inode->inline_buf;
+    }
+    int data_block_num = bmap(dir->inode, offset / BLOCK_SIZE, NULL);
+
+    if (dir->block_num != data_block_num) {
+        if (dir->block != NULL) {
+            brelse(dir->block_num);
+        }
+        dir->block = bget(data_block_num);
+        dir->block_num = data_block_num;
+    }
+    return dir->block;
+}
+
+// let go of the block in hand. a call never returns with one pinned:
+// enough open directories would otherwise pin the whole cache
+static void directory_release(struct directory *dir)
+{
+    if (dir->block != NULL) {
+        brelse(dir->block_num);
+    }
+    dir->block = NULL;
+    dir->block_num = -1;
+}
+
+// a scan is about to read the whole directory, so ask for all of its
+// blocks at once. the caller holds the directory's lock
+static void directory_prefetch(struct inode *dir)
+{
+    unsigned int blocks = (dir->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (blocks <= 1)
+        return;
+
+    int *block_nums = malloc(sizeof(int) * blocks);
+    if (block_nums == NULL)
+        exit(1);
+    unsigned int got = 0;
+    while (got < blocks) {
+        unsigned int run;
+        int physical = bmap(dir, got, &run);
+        if (physical == FAILED)
+            break;
+        for (unsigned int i = 0; i < run && got < blocks; i++)
+            block_nums[got++] = physical + i;
+    }
+    bprefetch(block_nums, got);
+    free(block_nums);
+}
 
-    // fixed to increment offset
-    dir->offset = offset + FIXED_LENGTH_RECORD_SIZE;
+// pull one entry out of the directory's current block. returns the
+// length of its record, or 0 for a corrupt one, which ends the scan
+static unsigned int directory_next(struct directory *dir, struct directory_entry *ent)
+{
+    unsigned char *block = directory_block_for(dir, dir->offset);
+    unsigned int len = directory_entry_get(block + dir->offset % BLOCK_SIZE,
+                                           directory_room(dir->inode, dir->offset), ent);
+
+    dir->offset = len > 0 ? dir->offset + len : dir->inode->size;
+    return len;
+}
+
+// reading a dictionary
+int directory_get(struct directory *dir, struct directory_entry *ent)
+{
+    unsigned int len = 0;
+
+    STATS_START(started);
+    TRACE_ENTER(TRACE_OP_DIRECTORY_GET);
+    inode_lock_shared(dir->inode);
+    // nothing is read once offset reaches the directory size
+    if (dir->offset < dir->inode->size) {
+        len = directory_next(dir, ent);
+    }
+    directory_release(dir);
+    inode_unlock(dir->inode);
+    TRACE_LEAVE();
+    STATS_END(STAT_DIRECTORY_GET, started, len);
+
+    // records are never empty, so nothing read means we are at the end,
+    // or at a corrupt record that ended the scan
+    return len > 0 ? 0 : -1;
+}
+
+// fill ents with up to max entries, getdents style. returns how many
+// were read, 0 at the end of the directory
+int directory_get_batch(struct directory *dir, struct directory_entry *ents, int max)
+{
+    int count = 0;
+
+    TRACE_ENTER(TRACE_OP_DIRECTORY_GET);
+    inode_lock_shared(dir->inode);
+    if (dir->offset == 0)
+        directory_prefetch(dir->inode);
+    while (count < max && dir->offset < dir->inode->size) {
+        if (directory_next(dir, &ents[count]) == 0) {
+            break;
+        }
+        count++;
+    }
+    directory_release(dir);
+    inode_unlock(dir->inode);
+    TRACE_LEAVE();
+    return count;
+}
+
+// search dir for name, which the caller has locked, and remember the
+// answer in the dentry cache. returns the inode number or -1
+int directory_find(struct inode *dir, char *name)
+{
+    int found = DCACHE_NEGATIVE;
+
+    if (dir->index_block != 0) {
+        // big directories go straight to the right entry
+        found = dirindex_lookup(dir, name);
+    } else {
+        struct directory scan = {dir, 0, -1, NULL};
+        struct directory_entry ent;
+        directory_prefetch(dir);
+        while (scan.offset < dir->size) {
+            if (directory_next(&scan, &ent) == 0) {
+                break;
+            }
+            if (strncmp(ent.name, name, sizeof(ent.name)) == 0) {
+                found = ent.inode_num;
+                break;
+            }
+        }
+        directory_release(&scan);
+    }
+
+    // remember the answer, including a miss. this happens under the
+    // directory's lock so it can't overwrite a newer entry from
+    // directory_link()
+    dcache_add(dir->inode_num, name, found);
+    return found;
+}
+
+// directory_find(), answered from the dentry cache when possible
+int directory_find_cached(struct inode *dir, char *name)
+{
+    int cached = dcache_lookup(dir->inode_num, name);
+
+    if (cached != DCACHE_MISS) {
+        return cached;
+    }
+    return directory_find(dir, name);
+}
+
+// find name in the directory with the given inode number and return
+// the inode number it refers to, or -1 if it isn't there. answers come
+// from the dentry cache when possible, misses scan the directory
+int directory_lookup(int inode_num, char *name)
+{
+    int cached = dcache_lookup(inode_num, name);
+    if (cached != DCACHE_MISS) {
+        return cached;
+    }
+
+    TRACE_ENTER(TRACE_OP_DIRECTORY_LOOKUP);
+    struct inode *dir = iget(inode_num);
+    if (dir == NULL) {
+        TRACE_LEAVE();
+        return -1;
+    }
+    inode_lock_shared(dir);
+    int found = -1;
+    // only directories can be searched
+    if (dir->flags == DIRECTORY_FLAG) {
+        found = directory_find(dir, name);
+    }
+    inode_unlock(dir);
+    iput(dir);
+    TRACE_LEAVE();
+
+    return found;
+}
+
+// an inline directory has outgrown its inode. move its entries to a
+// data block of its own, near the start of the inode's group. the
+// caller holds dir's lock exclusively. returns 0, or -1 if there's no
+// block for it
+static int directory_spill(struct inode *dir)
+{
+    int data_block_num = extent_alloc(dir, 1);
+    if (data_block_num == -1) {
+        return -1;
+    }
+    unsigned char block[BLOCK_SIZE] = {0};
+    memcpy(block, dir->inline_buf, dir->size);
+    bwrite(data_block_num, block);
+
+    dir->inline_data = 0;
+    memset(dir->inline_buf, 0, sizeof(dir->inline_buf));
+    mark_inode_dirty(dir);
+    return 0;
+}
+
+// the directory's last block can't take the next entry. stretch the
+// block's last record to the block's end, ext2 style, so a scan steps
+// straight into the next block. the caller holds dir's lock exclusively
+static void directory_stretch_last(struct inode *dir)
+{
+    unsigned int end = dir->size % BLOCK_SIZE;
+    int data_block_num = bmap(dir, dir->size / BLOCK_SIZE, NULL);
+    unsigned char *block = bget(data_block_num);
+    unsigned int at = 0;
+
+    while (at + read_u16(block + at + DIRENT_REC_LEN_OFFSET) < end)
+        at += read_u16(block + at + DIRENT_REC_LEN_OFFSET);
+    write_u16(block + at + DIRENT_REC_LEN_OFFSET, BLOCK_SIZE - at);
+    bdirty(data_block_num);
+    brelse(data_block_num);
+
+    dir->size += BLOCK_SIZE - end;
+    mark_inode_dirty(dir);
+}
+
+// whether dir will be big enough for an index once it has adding more
+// entries. fixed length records count themselves; variable length ones
+// are counted, but only in a directory big enough to hold that many of
+// the shortest, and only until the answer is known
+static int directory_needs_index(struct inode *dir, unsigned int adding)
+{
+    struct directory_entry ent;
+    unsigned int entries = adding;
+    unsigned int len;
+
+    if (!(sb.features & FEATURE_VARIABLE_DIRENTS)) {
+        return dir->size / FIXED_LENGTH_RECORD_SIZE + adding > DIRINDEX_THRESHOLD;
+    }
+    if (dir->size / DIRENT_LEN(1) + adding <= DIRINDEX_THRESHOLD) {
+        return 0;
+    }
+    for (unsigned int offset = 0; offset < dir->size && entries <= DIRINDEX_THRESHOLD; offset += len) {
+        len = directory_entry_at(dir, offset, &ent);
+        if (len == 0) {
+            return 0;
+        }
+        entries++;
+    }
+    return entries > DIRINDEX_THRESHOLD;
+}
+
+// append an entry for inode_num under name to the directory dir,
+// taking a new data block when the last one is full, and keep the
+// directory's hash index and the dentry cache up to date. the caller
+// holds dir's lock exclusively.
+// returns 0, or -1 if the directory can't grow
+int directory_link(struct inode *dir, char *name, int inode_num)
+{
+    unsigned int len = directory_entry_len(name);
+    int data_block_num = -1;
+    unsigned char *record;
+
+    // the entry may need a new block, and rebuilding the index can take
+    // far more of the journal than the entry itself, so both are
+    // reserved before anything changes. when the transaction has no room
+    // for the index the directory goes without one instead, which only
+    // makes lookups slower
+    if (journal_extend(1) == FAILED) {
+        return -1;
+    }
+    int indexed = dir->index_block != 0 || directory_needs_index(dir, 1);
+    int credits = indexed ? dirindex_credits(dir, name) : 0;
+    if (indexed && (credits == FAILED || journal_extend(credits) == FAILED)) {
+        if (journal_extend(dirindex_drop_credits(dir)) == FAILED)
+            return -1;
+        dirindex_drop(dir);
+        indexed = 0;
+    }
+    if (dir->inline_data && dir->size + len > INODE_INLINE_MAX &&
+        directory_spill(dir) == -1) {
+        return -1;
+    }
+    // a variable length entry that doesn't fit in the last block goes
+    // at the start of the next one
+    if (!dir->inline_data && dir->size % BLOCK_SIZE != 0 &&
+        dir->size % BLOCK_SIZE + len > BLOCK_SIZE) {
+        directory_stretch_last(dir);
+    }
+    unsigned int offset = dir->size;
+    if (dir->inline_data) {
+        // still fits in the inode
+        record = dir->inline_buf + offset;
+    } else {
+        // the last block is full, start a new one. it lands next to the
+        // previous block when it can, which just lengthens the last extent
+        if (offset % BLOCK_SIZE == 0 && offset != 0) {
+            data_block_num = extent_alloc(dir, 1);
+        } else {
+            data_block_num = bmap(dir, offset / BLOCK_SIZE, NULL);
+        }
+        if (data_block_num == -1) {
+            return -1;
+        }
+        unsigned char *block = bget(data_block_num);
+        record = block + offset % BLOCK_SIZE;
+    }
+    // Write the inode number and name to the directory data block
+    directory_entry_put(record, inode_num, name);
+    if (data_block_num != -1) {
+        bdirty(data_block_num);
+        brelse(data_block_num);
+    }
+
+    // Update the directories size
+    dir->size += len;
+    mark_inode_dirty(dir);
+
+    // index the new entry, or build an index once the directory outgrows
+    // a linear scan. without an index lookups still work, just slower
+    if (dir->index_block != 0) {
+        dirindex_insert(dir, name, offset);
+    } else if (indexed) {
+        dirindex_build(dir);
+    }
+
+    // the directory changed, so replace the cached miss for this name
+    dcache_add(dir->inode_num, name, inode_num);
 
     return 0;
 }
@@ -118,7 +530,7 @@ int invalid_path(char *path)
     }
 }
 
-int directory_make(char *path)
+static int directory_create(char *path)
 {
     // use helper function to check if path valid
     if (invalid_path(path)) {
@@ -130,55 +542,106 @@ int directory_make(char *path)
     char directory_name[1024];
     get_dirname(path, directory_path);
     get_basename(path, directory_name);
-    // create the new inode for new directory
-    struct inode *new_directory_inode = ialloc();
-    if (new_directory_inode == NULL) {
+    // the name has to fit in a directory entry
+    if (strlen(directory_name) > directory_name_max()) {
         return -1;
     }
-    // create a new block-size array for new directory block
-    int directory_block = alloc();
-    if (directory_block == -1) {
+    // walk the path to the parent directory
+    struct inode *parent_inode = namei(directory_path);
+    if (parent_inode == NULL) {
         return -1;
     }
-    struct inode *parent_inode = namei(directory_path);
+    // the parent stays locked until the new entry is in it, so two
+    // threads can't both create the same name
+    inode_lock(parent_inode);
+    // the parent must be a directory and the name must not be taken
+    // already
+    if (parent_inode->flags != DIRECTORY_FLAG ||
+        directory_find_cached(parent_inode, directory_name) != -1) {
+        inode_unlock(parent_inode);
+        iput(parent_inode);
+        return -1;
+    }
+    // create the new inode for new directory, next to its siblings
+    struct inode *new_directory_inode = ialloc_near(parent_inode, 1);
+    if (new_directory_inode == NULL) {
+        inode_unlock(parent_inode);
+        iput(parent_inode);
+        return -1;
+    }
+    // with inline data the new directory needs no block until it grows
+    int inline_data = (sb.features & FEATURE_INLINE_DATA) != 0;
+    int directory_block = -1;
+    if (!inline_data) {
+        // its block goes after the parent's last one when the two are in the
+        // same group, otherwise near the start of the new directory's group
+        int goal = extent_goal(new_directory_inode);
+        if (new_directory_inode->inode_num / sb.inodes_per_group ==
+            parent_inode->inode_num / sb.inodes_per_group) {
+            goal = extent_goal(parent_inode);
+        }
+        directory_block = alloc_near(goal);
+        if (directory_block == -1) {
+            // give the inode back
+            free_map_free(&inode_map, new_directory_inode->inode_num);
+            iput(new_directory_inode);
+            inode_unlock(parent_inode);
+            iput(parent_inode);
+            return -1;
+        }
+    }
 
     // make a block to store the directory information
-	unsigned char block[BLOCK_SIZE];
+	unsigned char block[BLOCK_SIZE] = {0};
+    unsigned char *entries = inline_data ? new_directory_inode->inline_buf : block;
 
     // write . file to the block
-	write_u16(block, new_directory_inode->inode_num);
-	strcpy((char *)block + 2, ".");
+	unsigned int size = directory_entry_put(entries, new_directory_inode->inode_num, ".");
     // write .. file to the block
-	write_u16(block + FIXED_LENGTH_RECORD_SIZE, parent_inode->inode_num);
-	strcpy((char *)block + 2 + FIXED_LENGTH_RECORD_SIZE, "..");
+	size += directory_entry_put(entries + size, parent_inode->inode_num, "..");
 
     // initialize root inode
 	new_directory_inode->flags = DIRECTORY_FLAG;
-	new_directory_inode->size = 64;
-	new_directory_inode->block_ptr[0] = get_block_position(directory_block);
-    // write new directory data block to disk bwrite()
-	bwrite(directory_block, block);
-
-    // Find the block that will contain the new directory entry
-    short parent_dir_data_block_num = parent_inode->block_ptr[0] / BLOCK_SIZE;
-    bread(parent_dir_data_block_num, block);
-    void *directory_data_location = block + parent_inode->size;
-
-    // Write the inode number to the directory data block
-    write_u16(directory_data_location, new_directory_inode->inode_num);
-
-    // Copy the directory name to the data block
-    strcpy((char *)directory_data_location + 2, directory_name);
-
-    // Write the block to disk
-    bwrite(parent_dir_data_block_num, block);
+	new_directory_inode->size = size;
+    new_directory_inode->inline_data = inline_data;
+    if (!inline_data) {
+        extent_append(new_directory_inode, directory_block, 1);
+        // write new directory data block to disk bwrite()
+        bwrite(directory_block, block);
+    }
 
-    // Update the parent directories size
-    parent_inode->size += FIXED_LENGTH_RECORD_SIZE;
+    // add the new directory to its parent
+    if (directory_link(parent_inode, directory_name, new_directory_inode->inode_num) == -1) {
+        extent_truncate(new_directory_inode, 0);
+        free_map_free(&inode_map, new_directory_inode->inode_num);
+        iput(new_directory_inode);
+        inode_unlock(parent_inode);
+        iput(parent_inode);
+        return -1;
+    }
 
     // Free up the inodes
     iput(new_directory_inode);
+    inode_unlock(parent_inode);
     iput(parent_inode);
 
     return 0;
 }
+
+// make a new directory at path. the new inode, its block, the entry in
+// the parent and the maps are one journal transaction, so after a
+// crash either all of them are there or none
+int directory_make(char *path)
+{
+    STATS_START(started);
+    TRACE_ENTER(TRACE_OP_DIRECTORY_MAKE);
+    int status = FAILED;
+    if (journal_start() == 0) {
+        status = directory_create(path);
+        if (journal_stop() == FAILED)
+            status = FAILED;
+    }
+    TRACE_LEAVE();
+    STATS_END(STAT_DIRECTORY_MAKE, started, 0);
+    return status;
+}
@@ -2,22 +2,54 @@
 #define DIRECTORY_H
 
 #define FILE_OFFSET 2
+// longest name a fixed length record holds
+#define FIXED_NAME_MAX 15
+
+// variable length records, on images made with FEATURE_VARIABLE_DIRENTS,
+// are laid out like ext2's:
+//   0 u16 inode number
+//   2 u16 record length, the distance to the next record
+//   4 u8  name length
+//   5     the name, not terminated
+// each is padded to DIRENT_ALIGN bytes and none crosses a block. when
+// the next entry won't fit in what's left of a block, the block's last
+// record is stretched to its end and the entry starts the next block
+#define DIRENT_REC_LEN_OFFSET 2
+#define DIRENT_NAME_LEN_OFFSET 4
+#define DIRENT_NAME_OFFSET 5
+#define DIRENT_ALIGN 4
+#define DIRENT_LEN(name_len) ((DIRENT_NAME_OFFSET + (name_len) + DIRENT_ALIGN - 1) & ~(DIRENT_ALIGN - 1))
+#define DIRECTORY_NAME_MAX 255
 
 // from project spec
 struct directory {
     struct inode *inode;
     unsigned int offset;
+
+    // data block the last entry came from, held until we move past it
+    // or the call reading it returns
+    int block_num;
+    unsigned char *block;
 };
 
 struct directory_entry {
     unsigned int inode_num;
-    char name[16];
+    char name[DIRECTORY_NAME_MAX + 1];
 };
 
 char *get_dirname(const char *path, char *dirname);
 char *get_basename(const char *path, char *basename);
+int invalid_path(char *path);
 struct directory *directory_open(int inode_num);
+unsigned int directory_name_max(void);
+unsigned int directory_entry_put(unsigned char *record, int inode_num, char *name);
+unsigned int directory_entry_at(struct inode *dir, unsigned int offset, struct directory_entry *ent);
 int directory_get(struct directory *dir, struct directory_entry *ent);
+int directory_get_batch(struct directory *dir, struct directory_entry *ents, int max);
+int directory_find(struct inode *dir, char *name);
+int directory_find_cached(struct inode *dir, char *name);
+int directory_lookup(int inode_num, char *name);
+int directory_link(struct inode *dir, char *name, int inode_num);
 void directory_close(struct directory *d);
 int directory_make(char *path);
 
@@ -0,0 +1,305 @@
+// hash index for large directories, so a lookup reads one index page
+// and one directory block instead of scanning every entry
+#include <string.h>
+#include "block.h"
+#include "free.h"
+#include "inode.h"
+#include "directory.h"
+#include "dirindex.h"
+#include "journal.h"
+#include "pack.h"
+#include "superblock.h"
+
+// fnv-1a. 0 marks an empty slot, so it's never a real hash
+unsigned int dirindex_hash(char *name)
+{
+    unsigned int h = 2166136261u;
+
+    for (int i = 0; name[i] != '\0'; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h == 0 ? 1 : h;
+}
+
+// entries are recorded by their offset in units of the smallest step
+// between records. variable length ones are only DIRENT_ALIGN apart
+static unsigned int record_unit(void)
+{
+    if (sb.features & FEATURE_VARIABLE_DIRENTS)
+        return DIRENT_ALIGN;
+    return FIXED_LENGTH_RECORD_SIZE;
+}
+
+// slot the probe for hash starts at, never the count in slot 0
+static int first_slot(unsigned int hash)
+{
+    return 1 + (hash >> 8) % (DIRINDEX_SLOTS - 1);
+}
+
+static int next_slot(int slot)
+{
+    return slot == DIRINDEX_SLOTS - 1 ? 1 : slot + 1;
+}
+
+// index page that holds hash
+static int page_for(unsigned char *header, unsigned int hash)
+{
+    unsigned int pages = read_u32(header + DIRINDEX_PAGES_OFFSET);
+
+    return read_u32(header + DIRINDEX_PAGE_LIST_OFFSET + 4 * (hash & (pages - 1)));
+}
+
+// put (hash, record) into its page. returns the page's new count, or
+// FAILED if the page is past DIRINDEX_PAGE_FULL and the index needs to grow
+static int page_insert(unsigned char *header, unsigned int hash, unsigned int record)
+{
+    int page_block = page_for(header, hash);
+    unsigned char *page = bget(page_block);
+    unsigned int count = read_u32(page);
+
+    if (count >= DIRINDEX_PAGE_FULL) {
+        brelse(page_block);
+        return FAILED;
+    }
+
+    int slot = first_slot(hash);
+    while (read_u32(page + slot * DIRINDEX_SLOT_SIZE) != 0)
+        slot = next_slot(slot);
+    write_u32(page + slot * DIRINDEX_SLOT_SIZE, hash);
+    write_u32(page + slot * DIRINDEX_SLOT_SIZE + 4, record);
+    write_u32(page, count + 1);
+
+    bdirty(page_block);
+    brelse(page_block);
+    return count + 1;
+}
+
+// give the index's blocks back and go back to linear lookups
+void dirindex_drop(struct inode *dir)
+{
+    if (dir->index_block == 0)
+        return;
+
+    unsigned char *header = bget(dir->index_block);
+    unsigned int pages = read_u32(header + DIRINDEX_PAGES_OFFSET);
+    for (unsigned int i = 0; i < pages; i++)
+        free_map_free(&block_map, read_u32(header + DIRINDEX_PAGE_LIST_OFFSET + 4 * i));
+    brelse(dir->index_block);
+
+    free_map_free(&block_map, dir->index_block);
+    dir->index_block = 0;
+}
+
+// build an index of the given number of pages from every entry in dir.
+// returns 0, or FAILED if a page overflowed, a record was corrupt or
+// there was no space
+static int build_pages(struct inode *dir, unsigned int pages)
+{
+    int blocks[pages + 1];
+    unsigned char zero[BLOCK_SIZE] = {0};
+
+    if (alloc_n(pages + 1, blocks) == FAILED)
+        return FAILED;
+    for (unsigned int i = 0; i <= pages; i++)
+        bwrite(blocks[i], zero);
+
+    unsigned char *header = bget(blocks[0]);
+    write_u32(header, DIRINDEX_MAGIC);
+    write_u32(header + DIRINDEX_PAGES_OFFSET, pages);
+    for (unsigned int i = 0; i < pages; i++)
+        write_u32(header + DIRINDEX_PAGE_LIST_OFFSET + 4 * i, blocks[i + 1]);
+    dir->index_block = blocks[0];
+
+    struct directory_entry ent;
+    unsigned int entries = 0;
+    int status = 0;
+    unsigned int len;
+    for (unsigned int offset = 0; offset < dir->size; offset += len) {
+        len = directory_entry_at(dir, offset, &ent);
+        // a corrupt record can't be stepped over
+        if (len == 0 || page_insert(header, dirindex_hash(ent.name), offset / record_unit()) == FAILED) {
+            status = FAILED;
+            break;
+        }
+        entries++;
+    }
+    write_u32(header + DIRINDEX_ENTRIES_OFFSET, entries);
+    bdirty(blocks[0]);
+    brelse(blocks[0]);
+
+    if (status == FAILED)
+        dirindex_drop(dir);
+    return status;
+}
+
+// records in dir, which is what an index of it holds. fixed length
+// ones count themselves, variable length ones are sized by their names
+// so they're counted, up to the first corrupt one
+static unsigned int entry_count(struct inode *dir)
+{
+    struct directory_entry ent;
+    unsigned int entries = 0;
+    unsigned int len;
+
+    if (!(sb.features & FEATURE_VARIABLE_DIRENTS))
+        return dir->size / FIXED_LENGTH_RECORD_SIZE;
+    for (unsigned int offset = 0; offset < dir->size; offset += len) {
+        len = directory_entry_at(dir, offset, &ent);
+        if (len == 0)
+            break;
+        entries++;
+    }
+    return entries;
+}
+
+// journal entries building an index of pages pages takes: its blocks,
+// the map blocks they come from, and revoking them all again should a
+// page overflow
+static int build_credits(unsigned int pages)
+{
+    return 2 * (pages + 1) + 2;
+}
+
+// pages a fresh index of entries starts with. around half full, so
+// inserts have room before the next rebuild, or as full as it takes to
+// be built in the spare entries of one transaction. 0 if not even that
+// fits. spare is 0 without a journal, which leaves the size alone
+static unsigned int build_page_count(unsigned int entries, int spare)
+{
+    unsigned int pages = 1;
+
+    while (pages * DIRINDEX_PAGE_FULL / 2 < entries)
+        pages <<= 1;
+    if (spare == 0)
+        return pages;
+    while (pages > 1 && pages / 2 * DIRINDEX_PAGE_FULL >= entries && build_credits(pages) > spare)
+        pages >>= 1;
+    return build_credits(pages) > spare ? 0 : pages;
+}
+
+// spare entries a transaction has for (re)building dir's index, past
+// what the handle starts with and the entry being added, and what
+// dropping the old index takes. 0 means there's no journal
+static int build_spare(struct inode *dir)
+{
+    int capacity = journal_capacity();
+
+    if (capacity == 0)
+        return 0;
+    int spare = capacity - JOURNAL_HANDLE_CREDITS - 1 - dirindex_drop_credits(dir);
+    return spare > 0 ? spare : -1;
+}
+
+// journal entries dropping dir's index takes: a revoke for each of its
+// blocks, and the map blocks they go back to
+int dirindex_drop_credits(struct inode *dir)
+{
+    if (dir->index_block == 0)
+        return 0;
+    unsigned char *header = bget(dir->index_block);
+    unsigned int pages = read_u32(header + DIRINDEX_PAGES_OFFSET);
+    brelse(dir->index_block);
+    return pages + 1 + 2;
+}
+
+// journal entries indexing name, which is being added to dir, can take
+// on top of an ordinary operation. nothing while name's page has room;
+// a full page, or a directory getting its first index, means a build:
+// the old index is dropped and a new one written, then dropped again
+// should a page overflow and the build have to go bigger. bigger builds
+// reserve their own. FAILED if no build fits in a transaction
+int dirindex_credits(struct inode *dir, char *name)
+{
+    unsigned int entries;
+
+    if (dir->index_block != 0) {
+        unsigned char *header = bget(dir->index_block);
+        int page_block = page_for(header, dirindex_hash(name));
+        brelse(dir->index_block);
+        unsigned char *page = bget(page_block);
+        int full = read_u32(page) >= DIRINDEX_PAGE_FULL;
+        brelse(page_block);
+        if (!full)
+            return 0;
+        header = bget(dir->index_block);
+        entries = read_u32(header + DIRINDEX_ENTRIES_OFFSET) + 1;
+        brelse(dir->index_block);
+    } else {
+        entries = entry_count(dir) + 1;
+    }
+    unsigned int pages = build_page_count(entries, build_spare(dir));
+    if (pages == 0)
+        return FAILED;
+    return dirindex_drop_credits(dir) + build_credits(pages);
+}
+
+// (re)build the index for dir, doubling the page count until every page
+// is under DIRINDEX_PAGE_FULL. if that can't be done the directory is
+// left without an index and FAILED is returned. the first try is
+// covered by dirindex_credits()
+int dirindex_build(struct inode *dir)
+{
+    unsigned int pages = build_page_count(entry_count(dir), build_spare(dir));
+
+    dirindex_drop(dir);
+    if (pages == 0 || journal_ensure(build_credits(pages)) == FAILED)
+        return FAILED;
+
+    for (unsigned int first = pages; pages <= DIRINDEX_MAX_PAGES; pages <<= 1) {
+        if (pages != first && journal_extend(build_credits(pages)) == FAILED)
+            return FAILED;
+        if (build_pages(dir, pages) == 0)
+            return 0;
+    }
+    return FAILED;
+}
+
+// look name up through the index. returns the inode number, or -1
+int dirindex_lookup(struct inode *dir, char *name)
+{
+    unsigned int hash = dirindex_hash(name);
+    unsigned char *header = bget(dir->index_block);
+    int page_block = page_for(header, hash);
+    brelse(dir->index_block);
+
+    unsigned char *page = bget(page_block);
+    struct directory_entry ent;
+    int found = -1;
+
+    for (int slot = first_slot(hash);; slot = next_slot(slot)) {
+        unsigned int slot_hash = read_u32(page + slot * DIRINDEX_SLOT_SIZE);
+        if (slot_hash == 0)
+            break;
+        if (slot_hash != hash)
+            continue;
+        unsigned int record = read_u32(page + slot * DIRINDEX_SLOT_SIZE + 4);
+        directory_entry_at(dir, record * record_unit(), &ent);
+        if (strncmp(ent.name, name, sizeof(ent.name)) == 0) {
+            found = ent.inode_num;
+            break;
+        }
+    }
+
+    brelse(page_block);
+    return found;
+}
+
+// add the entry at offset in dir to its index, growing the index when
+// the entry's page is full
+int dirindex_insert(struct inode *dir, char *name, unsigned int offset)
+{
+    unsigned char *header = bget(dir->index_block);
+    int status = page_insert(header, dirindex_hash(name), offset / record_unit());
+
+    if (status != FAILED) {
+        write_u32(header + DIRINDEX_ENTRIES_OFFSET, read_u32(header + DIRINDEX_ENTRIES_OFFSET) + 1);
+        bdirty(dir->index_block);
+    }
+    brelse(dir->index_block);
+
+    // the entry is already in the directory, so a rebuild picks it up
+    if (status == FAILED)
+        return dirindex_build(dir);
+    return 0;
+}
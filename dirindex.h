@@ -0,0 +1,36 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "inode.h"
+#include "mkfs.h"
+
+// hash index for large directories. the inode's index_block points at
+// a header block listing the index pages; a name's hash picks a page
+// and the page is an open addressing table of (hash, record) slots,
+// where record is the entry's offset in the directory divided by the
+// record size, or by DIRENT_ALIGN for variable length records
+#define DIRINDEX_MAGIC 0x48545245
+#define DIRINDEX_SLOT_SIZE 8
+#define DIRINDEX_SLOTS (BLOCK_SIZE / DIRINDEX_SLOT_SIZE)
+// slot 0 of every page holds the page's entry count
+#define DIRINDEX_PAGE_FULL (DIRINDEX_SLOTS * 3 / 4)
+
+// header block layout
+#define DIRINDEX_PAGES_OFFSET 4
+#define DIRINDEX_ENTRIES_OFFSET 8
+#define DIRINDEX_PAGE_LIST_OFFSET 12
+#define DIRINDEX_MAX_PAGES ((BLOCK_SIZE - DIRINDEX_PAGE_LIST_OFFSET) / 4)
+
+// directories with more entries than one block of fixed length records
+// holds get an index, whichever format their records are in
+#define DIRINDEX_THRESHOLD (BLOCK_SIZE / FIXED_LENGTH_RECORD_SIZE)
+
+unsigned int dirindex_hash(char *name);
+int dirindex_build(struct inode *dir);
+int dirindex_lookup(struct inode *dir, char *name);
+int dirindex_insert(struct inode *dir, char *name, unsigned int offset);
+void dirindex_drop(struct inode *dir);
+int dirindex_credits(struct inode *dir, char *name);
+int dirindex_drop_credits(struct inode *dir);
+
+#endif
@@ -0,0 +1,269 @@
+// extent mapping: a file's blocks are a list of (logical, physical,
+// length) runs in logical order. the first few live in the inode and
+// the rest in a single extent block
+#include "block.h"
+#include "free.h"
+#include "inode.h"
+#include "journal.h"
+#include "extent.h"
+#include "pack.h"
+#include "superblock.h"
+
+void unpack_extent(unsigned char *record, struct extent *ext)
+{
+    ext->logical = read_u32(record + EXTENT_LOGICAL_OFFSET);
+    ext->physical = read_u32(record + EXTENT_PHYSICAL_OFFSET);
+    ext->length = read_u16(record + EXTENT_LENGTH_OFFSET);
+}
+
+void pack_extent(unsigned char *record, struct extent *ext)
+{
+    write_u32(record + EXTENT_LOGICAL_OFFSET, ext->logical);
+    write_u32(record + EXTENT_PHYSICAL_OFFSET, ext->physical);
+    write_u16(record + EXTENT_LENGTH_OFFSET, ext->length);
+}
+
+// the i'th extent of in, wherever it's kept
+static void extent_get(struct inode *in, int i, struct extent *ext)
+{
+    if (i < INODE_EXTENT_COUNT) {
+        *ext = in->extents[i];
+        return;
+    }
+    unsigned char *block = bget(in->extent_block);
+    unpack_extent(block + (i - INODE_EXTENT_COUNT) * EXTENT_SIZE, ext);
+    brelse(in->extent_block);
+}
+
+static void extent_put(struct inode *in, int i, struct extent *ext)
+{
+    if (i < INODE_EXTENT_COUNT) {
+        in->extents[i] = *ext;
+        mark_inode_dirty(in);
+        return;
+    }
+    unsigned char *block = bget(in->extent_block);
+    pack_extent(block + (i - INODE_EXTENT_COUNT) * EXTENT_SIZE, ext);
+    bdirty(in->extent_block);
+    brelse(in->extent_block);
+}
+
+// physical block for logical if ext covers it, and how many blocks
+// from there on are contiguous
+static int extent_hit(struct extent *ext, unsigned int logical, unsigned int *run)
+{
+    if (logical < ext->logical || logical - ext->logical >= ext->length)
+        return FAILED;
+    if (run != NULL)
+        *run = ext->length - (logical - ext->logical);
+    return ext->physical + (logical - ext->logical);
+}
+
+// the disk block holding block logical of the file, or FAILED if it
+// isn't mapped. if run isn't NULL it gets the number of blocks from
+// logical on that follow it on disk, so callers can do one big I/O
+int bmap(struct inode *in, unsigned int logical, unsigned int *run)
+{
+    int in_inode = in->extent_count < INODE_EXTENT_COUNT ? in->extent_count : INODE_EXTENT_COUNT;
+
+    for (int i = 0; i < in_inode; i++) {
+        int physical = extent_hit(&in->extents[i], logical, run);
+        if (physical != FAILED)
+            return physical;
+    }
+    if (in->extent_count <= INODE_EXTENT_COUNT)
+        return FAILED;
+
+    // the extent block is sorted, binary search it
+    unsigned char *block = bget(in->extent_block);
+    int lo = 0;
+    int hi = in->extent_count - INODE_EXTENT_COUNT - 1;
+    int physical = FAILED;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        struct extent ext;
+        unpack_extent(block + mid * EXTENT_SIZE, &ext);
+        if (logical < ext.logical) {
+            hi = mid - 1;
+        } else if (logical - ext.logical >= ext.length) {
+            lo = mid + 1;
+        } else {
+            physical = extent_hit(&ext, logical, run);
+            break;
+        }
+    }
+    brelse(in->extent_block);
+    return physical;
+}
+
+// number of file blocks mapped, which is where the next one goes
+unsigned int extent_blocks(struct inode *in)
+{
+    struct extent last;
+
+    if (in->extent_count == 0)
+        return 0;
+    extent_get(in, in->extent_count - 1, &last);
+    return last.logical + last.length;
+}
+
+// map count blocks starting at physical onto the end of the file,
+// growing the last extent when they follow it on disk. returns 0, or
+// FAILED if the file is out of extents
+int extent_append(struct inode *in, unsigned int physical, unsigned int count)
+{
+    unsigned int logical = extent_blocks(in);
+
+    while (count > 0) {
+        struct extent ext;
+
+        if (in->extent_count > 0) {
+            extent_get(in, in->extent_count - 1, &ext);
+            if (ext.physical + ext.length == physical && ext.length < EXTENT_MAX_LENGTH) {
+                unsigned int grow = EXTENT_MAX_LENGTH - ext.length;
+                if (grow > count)
+                    grow = count;
+                ext.length += grow;
+                extent_put(in, in->extent_count - 1, &ext);
+                physical += grow;
+                logical += grow;
+                count -= grow;
+                continue;
+            }
+        }
+
+        if (in->extent_count >= EXTENT_MAX)
+            return FAILED;
+        // the inode is full, spill into an extent block. under a journal
+        // that's the block, its map block and a revoke should it be
+        // freed again. it goes near the start of the inode's group, out
+        // of the way of the blocks the file grows into next
+        if (in->extent_count == INODE_EXTENT_COUNT && in->extent_block == 0) {
+            if (journal_extend(3) == FAILED)
+                return FAILED;
+            int block = alloc_near(group_first_block(in->inode_num / sb.inodes_per_group));
+            if (block == FAILED)
+                return FAILED;
+            in->extent_block = block;
+        }
+        ext.logical = logical;
+        ext.physical = physical;
+        ext.length = count < EXTENT_MAX_LENGTH ? count : EXTENT_MAX_LENGTH;
+        extent_put(in, in->extent_count, &ext);
+        in->extent_count++;
+        mark_inode_dirty(in);
+
+        physical += ext.length;
+        logical += ext.length;
+        count -= ext.length;
+    }
+    return 0;
+}
+
+// where in's next block would best go: right after its last one, or
+// for an empty file at the start of the group its inode is in, so a
+// file's blocks sit near its inode and near each other
+int extent_goal(struct inode *in)
+{
+    struct extent last;
+
+    if (in->extent_count > 0) {
+        extent_get(in, in->extent_count - 1, &last);
+        return last.physical + last.length;
+    }
+    return group_first_block(in->inode_num / sb.inodes_per_group);
+}
+
+// give in count more blocks at the end of the file, taking the longest
+// contiguous runs the block map has, as close after extent_goal() as
+// they'll fit. all or nothing: returns the first
+// new block, or FAILED with nothing allocated. under a journal every run
+// may dirty another map block, so each is reserved before it's taken
+// and a transaction too full for the next one fails the whole call
+int extent_alloc(struct inode *in, int count)
+{
+    unsigned int blocks = extent_blocks(in);
+    int first = FAILED;
+    int run = count;
+    int done = 0;
+    int reserved = 0;
+
+    while (done < count) {
+        if (run > count - done)
+            run = count - done;
+        if (!reserved && journal_extend(1) == FAILED) {
+            extent_truncate(in, blocks);
+            return FAILED;
+        }
+        reserved = 1;
+        int physical = alloc_run_near(run, extent_goal(in));
+        if (physical == FAILED) {
+            // no run that long, settle for shorter ones
+            if (run > 1) {
+                run /= 2;
+                continue;
+            }
+            extent_truncate(in, blocks);
+            return FAILED;
+        }
+        if (extent_append(in, physical, run) == FAILED) {
+            for (int i = 0; i < run; i++)
+                free_map_free(&block_map, physical + i);
+            extent_truncate(in, blocks);
+            return FAILED;
+        }
+        if (first == FAILED)
+            first = physical;
+        done += run;
+        reserved = 0;
+    }
+    return first;
+}
+
+// shrink the file to its first blocks blocks, freeing everything past
+// them, and the extent block once it's no longer needed
+void extent_truncate(struct inode *in, unsigned int blocks)
+{
+    while (in->extent_count > 0) {
+        struct extent ext;
+        extent_get(in, in->extent_count - 1, &ext);
+        if (ext.logical + ext.length <= blocks)
+            break;
+
+        unsigned int keep = blocks > ext.logical ? blocks - ext.logical : 0;
+        for (unsigned int i = keep; i < ext.length; i++)
+            free_map_free(&block_map, ext.physical + i);
+        if (keep > 0) {
+            ext.length = keep;
+            extent_put(in, in->extent_count - 1, &ext);
+            break;
+        }
+        in->extent_count--;
+    }
+
+    if (in->extent_count <= INODE_EXTENT_COUNT && in->extent_block != 0) {
+        free_map_free(&block_map, in->extent_block);
+        in->extent_block = 0;
+    }
+    mark_inode_dirty(in);
+}
+
+// extent_truncate() as far as the running transaction has room for.
+// whole extents come off the end one at a time. each makes sure of the
+// map blocks it may go back to and the extent block's revoke, and one
+// more for the inode once the handle stops. returns 0 once the file is
+// down to blocks, or FAILED if the caller has to finish its handle and
+// carry on in a new one
+int extent_truncate_some(struct inode *in, unsigned int blocks)
+{
+    while (in->extent_count > 0) {
+        struct extent ext;
+        extent_get(in, in->extent_count - 1, &ext);
+        if (ext.logical + ext.length <= blocks)
+            break;
+        if (journal_ensure(5) == FAILED)
+            return FAILED;
+        extent_truncate(in, ext.logical > blocks ? ext.logical : blocks);
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "inode.h"
+
+// an extent on disk: logical start, physical start, length
+#define EXTENT_SIZE 10
+#define EXTENT_LOGICAL_OFFSET 0
+#define EXTENT_PHYSICAL_OFFSET 4
+#define EXTENT_LENGTH_OFFSET 8
+#define EXTENT_MAX_LENGTH 0xffff
+
+// extents that don't fit in the inode go in its extent block
+#define EXTENT_BLOCK_COUNT (BLOCK_SIZE / EXTENT_SIZE)
+#define EXTENT_MAX (INODE_EXTENT_COUNT + EXTENT_BLOCK_COUNT)
+
+void unpack_extent(unsigned char *record, struct extent *ext);
+void pack_extent(unsigned char *record, struct extent *ext);
+int bmap(struct inode *in, unsigned int logical, unsigned int *run);
+unsigned int extent_blocks(struct inode *in);
+int extent_append(struct inode *in, unsigned int physical, unsigned int count);
+int extent_goal(struct inode *in);
+int extent_alloc(struct inode *in, int count);
+void extent_truncate(struct inode *in, unsigned int blocks);
+int extent_truncate_some(struct inode *in, unsigned int blocks);
+
+#endif
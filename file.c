@@ -0,0 +1,376 @@
+// reading and writing file data through an open file table. partial
+// blocks go through the buffer cache in place, so small writes to a
+// block are combined there and leave as one whole-block write. runs of
+// whole blocks move straight between the caller's buffer and the image.
+//
+// under a journal a file's blocks, extents and size are metadata and
+// are journaled, but its data isn't, and nothing orders it against the
+// commit: a crash can leave a write's new size and blocks in place
+// without the data that was to go in them, and the file reads back
+// whatever those blocks held before
+#include <string.h>
+#include <pthread.h>
+#include "block.h"
+#include "free.h"
+#include "inode.h"
+#include "extent.h"
+#include "journal.h"
+#include "trace.h"
+#include "directory.h"
+#include "mkfs.h"
+#include "file.h"
+
+// a descriptor is used by one thread at a time. the table lock only
+// covers handing entries out and taking them back
+static struct open_file files[MAX_SYS_OPEN_FILES];
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct open_file *file_get(int fd)
+{
+    if (fd < 0 || fd >= MAX_SYS_OPEN_FILES || files[fd].inode == NULL)
+        return NULL;
+    return &files[fd];
+}
+
+// make an empty file at path, unless another thread just did. returns
+// it referenced, or NULL
+static struct inode *file_create(char *path)
+{
+    char dir_path[1024];
+    char name[1024];
+
+    if (invalid_path(path) || strlen(path) >= sizeof(dir_path))
+        return NULL;
+    get_dirname(path, dir_path);
+    get_basename(path, name);
+    if (strlen(name) > directory_name_max())
+        return NULL;
+
+    struct inode *parent = namei(dir_path);
+    if (parent == NULL)
+        return NULL;
+    inode_lock(parent);
+    struct inode *in = NULL;
+    int existing = FAILED;
+    if (parent->flags == DIRECTORY_FLAG) {
+        existing = directory_find_cached(parent, name);
+        if (existing != FAILED) {
+            in = iget(existing);
+        } else {
+            in = ialloc_near(parent, 0);
+        }
+    }
+    if (in != NULL && existing == FAILED) {
+        in->flags = FILE_FLAG;
+        mark_inode_dirty(in);
+        if (directory_link(parent, name, in->inode_num) == FAILED) {
+            free_map_free(&inode_map, in->inode_num);
+            iput(in);
+            in = NULL;
+        }
+    }
+    inode_unlock(parent);
+    iput(parent);
+    return in;
+}
+
+// open the file at path and return a descriptor for it, or FAILED.
+// FILE_CREATE makes the file if it's missing, FILE_TRUNCATE empties it
+int file_open(char *path, int flags)
+{
+    struct inode *in = namei(path);
+
+    // creating and truncating are journaled like directory_make(), and
+    // so is a write's allocation and size
+    if (in == NULL && (flags & FILE_CREATE) && journal_start() == 0) {
+        in = file_create(path);
+        if (journal_stop() == FAILED && in != NULL) {
+            iput(in);
+            in = NULL;
+        }
+    }
+    if (in == NULL)
+        return FAILED;
+    if (in->flags != FILE_FLAG) {
+        iput(in);
+        return FAILED;
+    }
+
+    // a big file can free more blocks than one transaction holds, so it
+    // takes as many handles as it needs. in between the file is only
+    // shorter, and a crash there leaves it part way truncated
+    if (flags & FILE_TRUNCATE) {
+        int status;
+        do {
+            if (journal_start() == FAILED) {
+                iput(in);
+                return FAILED;
+            }
+            inode_lock(in);
+            status = extent_truncate_some(in, 0);
+            unsigned int kept = extent_blocks(in);
+            if (kept < in->size / BLOCK_SIZE + (in->size % BLOCK_SIZE != 0))
+                in->size = kept * BLOCK_SIZE;
+            mark_inode_dirty(in);
+            inode_unlock(in);
+            if (journal_stop() == FAILED) {
+                iput(in);
+                return FAILED;
+            }
+        } while (status == FAILED);
+    }
+
+    pthread_mutex_lock(&files_lock);
+    int fd = 0;
+    while (fd < MAX_SYS_OPEN_FILES && files[fd].inode != NULL)
+        fd++;
+    if (fd == MAX_SYS_OPEN_FILES) {
+        pthread_mutex_unlock(&files_lock);
+        iput(in);
+        return FAILED;
+    }
+    files[fd].inode = in;
+    pthread_mutex_unlock(&files_lock);
+
+    files[fd].offset = 0;
+    files[fd].ra_last = (unsigned int)-1;
+    files[fd].ra_end = 0;
+    files[fd].ra_window = FILE_READAHEAD_MIN;
+    return fd;
+}
+
+// called as a read moves into block logical. while the reader stays
+// sequential, the blocks after it are fetched a window at a time, each
+// window twice the last
+static void file_readahead(struct open_file *f, unsigned int logical)
+{
+    struct inode *in = f->inode;
+    unsigned int blocks = (in->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (logical == f->ra_last)
+        return;
+    if (logical != f->ra_last + 1) {
+        // a seek, start over with a small window
+        f->ra_window = FILE_READAHEAD_MIN;
+        f->ra_end = logical + 1;
+    }
+    f->ra_last = logical;
+    if (logical + 1 < f->ra_end)
+        return;
+
+    unsigned int next = logical + 1;
+    unsigned int end = next + f->ra_window;
+    if (end > blocks)
+        end = blocks;
+    // one readahead per extent the window covers
+    while (next < end) {
+        unsigned int run;
+        int physical = bmap(in, next, &run);
+        if (physical == FAILED)
+            break;
+        if (run > end - next)
+            run = end - next;
+        breadahead(physical, run);
+        next += run;
+    }
+    f->ra_end = end;
+    if (f->ra_window < FILE_READAHEAD_MAX)
+        f->ra_window *= 2;
+}
+
+// read up to count bytes from the file's offset into buf. returns the
+// number of bytes read, 0 at the end of the file, or FAILED
+int file_read(int fd, void *buf, unsigned int count)
+{
+    struct open_file *f = file_get(fd);
+    if (f == NULL)
+        return FAILED;
+
+    struct inode *in = f->inode;
+    unsigned char *out = buf;
+    unsigned char *run_blocks[BLOCK_IOV_MAX];
+    unsigned int done = 0;
+
+    TRACE_ENTER(TRACE_OP_FILE_READ);
+    inode_lock_shared(in);
+    if (f->offset >= in->size)
+        count = 0;
+    else if (count > in->size - f->offset)
+        count = in->size - f->offset;
+
+    while (done < count) {
+        unsigned int logical = f->offset / BLOCK_SIZE;
+        unsigned int in_block = f->offset % BLOCK_SIZE;
+        unsigned int run;
+        unsigned int chunk;
+        int physical = bmap(in, logical, &run);
+
+        if (in_block == 0 && count - done >= BLOCK_SIZE && physical != FAILED) {
+            // whole blocks that are contiguous on disk go into the
+            // caller's buffer with one read, no copy through the cache
+            unsigned int n = (count - done) / BLOCK_SIZE;
+            if (n > run)
+                n = run;
+            if (n > BLOCK_IOV_MAX)
+                n = BLOCK_IOV_MAX;
+            for (unsigned int i = 0; i < n; i++)
+                run_blocks[i] = out + done + i * BLOCK_SIZE;
+            breadv(physical, run_blocks, n);
+            chunk = n * BLOCK_SIZE;
+            f->ra_last = logical + n - 1;
+        } else {
+            file_readahead(f, logical);
+            chunk = BLOCK_SIZE - in_block;
+            if (chunk > count - done)
+                chunk = count - done;
+            if (physical == FAILED) {
+                memset(out + done, 0, chunk);
+            } else {
+                unsigned char *block = bget(physical);
+                memcpy(out + done, block + in_block, chunk);
+                brelse(physical);
+            }
+        }
+        done += chunk;
+        f->offset += chunk;
+    }
+    inode_unlock(in);
+    TRACE_LEAVE();
+    return done;
+}
+
+// write count bytes from buf at the file's offset, growing the file as
+// needed. returns count, or FAILED if there's no room
+int file_write(int fd, const void *buf, unsigned int count)
+{
+    struct open_file *f = file_get(fd);
+    if (f == NULL)
+        return FAILED;
+
+    struct inode *in = f->inode;
+    const unsigned char *src = buf;
+    unsigned char *run_blocks[BLOCK_IOV_MAX];
+    unsigned int done = 0;
+
+    if (count > (unsigned int)-1 - f->offset)
+        return FAILED;
+
+    TRACE_ENTER(TRACE_OP_FILE_WRITE);
+    if (journal_start() == FAILED) {
+        TRACE_LEAVE();
+        return FAILED;
+    }
+    inode_lock(in);
+    // blocks the write needs are allocated up front, so they come from as
+    // few free runs as possible. blocks from fresh on held no file data.
+    // a write needing more runs than a transaction can hold fails here,
+    // before anything is written
+    unsigned int fresh = extent_blocks(in);
+    unsigned int needed = (f->offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needed > fresh && extent_alloc(in, needed - fresh) == FAILED) {
+        inode_unlock(in);
+        journal_stop();
+        TRACE_LEAVE();
+        return FAILED;
+    }
+
+    // a write past the end leaves a gap, which reads back as zeros
+    unsigned char zero[BLOCK_SIZE] = {0};
+    for (unsigned int logical = fresh; logical < f->offset / BLOCK_SIZE; logical++)
+        bwrite_data(bmap(in, logical, NULL), zero);
+
+    while (done < count) {
+        unsigned int logical = f->offset / BLOCK_SIZE;
+        unsigned int in_block = f->offset % BLOCK_SIZE;
+        unsigned int run;
+        unsigned int chunk;
+        int physical = bmap(in, logical, &run);
+
+        if (in_block == 0 && count - done >= BLOCK_SIZE) {
+            // whole blocks go from the caller's buffer to the image in
+            // one write, refreshing any cached copies on the way
+            unsigned int n = (count - done) / BLOCK_SIZE;
+            if (n > run)
+                n = run;
+            if (n > BLOCK_IOV_MAX)
+                n = BLOCK_IOV_MAX;
+            for (unsigned int i = 0; i < n; i++)
+                run_blocks[i] = (unsigned char *)src + done + i * BLOCK_SIZE;
+            bwritev(physical, run_blocks, n);
+            chunk = n * BLOCK_SIZE;
+        } else {
+            // part of a block is changed in the cache, where the rest
+            // of the block's writes will join it
+            chunk = BLOCK_SIZE - in_block;
+            if (chunk > count - done)
+                chunk = count - done;
+            // a new block starts out zeroed in the cache rather than
+            // read from the image
+            if (logical >= fresh)
+                bwrite_data(physical, zero);
+            unsigned char *block = bget(physical);
+            memcpy(block + in_block, src + done, chunk);
+            bdirty_data(physical);
+            brelse(physical);
+        }
+        done += chunk;
+        f->offset += chunk;
+    }
+
+    if (f->offset > in->size) {
+        in->size = f->offset;
+        mark_inode_dirty(in);
+    }
+    inode_unlock(in);
+    // the data may be on the image, but the size isn't
+    if (journal_stop() == FAILED)
+        done = FAILED;
+    TRACE_LEAVE();
+    return done;
+}
+
+// move the file's offset. seeking past the end is allowed, a write
+// there fills the gap with zeros
+int file_seek(int fd, unsigned int offset)
+{
+    struct open_file *f = file_get(fd);
+    if (f == NULL)
+        return FAILED;
+    f->offset = offset;
+    return 0;
+}
+
+int file_size(int fd)
+{
+    struct open_file *f = file_get(fd);
+    if (f == NULL)
+        return FAILED;
+    inode_lock_shared(f->inode);
+    int size = f->inode->size;
+    inode_unlock(f->inode);
+    return size;
+}
+
+int file_close(int fd)
+{
+    pthread_mutex_lock(&files_lock);
+    struct open_file *f = file_get(fd);
+    struct inode *in = f == NULL ? NULL : f->inode;
+    if (f != NULL)
+        f->inode = NULL;
+    pthread_mutex_unlock(&files_lock);
+
+    if (in == NULL)
+        return FAILED;
+    iput(in);
+    return 0;
+}
+
+// the image is going away, so is every descriptor on it
+void file_close_all(void)
+{
+    for (int fd = 0; fd < MAX_SYS_OPEN_FILES; fd++) {
+        if (files[fd].inode != NULL)
+            file_close(fd);
+    }
+}
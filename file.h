@@ -0,0 +1,34 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "inode.h"
+
+// file_open() flags
+#define FILE_CREATE 1
+#define FILE_TRUNCATE 2
+
+// readahead window in blocks, doubling while reads stay sequential
+#define FILE_READAHEAD_MIN 4
+#define FILE_READAHEAD_MAX 32
+
+// an entry in the open file table. descriptors are indexes into it
+struct open_file {
+    struct inode *inode;  // NULL if the entry is free
+    unsigned int offset;
+
+    // readahead state: the last block read, the end of what has been
+    // fetched ahead and the size of the next window
+    unsigned int ra_last;
+    unsigned int ra_end;
+    unsigned int ra_window;
+};
+
+int file_open(char *path, int flags);
+int file_read(int fd, void *buf, unsigned int count);
+int file_write(int fd, const void *buf, unsigned int count);
+int file_seek(int fd, unsigned int offset);
+int file_size(int fd);
+int file_close(int fd);
+void file_close_all(void);
+
+#endif
@@ -1,7 +1,28 @@
 // freeing blocks
 #include "free.h"
 #include "block.h"
+#include "superblock.h"
+#include "journal.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define WORD_BITS 64
+
+// the inode map and the data block map. their groups are laid out by
+// free_map_setup() once the superblock says how many there are
+struct free_map inode_map = {FREE_MAP_BITS, 0, 0, NULL, &sb.free_inodes};
+struct free_map block_map = {FREE_MAP_BITS, 0, 0, NULL, &sb.free_blocks};
+
+// each group is locked on its own, and only for the scan of its map
+// block, so allocations in different groups don't wait on each other.
+// this lock only covers moving a map's pinned group
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 // helper function to find lowest clear bit in a byte
@@ -10,7 +31,7 @@ int find_low_clear_bit(unsigned char x)
     for (int i = 0; i < BYTE; i++)
         if (!(x & (1 << i)))
             return i;
-    
+
     return -1;
 }
 
@@ -27,15 +48,503 @@ void set_free(unsigned char *block, int num, int set){
     }
 }
 
+// 64 bits of the map starting at bit word * 64, with bit n of the map
+// in bit n % 64 of the result
+static uint64_t load_word(const unsigned char *block, int word)
+{
+    uint64_t x;
+
+    memcpy(&x, block + word * sizeof(x), sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+// skipping over completely full stretches of the map. each version
+// returns the first word at or after word that might have a clear bit
+static int skip_full_portable(const unsigned char *block, int word, int end)
+{
+    while (word + 4 <= end &&
+           (load_word(block, word) & load_word(block, word + 1) &
+            load_word(block, word + 2) & load_word(block, word + 3)) == UINT64_MAX)
+        word += 4;
+    return word;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int skip_full_sse2(const unsigned char *block, int word, int end)
+{
+    const __m128i ones = _mm_set1_epi8(-1);
+
+    while (word + 2 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + word * 8));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff)
+            break;
+        word += 2;
+    }
+    return word;
+}
+
+__attribute__((target("avx2")))
+static int skip_full_avx2(const unsigned char *block, int word, int end)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    while (word + 4 <= end) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + word * 8));
+        if (!_mm256_testc_si256(v, ones))
+            break;
+        word += 4;
+    }
+    return word;
+}
+#endif
+
+static int (*skip_full)(const unsigned char *, int, int) = NULL;
+
+// pick the widest skip the cpu supports, once
+static void choose_skip_full(void)
+{
+    skip_full = skip_full_portable;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        skip_full = skip_full_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        skip_full = skip_full_sse2;
+#endif
+}
+
+// lowest clear bit in [from, to), or FAILED
+static int scan_clear(const unsigned char *block, int from, int to)
+{
+    if (skip_full == NULL)
+        choose_skip_full();
+
+    if (from >= to)
+        return FAILED;
+
+    int word = from / WORD_BITS;
+    int end = (to + WORD_BITS - 1) / WORD_BITS;
+    uint64_t x = ~load_word(block, word) & (UINT64_MAX << (from % WORD_BITS));
+
+    for (;;) {
+        if (x != 0) {
+            int bit = word * WORD_BITS + __builtin_ctzll(x);
+            return bit < to ? bit : FAILED;
+        }
+        word = skip_full(block, word + 1, end);
+        if (word >= end)
+            return FAILED;
+        x = ~load_word(block, word);
+    }
+}
+
+// lowest set bit in [from, to), or to if there isn't one
+static int scan_set(const unsigned char *block, int from, int to)
+{
+    if (from >= to)
+        return to;
+
+    int word = from / WORD_BITS;
+    int end = (to + WORD_BITS - 1) / WORD_BITS;
+    uint64_t x = load_word(block, word) & (UINT64_MAX << (from % WORD_BITS));
+
+    for (;;) {
+        if (x != 0) {
+            int bit = word * WORD_BITS + __builtin_ctzll(x);
+            return bit < to ? bit : to;
+        }
+        if (++word >= end)
+            return to;
+        x = load_word(block, word);
+    }
+}
+
 // find a 0 bit and return its index
 int find_free(unsigned char *block){
-    for(int i = 0; i < BLOCK_SIZE; i++)
-    {
-        int bit_num = find_low_clear_bit(block[i]);
-        if(bit_num != FAILED)
-        {
-            return (i * 8) + bit_num;
+    return scan_clear(block, 0, FREE_MAP_BITS);
+}
+
+// next-fit: the first 0 bit at or after start, wrapping around to the
+// beginning of the map
+int find_free_from(unsigned char *block, int start){
+    int bit = scan_clear(block, start, FREE_MAP_BITS);
+    if (bit == FAILED)
+        bit = scan_clear(block, 0, start);
+    return bit;
+}
+
+// first run of count 0 bits starting in [from, to)
+static int find_run(unsigned char *block, int from, int to, int count)
+{
+    while (from < to) {
+        int bit = scan_clear(block, from, to);
+        if (bit == FAILED)
+            return FAILED;
+        int run_end = scan_set(block, bit, FREE_MAP_BITS);
+        if (run_end - bit >= count)
+            return bit;
+        from = run_end;
+    }
+    return FAILED;
+}
+
+// find count contiguous 0 bits, looking from start and wrapping around.
+// returns the first bit of the run
+int find_free_run(unsigned char *block, int start, int count){
+    if (count <= 0 || count > FREE_MAP_BITS)
+        return FAILED;
+    int bit = find_run(block, start, FREE_MAP_BITS, count);
+    if (bit == FAILED)
+        bit = find_run(block, 0, start, count);
+    return bit;
+}
+
+// lock group g of a map and return its bits. the group the map
+// allocates from keeps its block pinned; any other group's block is
+// pinned just until group_unlock()
+static unsigned char *group_lock(struct free_map *map, int g)
+{
+    struct free_group *group = &map->groups[g];
+
+    pthread_mutex_lock(&group->lock);
+    if (group->bits != NULL)
+        return group->bits;
+    return bget(group->block_num);
+}
+
+static void group_unlock(struct free_map *map, int g)
+{
+    struct free_group *group = &map->groups[g];
+
+    if (group->bits == NULL)
+        brelse(group->block_num);
+    pthread_mutex_unlock(&group->lock);
+}
+
+// allocations now come from group g, so its block is the one to keep
+// pinned. the group before it gives its pin up
+static void group_make_current(struct free_map *map, int g)
+{
+    // nearly always it already is
+    if (__atomic_load_n(&map->current, __ATOMIC_RELAXED) == g &&
+        __atomic_load_n(&map->groups[g].bits, __ATOMIC_RELAXED) != NULL)
+        return;
+
+    pthread_mutex_lock(&current_lock);
+    int old = map->current;
+    struct free_group *group = &map->groups[old];
+    if (old != g) {
+        pthread_mutex_lock(&group->lock);
+        if (group->bits != NULL) {
+            brelse(group->block_num);
+            __atomic_store_n(&group->bits, NULL, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&group->lock);
+        __atomic_store_n(&map->current, g, __ATOMIC_RELAXED);
+    }
+    group = &map->groups[g];
+    pthread_mutex_lock(&group->lock);
+    if (group->bits == NULL)
+        __atomic_store_n(&group->bits, bget(group->block_num), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&group->lock);
+    pthread_mutex_unlock(&current_lock);
+}
+
+// keep a group's count and the superblock's total in step with its
+// bits. called with the group locked
+static void group_count(struct free_map *map, int g, int delta)
+{
+    struct free_group *group = &map->groups[g];
+
+    if (delta < 0 && group->free < (unsigned int)-delta)
+        delta = -(int)group->free;
+    __atomic_add_fetch(&group->free, delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(map->free_count, delta, __ATOMIC_RELAXED);
+}
+
+// the group an allocation aiming at goal starts in: goal's own, or
+// with no goal the one the last allocation came from
+static int group_first(struct free_map *map, int goal)
+{
+    if (goal >= 0 && goal / map->per_group < map->group_count)
+        return goal / map->per_group;
+    return __atomic_load_n(&map->current, __ATOMIC_RELAXED);
+}
+
+// where to start looking in group g: at the goal in the goal's group,
+// otherwise from the group's next-fit cursor
+static int group_start(struct free_map *map, int g, int goal)
+{
+    if (goal >= 0 && goal / map->per_group == g)
+        return goal % map->per_group;
+    return map->groups[g].hint;
+}
+
+// the group to try i steps after first. a group whose count says it's
+// full is passed over without looking at its map
+static int group_next(struct free_map *map, int first, int i, int wanted)
+{
+    int g = (first + i) % map->group_count;
+
+    if (__atomic_load_n(&map->groups[g].free, __ATOMIC_RELAXED) < (unsigned int)wanted)
+        return FAILED;
+    return g;
+}
+
+// allocate count contiguous bits from a map, as close after goal as
+// there's room, or next-fit from the current group's cursor if goal is
+// FAILED. groups after goal's are tried in turn. a run never crosses
+// into another group. returns the first bit of the run or FAILED
+int free_map_alloc_run_near(struct free_map *map, int count, int goal){
+    if (count <= 0 || count > map->per_group)
+        return FAILED;
+
+    int first = group_first(map, goal);
+    for (int i = 0; i < map->group_count; i++) {
+        int g = group_next(map, first, i, count);
+        if (g == FAILED)
+            continue;
+        struct free_group *group = &map->groups[g];
+        unsigned char *block = group_lock(map, g);
+        int bit = find_free_run(block, group_start(map, g, goal), count);
+        if (bit != FAILED) {
+            for (int j = 0; j < count; j++)
+                set_free(block, bit + j, 1);
+            bdirty(group->block_num);
+            group->hint = (bit + count) % FREE_MAP_BITS;
+            group_count(map, g, -count);
+        }
+        group_unlock(map, g);
+        if (bit != FAILED) {
+            group_make_current(map, g);
+            return g * map->per_group + bit;
         }
     }
     return FAILED;
-}
\ No newline at end of file
+}
+
+int free_map_alloc_run(struct free_map *map, int count){
+    return free_map_alloc_run_near(map, count, FAILED);
+}
+
+// clear a bit that was just set, when a batch it was part of fails
+static void group_undo(struct free_map *map, int num)
+{
+    int g = num / map->per_group;
+    unsigned char *block = group_lock(map, g);
+
+    set_free(block, num % map->per_group, 0);
+    group_count(map, g, 1);
+    group_unlock(map, g);
+}
+
+// allocate count bits from a map, not necessarily contiguous, into out,
+// the first ones as close after goal as there's room (see
+// free_map_alloc_run_near()). it's all or nothing: if there aren't
+// enough free bits none are taken. each group's map block is dirtied
+// once for the part of the batch it gave
+static int alloc_n_near(struct free_map *map, int count, int *out, int goal){
+    int got = 0;
+    int last = FAILED;
+
+    if (__atomic_load_n(map->free_count, __ATOMIC_RELAXED) < (unsigned int)count)
+        return FAILED;
+
+    int first = group_first(map, goal);
+    for (int i = 0; i < map->group_count && got < count; i++) {
+        int g = group_next(map, first, i, 1);
+        if (g == FAILED)
+            continue;
+        struct free_group *group = &map->groups[g];
+        unsigned char *block = group_lock(map, g);
+        int hint = group_start(map, g, goal);
+        int taken = 0;
+        while (got < count) {
+            int bit = find_free_from(block, hint);
+            if (bit == FAILED)
+                break;
+            set_free(block, bit, 1);
+            out[got++] = g * map->per_group + bit;
+            taken++;
+            hint = (bit + 1) % FREE_MAP_BITS;
+        }
+        if (taken > 0) {
+            bdirty(group->block_num);
+            group->hint = hint;
+            group_count(map, g, -taken);
+            last = g;
+        }
+        group_unlock(map, g);
+    }
+
+    if (got < count) {
+        // not enough room, hand back what was taken
+        for (int i = 0; i < got; i++)
+            group_undo(map, out[i]);
+        return FAILED;
+    }
+    if (last != FAILED)
+        group_make_current(map, last);
+    return count;
+}
+
+int free_map_alloc_n(struct free_map *map, int count, int *out){
+    return alloc_n_near(map, count, out, FAILED);
+}
+
+// allocate a single bit from a map, the first free one at or after
+// goal if its group has any
+int free_map_alloc_near(struct free_map *map, int goal){
+    int bit;
+
+    if (alloc_n_near(map, 1, &bit, goal) == FAILED)
+        return FAILED;
+    return bit;
+}
+
+// allocate a single bit from a map
+int free_map_alloc(struct free_map *map){
+    return free_map_alloc_near(map, FAILED);
+}
+
+// Orlov-style placement for a directory made at the top of the tree:
+// the group with the most free inodes among those with at least the
+// average share of free blocks. the search starts one group further on
+// each time, so groups that tie take turns and top-level trees spread
+// over the image instead of piling up in group 0
+int free_group_spread(void){
+    static int cursor = 0;
+    int groups = block_map.group_count;
+    unsigned int average = __atomic_load_n(block_map.free_count, __ATOMIC_RELAXED) / groups;
+    int start = __atomic_fetch_add(&cursor, 1, __ATOMIC_RELAXED) % groups;
+    int best = FAILED;
+    unsigned int best_free = 0;
+
+    for (int i = 0; i < groups; i++) {
+        int g = (start + i) % groups;
+        unsigned int free_inodes = __atomic_load_n(&inode_map.groups[g].free, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&block_map.groups[g].free, __ATOMIC_RELAXED) < average ||
+            free_inodes == 0)
+            continue;
+        if (best == FAILED || free_inodes > best_free) {
+            best = g;
+            best_free = free_inodes;
+        }
+    }
+    return best;
+}
+
+// give a bit back to a map
+void free_map_free(struct free_map *map, int num){
+    int g = num / map->per_group;
+    int bit = num % map->per_group;
+
+    if (num < 0 || g >= map->group_count)
+        return;
+    unsigned char *block = group_lock(map, g);
+    if (block[bit / BYTE] & (1 << (bit % BYTE)))
+        group_count(map, g, 1);
+    set_free(block, bit, 0);
+    bdirty(map->groups[g].block_num);
+    if (map == &block_map)
+        journal_revoke(num);
+    group_unlock(map, g);
+}
+
+static void setup_map(struct free_map *map, int per_group, unsigned int (*map_block)(int))
+{
+    free(map->groups);
+    map->per_group = per_group;
+    map->group_count = sb.group_count;
+    map->current = 0;
+    map->groups = calloc(sb.group_count, sizeof(struct free_group));
+    if (map->groups == NULL)
+        exit(1);
+    for (unsigned int g = 0; g < sb.group_count; g++) {
+        map->groups[g].block_num = map_block(g);
+        pthread_mutex_init(&map->groups[g].lock, NULL);
+    }
+}
+
+// lay the maps out over the groups the superblock describes. the
+// counts stay zero until free_map_recount()
+void free_map_setup(void){
+    setup_map(&inode_map, sb.inodes_per_group, group_inode_map);
+    setup_map(&block_map, sb.blocks_per_group, group_block_map);
+}
+
+// clear bits below limit in a map block
+static unsigned int count_clear(const unsigned char *bits, int limit)
+{
+    unsigned int count = 0;
+    int word = 0;
+
+    for (; (word + 1) * WORD_BITS <= limit; word++)
+        count += WORD_BITS - __builtin_popcountll(load_word(bits, word));
+    for (int i = word * WORD_BITS; i < limit; i++)
+        count += !(bits[i / BYTE] & (1 << (i % BYTE)));
+    return count;
+}
+
+static void recount_map(struct free_map *map, long long total)
+{
+    unsigned int sum = 0;
+
+    for (int g = 0; g < map->group_count; g++) {
+        long long limit = total - (long long)g * map->per_group;
+        if (limit > map->per_group)
+            limit = map->per_group;
+        if (limit < 0)
+            limit = 0;
+        unsigned char *block = group_lock(map, g);
+        map->groups[g].free = count_clear(block, limit);
+        sum += map->groups[g].free;
+        group_unlock(map, g);
+    }
+    *map->free_count = sum;
+}
+
+// count each group's clear bits, and the totals in the superblock
+void free_map_recount(void){
+    recount_map(&inode_map, (long long)sb.inodes_per_group * sb.group_count);
+    recount_map(&block_map, sb.block_count);
+}
+
+// unpin the maps so their blocks can be flushed and evicted normally
+void free_map_release(void){
+    struct free_map *maps[] = {&inode_map, &block_map};
+
+    pthread_mutex_lock(&current_lock);
+    for (int i = 0; i < 2; i++) {
+        for (int g = 0; g < maps[i]->group_count; g++) {
+            struct free_group *group = &maps[i]->groups[g];
+            pthread_mutex_lock(&group->lock);
+            if (group->bits != NULL) {
+                brelse(group->block_num);
+                __atomic_store_n(&group->bits, NULL, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&group->lock);
+        }
+    }
+    pthread_mutex_unlock(&current_lock);
+}
+
+// cursors and pinned bits are only meaningful for the image they were
+// built on. used after the cache has been thrown away
+void free_map_reset(void){
+    struct free_map *maps[] = {&inode_map, &block_map};
+
+    pthread_mutex_lock(&current_lock);
+    for (int i = 0; i < 2; i++) {
+        maps[i]->current = 0;
+        for (int g = 0; g < maps[i]->group_count; g++) {
+            maps[i]->groups[g].hint = 0;
+            maps[i]->groups[g].bits = NULL;
+        }
+    }
+    pthread_mutex_unlock(&current_lock);
+}
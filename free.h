@@ -1,10 +1,52 @@
 #ifndef FREE_H
 #define FREE_H
 
+#include <pthread.h>
+
 #define BLOCK_SIZE 4096
 #define BYTE 8
+#define FREE_MAP_BITS (BLOCK_SIZE * BYTE)
+
+// one allocation group's share of a map: a single map block, its
+// next-fit cursor and how many of its bits are clear. the block is
+// pinned while the group is the one the map allocates from
+struct free_group {
+    int block_num;
+    int hint;
+    unsigned int free;
+    unsigned char *bits;
+    pthread_mutex_t lock;
+};
+
+// the inode map or the data block map, split across the allocation
+// groups. numbers are global, bit n of group g's block stands for
+// g * per_group + n. free_count is the superblock counter of clear
+// bits over every group
+struct free_map {
+    int per_group;
+    int group_count;
+    int current;  // group the last allocation came from
+    struct free_group *groups;
+    unsigned int *free_count;
+};
+
+extern struct free_map inode_map;
+extern struct free_map block_map;
 
 void set_free(unsigned char *block, int num, int set);
 int find_free(unsigned char *block);
+int find_free_from(unsigned char *block, int start);
+int find_free_run(unsigned char *block, int start, int count);
+int free_map_alloc(struct free_map *map);
+int free_map_alloc_near(struct free_map *map, int goal);
+int free_map_alloc_run(struct free_map *map, int count);
+int free_map_alloc_run_near(struct free_map *map, int count, int goal);
+int free_map_alloc_n(struct free_map *map, int count, int *out);
+int free_group_spread(void);
+void free_map_free(struct free_map *map, int num);
+void free_map_setup(void);
+void free_map_recount(void);
+void free_map_release(void);
+void free_map_reset(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,23 +1,171 @@
 // this contains function to open and close to file that holds the file system image
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "image.h"
+#include "block.h"
+#include "cache.h"
+#include "inode.h"
+#include "free.h"
+#include "dcache.h"
+#include "superblock.h"
+#include "file.h"
+#include "async.h"
+#include "journal.h"
 
 // global variables
 int image_fd;
 
+// mmap backend. the whole reservation is claimed up front so the
+// mapping never moves when the image grows, which keeps pointers
+// handed out by bget() valid
+unsigned char *image_map = NULL;
+static size_t image_map_size = 0;
+static unsigned char *dirty_pages = NULL;
+// growing the mapping is serialized, using it isn't
+static pthread_mutex_t image_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // open the image file of the given name, create it if it doesn't exist, and truncate
-// to 0 size if truncate is true. use open() to create the file
-int image_open(char *filename, int truncate){
-    if(truncate){
+// to 0 size if IMAGE_TRUNCATE is set. use open() to create the file.
+// IMAGE_MMAP maps the image so blocks are accessed in place
+int image_open(char *filename, int flags){
+    // cached blocks belong to whatever image was open before
+    cache_invalidate();
+    free_map_reset();
+    if(flags & IMAGE_TRUNCATE){
         image_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
     } else {
         image_fd = open(filename, O_RDWR | O_CREAT, 0600);
     }
+    if (image_fd != FAILED && (flags & IMAGE_MMAP)) {
+        void *reserve = mmap(NULL, IMAGE_MAP_RESERVE, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserve == MAP_FAILED) {
+            close(image_fd);
+            return FAILED;
+        }
+        image_map = reserve;
+        image_map_size = 0;
+        dirty_pages = calloc(IMAGE_MAP_RESERVE / BLOCK_SIZE / 8, 1);
+        if (dirty_pages == NULL)
+            exit(1);
+    }
+    // pick up the layout from the superblock. an image too short to
+    // have one gets the default layout
+    struct stat st;
+    superblock_defaults();
+    if (image_fd != FAILED && fstat(image_fd, &st) == 0 && st.st_size >= BLOCK_SIZE &&
+        superblock_load() == FAILED) {
+        image_close();
+        return FAILED;
+    }
+    // finish whatever the journal holds from before a crash
+    if (image_fd != FAILED) {
+        if (journal_open() == FAILED) {
+            image_close();
+            return FAILED;
+        }
+        superblock_recount();
+    }
     return image_fd;
 }
 
+// map the image far enough to cover block_num and return a pointer to
+// the block. IMAGE_MAP_WRITE grows the file when the block lies past
+// its end; a read there returns NULL and leaves the file alone, the
+// block reads as zeros
+unsigned char *image_map_block(int block_num, int access){
+    size_t needed = (size_t)(block_num + 1) * BLOCK_SIZE;
+
+    if (needed > IMAGE_MAP_RESERVE)
+        exit(1);
+
+    if (needed > __atomic_load_n(&image_map_size, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&image_map_lock);
+        struct stat st;
+        if (fstat(image_fd, &st) == FAILED)
+            exit(1);
+
+        size_t size = st.st_size;
+        if (size < needed) {
+            if (access == IMAGE_MAP_READ) {
+                pthread_mutex_unlock(&image_map_lock);
+                return NULL;
+            }
+            if (ftruncate(image_fd, needed) == FAILED)
+                exit(1);
+            size = needed;
+        }
+        // round down to whole blocks, a trailing partial block is
+        // never handed out
+        size -= size % BLOCK_SIZE;
+        // only the new part is mapped, so blocks other threads are
+        // using are never remapped under them
+        if (size > image_map_size) {
+            if (mmap(image_map + image_map_size, size - image_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, image_fd, image_map_size) == MAP_FAILED)
+                exit(1);
+            __atomic_store_n(&image_map_size, size, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&image_map_lock);
+    }
+
+    return image_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+// record that block_num was modified through the mapping
+void image_map_dirty(int block_num){
+    __atomic_fetch_or(&dirty_pages[block_num / 8], 1 << (block_num % 8), __ATOMIC_RELAXED);
+}
+
+// msync each run of dirty blocks
+void image_map_sync(void){
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t blocks = image_map_size / BLOCK_SIZE;
+    size_t i = 0;
+
+    while (i < blocks) {
+        if (!(dirty_pages[i / 8] & (1 << (i % 8)))) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < blocks && (dirty_pages[i / 8] & (1 << (i % 8)))) {
+            dirty_pages[i / 8] &= ~(1 << (i % 8));
+            i++;
+        }
+        uintptr_t addr = (uintptr_t)(image_map + start * BLOCK_SIZE);
+        uintptr_t end = (uintptr_t)(image_map + i * BLOCK_SIZE);
+        addr -= addr % page;
+        if (msync((void *)addr, end - addr, MS_SYNC) == FAILED)
+            exit(1);
+    }
+}
+
 // close the image file. use close() to close the file
 int image_close(void){
+    file_close_all();
+    dcache_clear();
+    inode_sync();
+    superblock_sync();
+    journal_close();
+    invalidate_incore_inodes();
+    free_map_release();
+    bflush();
+    cache_invalidate();
+    // the ring holds a file descriptor of its own
+    async_shutdown();
+    if (image_map != NULL) {
+        munmap(image_map, IMAGE_MAP_RESERVE);
+        free(dirty_pages);
+        image_map = NULL;
+        dirty_pages = NULL;
+        image_map_size = 0;
+    }
     return close(image_fd);
-}
\ No newline at end of file
+}
@@ -1,9 +1,24 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
-int image_open(char *filename, int truncate);
+// image_open() flags
+#define IMAGE_TRUNCATE 1
+#define IMAGE_MMAP 2
+
+// address space claimed for a mapped image
+#define IMAGE_MAP_RESERVE ((size_t)1 << 36)
+
+// image_map_block() access
+#define IMAGE_MAP_READ 0
+#define IMAGE_MAP_WRITE 1
+
+int image_open(char *filename, int flags);
 int image_close(void);
+unsigned char *image_map_block(int block_num, int access);
+void image_map_dirty(int block_num);
+void image_map_sync(void);
 
 extern int image_fd;
+extern unsigned char *image_map;
 
 #endif
\ No newline at end of file
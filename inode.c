@@ -3,49 +3,234 @@
 #include "inode.h"
 #include "pack.h"
 #include "pack.c"
+#include "directory.h"
+#include "dcache.h"
+#include "superblock.h"
+#include "extent.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-static struct inode incore[MAX_SYS_OPEN_FILES] = {0};
+// in-core inode table, sized at startup by inode_table_init().
+// referenced inodes are found through the hash; unreferenced ones stay
+// hashed on an lru list so a later iget() can revive them without I/O
+static struct inode *incore = NULL;
+static int incore_count = 0;
+static struct inode **incore_hash = NULL;
+static unsigned int incore_hash_mask = 0;
 
-// find the first free in-core inode within the incore array
-struct inode *find_incore_free(void){
-	for (int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
-		// check if reference is 0
-		struct inode *temp_incore = &incore[i];
+// unreferenced inodes, most recently released at the head. slots that
+// never held an inode sit at the tail so they get used first
+static struct inode *lru_head = NULL;
+static struct inode *lru_tail = NULL;
+
+// locking: each hash chain, and the hashing of the inodes on it, is
+// covered by one of the stripe locks, picked by bucket. the lru list
+// has a lock of its own, always taken after a stripe lock and never
+// while holding another stripe. ref_count is changed atomically, so
+// taking and dropping extra references costs no lock at all
+static pthread_mutex_t stripe_locks[INODE_LOCK_STRIPES] = {
+	[0 ... INODE_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t incore_once = PTHREAD_ONCE_INIT;
+
+static unsigned int incore_bucket(unsigned int inode_num)
+{
+	return inode_num * 2654435761u & incore_hash_mask;
+}
+
+static pthread_mutex_t *incore_stripe(unsigned int inode_num)
+{
+	return &stripe_locks[incore_bucket(inode_num) % INODE_LOCK_STRIPES];
+}
+
+// every lock in the table, in order, for whole-table operations
+static void incore_lock_all(void)
+{
+	for (int i = 0; i < INODE_LOCK_STRIPES; i++)
+		pthread_mutex_lock(&stripe_locks[i]);
+	pthread_mutex_lock(&lru_lock);
+}
+
+static void incore_unlock_all(void)
+{
+	pthread_mutex_unlock(&lru_lock);
+	for (int i = INODE_LOCK_STRIPES - 1; i >= 0; i--)
+		pthread_mutex_unlock(&stripe_locks[i]);
+}
+
+static void lru_unlink(struct inode *in)
+{
+	if (in->lru_prev != NULL)
+		in->lru_prev->lru_next = in->lru_next;
+	else
+		lru_head = in->lru_next;
+
+	if (in->lru_next != NULL)
+		in->lru_next->lru_prev = in->lru_prev;
+	else
+		lru_tail = in->lru_prev;
+
+	in->lru_prev = in->lru_next = NULL;
+	in->in_lru = 0;
+}
+
+static void lru_push(struct inode *in, int front)
+{
+	in->in_lru = 1;
+	if (front) {
+		in->lru_prev = NULL;
+		in->lru_next = lru_head;
+		if (lru_head != NULL)
+			lru_head->lru_prev = in;
+		lru_head = in;
+		if (lru_tail == NULL)
+			lru_tail = in;
+	} else {
+		in->lru_next = NULL;
+		in->lru_prev = lru_tail;
+		if (lru_tail != NULL)
+			lru_tail->lru_next = in;
+		lru_tail = in;
+		if (lru_head == NULL)
+			lru_head = in;
+	}
+}
 
-		if (temp_incore->ref_count == 0) {
-			return temp_incore;
+static void incore_unhash(struct inode *in)
+{
+	if (!in->hashed)
+		return;
+
+	struct inode **link = &incore_hash[incore_bucket(in->inode_num)];
+	while (*link != NULL) {
+		if (*link == in) {
+			*link = in->hash_next;
+			break;
 		}
+		link = &(*link)->hash_next;
 	}
-	return NULL;
+	in->hashed = 0;
 }
 
-// find an incore inode record in the incore array
-// by the inode number
-struct inode *find_incore(unsigned int inode_num){
-	for (int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
-		// check if reference is 0
-		struct inode *temp_incore = &incore[i];
+static void incore_hash_insert(struct inode *in)
+{
+	unsigned int bucket = incore_bucket(in->inode_num);
 
-		if(temp_incore->inode_num == inode_num){
-			if(temp_incore->ref_count != 0){
-				return temp_incore;
-			}
+	in->hash_next = incore_hash[bucket];
+	incore_hash[bucket] = in;
+	in->hashed = 1;
+}
+
+// set up the in-core inode table with room for capacity inodes. must
+// be called before any inode is in use
+int inode_table_init(int capacity)
+{
+	if (capacity <= 0)
+		return FAILED;
+
+	if (incore != NULL) {
+		for (int i = 0; i < incore_count; i++)
+			pthread_rwlock_destroy(&incore[i].lock);
+	}
+	free(incore);
+	free(incore_hash);
+
+	unsigned int buckets = 1;
+	while (buckets < (unsigned int)capacity)
+		buckets <<= 1;
+
+	incore = calloc(capacity, sizeof(struct inode));
+	incore_hash = calloc(buckets, sizeof(struct inode *));
+	if (incore == NULL || incore_hash == NULL)
+		exit(1);
+
+	incore_count = capacity;
+	incore_hash_mask = buckets - 1;
+	lru_head = lru_tail = NULL;
+	for (int i = 0; i < capacity; i++) {
+		pthread_rwlock_init(&incore[i].lock, NULL);
+		lru_push(&incore[i], 0);
+	}
+
+	return 0;
+}
+
+int inode_table_capacity(void)
+{
+	return incore_count;
+}
+
+static void incore_default_init(void)
+{
+	if (incore == NULL)
+		inode_table_init(MAX_SYS_OPEN_FILES);
+}
+
+static void incore_ready(void)
+{
+	pthread_once(&incore_once, incore_default_init);
+}
+
+// find a free in-core inode: an empty slot if there is one, otherwise
+// the least recently released inode
+struct inode *find_incore_free(void){
+	incore_ready();
+	pthread_mutex_lock(&lru_lock);
+	struct inode *in = lru_tail;
+	pthread_mutex_unlock(&lru_lock);
+	return in;
+}
+
+// hash lookup, with the inode's stripe lock held
+static struct inode *find_incore_locked(unsigned int inode_num)
+{
+	for (struct inode *in = incore_hash[incore_bucket(inode_num)]; in != NULL; in = in->hash_next) {
+		if (in->inode_num == inode_num) {
+			return in;
 		}
 	}
 	return NULL;
 }
 
+// find an incore inode record by the inode number. this finds
+// unreferenced inodes that are still cached as well
+struct inode *find_incore(unsigned int inode_num){
+	incore_ready();
+	pthread_mutex_t *stripe = incore_stripe(inode_num);
+	pthread_mutex_lock(stripe);
+	struct inode *in = find_incore_locked(inode_num);
+	pthread_mutex_unlock(stripe);
+	return in;
+}
+
+// inode table block that holds inode_num's record
+static int inode_block_num(unsigned int inode_num)
+{
+	int group = inode_num / sb.inodes_per_group;
+	int per_block = BLOCK_SIZE / sb.inode_size;
+	return group_inode_table(group) + inode_num % sb.inodes_per_group / per_block;
+}
+
+// where inode_num's record starts in its inode table block
+static int inode_record_offset(unsigned int inode_num)
+{
+	int per_block = BLOCK_SIZE / sb.inode_size;
+	return inode_num % sb.inodes_per_group % per_block * sb.inode_size;
+}
+
 // take a pointer to an empty struct inode to read
 // data into.
 void read_inode(struct inode *in, int inode_num){
 	// helper code from project spec
-	int block_num = inode_num / INODES_PER_BLOCK + INODE_FIRST_BLOCK;
-	int block_offset = inode_num % INODES_PER_BLOCK;
-	int block_offset_bytes = block_offset * INODE_SIZE;
-	unsigned char read_buffer[BLOCK_SIZE];
-	bread(block_num, read_buffer);
+	int block_num = inode_block_num(inode_num);
+	int block_offset_bytes = inode_record_offset(inode_num);
+	// parse the record in place instead of copying the block out
+	unsigned char *read_buffer = bget(block_num);
 
 	// layout of data as stored on disk for each record
 	// read using functions from pack.c
@@ -55,77 +240,278 @@ void read_inode(struct inode *in, int inode_num){
     in->flags = read_u8(read_buffer + block_offset_bytes + FLAGS_OFFSET);
     in->link_count = read_u8(read_buffer + block_offset_bytes + LINK_COUNT_OFFSET);
 
-    // read pointers to inode using functions from pack.c
-    int block_pointer_address = BLOCK_POINTER_OFFSET;
-    for (int i = 0; i < INODE_PTR_COUNT; i++) {
-    	in->block_ptr[i] = read_u16(read_buffer + block_offset_bytes + block_pointer_address);
-    	block_pointer_address += 2;
-    }	
+    // the extents kept in the inode, the rest are in the extent block
+    for (int i = 0; i < INODE_EXTENT_COUNT; i++) {
+    	unpack_extent(read_buffer + block_offset_bytes + EXTENT_OFFSET + i * EXTENT_SIZE, &in->extents[i]);
+    }
+    in->extent_block = read_u32(read_buffer + block_offset_bytes + EXTENT_BLOCK_OFFSET);
+    in->extent_count = read_u16(read_buffer + block_offset_bytes + EXTENT_COUNT_OFFSET);
+    in->index_block = read_u32(read_buffer + block_offset_bytes + INDEX_BLOCK_OFFSET);
+    // only records big enough for an inline area have the flag
+    in->inline_data = 0;
+    if (sb.inode_size == INODE_SIZE_INLINE) {
+    	in->inline_data = read_u8(read_buffer + block_offset_bytes + INLINE_DATA_OFFSET);
+    	memcpy(in->inline_buf, read_buffer + block_offset_bytes + INODE_SIZE, INODE_INLINE_MAX);
+    }
+	brelse(block_num);
 }
 
-// stores inode data pointed to by in on disk
+// lay the inode out in its on-disk record
+static void pack_inode(unsigned char *record, struct inode *in)
+{
+	// layout of data as stored on disk for each record
+	// write functions from pack.c
+ 	write_u32(record, in->size);
+    write_u16(record + OWNER_ID_OFFSET, in->owner_id);
+    write_u8(record + PERMISSIONS_OFFSET, in->permissions);
+    write_u8(record + FLAGS_OFFSET, in->flags);
+    write_u8(record + LINK_COUNT_OFFSET, in->link_count);
+    // the extents kept in the inode
+    for (int i = 0; i < INODE_EXTENT_COUNT; i++) {
+    	pack_extent(record + EXTENT_OFFSET + i * EXTENT_SIZE, &in->extents[i]);
+    }
+    write_u32(record + INDEX_BLOCK_OFFSET, in->index_block);
+    write_u32(record + EXTENT_BLOCK_OFFSET, in->extent_block);
+    write_u16(record + EXTENT_COUNT_OFFSET, in->extent_count);
+    if (sb.inode_size == INODE_SIZE_INLINE) {
+    	write_u8(record + INLINE_DATA_OFFSET, in->inline_data);
+    	memcpy(record + INODE_SIZE, in->inline_buf, INODE_INLINE_MAX);
+    }
+}
+
+// stores inode data pointed to by in on disk. the inode table block is
+// shared with other inodes, so only this inode's record is changed
 void write_inode(struct inode *in){
 	int inode_num = in->inode_num;
 	// helper code from project spec
-	int block_num = inode_num / INODES_PER_BLOCK + INODE_FIRST_BLOCK;
-	int block_offset = inode_num % INODES_PER_BLOCK;
-	int block_offset_bytes = block_offset * INODE_SIZE;
-	unsigned char write_buffer[BLOCK_SIZE];
+	int block_num = inode_block_num(inode_num);
+	int block_offset_bytes = inode_record_offset(inode_num);
+	STATS_START(started);
+	unsigned char *write_buffer = bget(block_num);
 
-	// layout of data as stored on disk for each record
-	// write functions from pack.c
- 	write_u32(write_buffer + block_offset_bytes, in->size);
-    write_u16(write_buffer + block_offset_bytes + OWNER_ID_OFFSET, in->owner_id);
-    write_u8(write_buffer + block_offset_bytes + PERMISSIONS_OFFSET, in->permissions);
-    write_u8(write_buffer + block_offset_bytes + FLAGS_OFFSET, in->flags);
-    write_u8(write_buffer + block_offset_bytes + LINK_COUNT_OFFSET, in->link_count);
-    // write pointers to inode using functions from pack.c
-    int block_pointer_address = BLOCK_POINTER_OFFSET;
-    for (int i = 0; i < INODE_PTR_COUNT; i++) {
-    	write_u16(write_buffer + block_offset_bytes + block_pointer_address, in->block_ptr[i]);
-    	block_pointer_address += 2;
-    }
-    // write to disk
-	bwrite(block_num, write_buffer);
+	pack_inode(write_buffer + block_offset_bytes, in);
+	in->dirty = 0;
+
+	bdirty(block_num);
+	brelse(block_num);
+	STATS_END(STAT_INODE_WRITEBACK, started, sb.inode_size);
+}
+
+// the in-core inode changed and has to reach the disk eventually
+void mark_inode_dirty(struct inode *in){
+	in->dirty = 1;
+	// under a handle it goes into the log with the rest of the update
+	journal_dirty_inode(in);
+}
+
+static int compare_inode_nums(const void *a, const void *b)
+{
+	unsigned int x = (*(struct inode * const *)a)->inode_num;
+	unsigned int y = (*(struct inode * const *)b)->inode_num;
+
+	return (x > y) - (x < y);
+}
+
+// write back every dirty in-core inode. dirty inodes are grouped by
+// inode table block so each block is updated once however many of its
+// inodes changed
+void inode_sync(void){
+	if (incore == NULL) {
+		return;
+	}
+
+	struct inode **dirty = malloc(sizeof(struct inode *) * incore_count);
+	int dirty_count = 0;
+	if (dirty == NULL) {
+		exit(1);
+	}
+	// hold a reference to each dirty inode so it stays put while it's
+	// written, without keeping the whole table locked
+	incore_lock_all();
+	for (int i = 0; i < incore_count; i++) {
+		if (incore[i].hashed && incore[i].dirty) {
+			if (__atomic_fetch_add(&incore[i].ref_count, 1, __ATOMIC_ACQ_REL) == 0 && incore[i].in_lru) {
+				lru_unlink(&incore[i]);
+			}
+			dirty[dirty_count++] = &incore[i];
+		}
+	}
+	incore_unlock_all();
+	qsort(dirty, dirty_count, sizeof(struct inode *), compare_inode_nums);
+
+	TRACE_ENTER(TRACE_OP_INODE_SYNC);
+	int i = 0;
+	while (i < dirty_count) {
+		int block_num = inode_block_num(dirty[i]->inode_num);
+		unsigned char *block = bget(block_num);
+		// every dirty inode that lives in this table block
+		while (i < dirty_count &&
+		       inode_block_num(dirty[i]->inode_num) == block_num) {
+			STATS_START(started);
+			inode_lock_shared(dirty[i]);
+			pack_inode(block + inode_record_offset(dirty[i]->inode_num), dirty[i]);
+			dirty[i]->dirty = 0;
+			inode_unlock(dirty[i]);
+			STATS_END(STAT_INODE_WRITEBACK, started, sb.inode_size);
+			i++;
+		}
+		bdirty(block_num);
+		brelse(block_num);
+	}
+	TRACE_LEAVE();
+
+	for (i = 0; i < dirty_count; i++) {
+		iput(dirty[i]);
+	}
+	free(dirty);
 }
 
+// drop every reference. the inodes stay cached on the lru list
 void clear_incore_inodes(void)
 {
-	for (int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
-		incore[i].ref_count = 0;
+	incore_ready();
+	incore_lock_all();
+	for (int i = 0; i < incore_count; i++) {
+		if (incore[i].ref_count != 0) {
+			incore[i].ref_count = 0;
+			if (!incore[i].in_lru)
+				lru_push(&incore[i], 1);
+		}
 	}
+	incore_unlock_all();
 }
 
 void mark_incore_in_use(void)
 {
-	for (int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
+	incore_ready();
+	incore_lock_all();
+	for (int i = 0; i < incore_count; i++) {
+		if (incore[i].in_lru) {
+			lru_unlink(&incore[i]);
+		}
 		incore[i].ref_count = 1;
 	}
+	incore_unlock_all();
+}
+
+// forget the unreferenced cached inodes, e.g. when the image they
+// came from is closed or reformatted. anything unsynced is discarded
+void invalidate_incore_inodes(void)
+{
+	if (incore == NULL)
+		return;
+	incore_lock_all();
+	for (struct inode *in = lru_head; in != NULL; in = in->lru_next) {
+		incore_unhash(in);
+		in->dirty = 0;
+	}
+	incore_unlock_all();
+}
+
+// take an unreferenced inode off the lru list for reuse, written back
+// and unhashed. returns NULL if every inode is referenced
+static struct inode *incore_claim(void)
+{
+	for (;;) {
+		pthread_mutex_lock(&lru_lock);
+		struct inode *in = lru_tail;
+		if (in != NULL) {
+			lru_unlink(in);
+		}
+		pthread_mutex_unlock(&lru_lock);
+		if (in == NULL || !in->hashed) {
+			return in;
+		}
+
+		pthread_mutex_t *stripe = incore_stripe(in->inode_num);
+		pthread_mutex_lock(stripe);
+		// someone revived it between the two locks, it's theirs now
+		if (__atomic_load_n(&in->ref_count, __ATOMIC_ACQUIRE) != 0) {
+			pthread_mutex_unlock(stripe);
+			continue;
+		}
+		// a dirty inode has to be written before its slot is reused,
+		// and before anyone can miss it in the hash and read the disk
+		if (in->dirty) {
+			write_inode(in);
+		}
+		incore_unhash(in);
+		pthread_mutex_unlock(stripe);
+		return in;
+	}
+}
+
+// the inode's last reference is gone, cache it on the lru list unless
+// it was revived in the meantime
+static void incore_release(struct inode *in)
+{
+	pthread_mutex_t *stripe = incore_stripe(in->inode_num);
+
+	pthread_mutex_lock(stripe);
+	if (__atomic_load_n(&in->ref_count, __ATOMIC_ACQUIRE) == 0 && !in->in_lru) {
+		pthread_mutex_lock(&lru_lock);
+		lru_push(in, 1);
+		pthread_mutex_unlock(&lru_lock);
+	}
+	pthread_mutex_unlock(stripe);
 }
 
 // iget function to return a pointer to an incore inode
 // for a given inode number, following project spec algorithm
 struct inode *iget(int inode_num){
-	// use find_incore() to search for inode number incore
-	struct inode *incore_inode = find_incore(inode_num);
-	// if found
-	if (incore_inode != NULL) {
-		// increment the ref count and return the pointer
-		incore_inode->ref_count++;
-		return incore_inode;
-	} else {
+	STATS_START(started);
+	incore_ready();
+	pthread_mutex_t *stripe = incore_stripe(inode_num);
+
+	for (;;) {
+		pthread_mutex_lock(stripe);
+		// use find_incore() to search for inode number incore
+		struct inode *incore_inode = find_incore_locked(inode_num);
+		// if found
+		if (incore_inode != NULL) {
+			// increment the ref count. an unreferenced inode is revived
+			// straight off the lru list
+			if (__atomic_fetch_add(&incore_inode->ref_count, 1, __ATOMIC_ACQ_REL) == 0 &&
+			    incore_inode->in_lru) {
+				pthread_mutex_lock(&lru_lock);
+				lru_unlink(incore_inode);
+				pthread_mutex_unlock(&lru_lock);
+			}
+			pthread_mutex_unlock(stripe);
+			STATS_END(STAT_IGET_HIT, started, 0);
+			return incore_inode;
+		}
+		pthread_mutex_unlock(stripe);
+
 		// else, find a free incore inode
-		struct inode *available_incore = find_incore_free();
-		// if none found, return null
+		struct inode *available_incore = incore_claim();
+		// if none found, return null. the miss is still counted
 		if (available_incore == NULL) {
+			STATS_END(STAT_IGET_READ, started, 0);
 			return NULL;
 		}
+
+		pthread_mutex_lock(stripe);
+		// another thread read it in while we found a slot, use theirs
+		if (find_incore_locked(inode_num) != NULL) {
+			pthread_mutex_lock(&lru_lock);
+			lru_push(available_incore, 0);
+			pthread_mutex_unlock(&lru_lock);
+			pthread_mutex_unlock(stripe);
+			continue;
+		}
 		// read the data from disk into read_inode()
+		TRACE_ENTER(TRACE_OP_IGET);
 		read_inode(available_incore, inode_num);
+		TRACE_LEAVE();
+		available_incore->dirty = 0;
 		// set inode ref_count to 1
 		available_incore->ref_count = 1;
 		// set inode's inode_num to inode num that was passed in
 		available_incore->inode_num = inode_num;
+		incore_hash_insert(available_incore);
+		pthread_mutex_unlock(stripe);
+		STATS_END(STAT_IGET_READ, started, sb.inode_size);
 		// return the pointer to the inode
 		return available_incore;
 	}
@@ -133,18 +519,37 @@ struct inode *iget(int inode_num){
 
 // opposite of iget(), frees the node if no one is using it
 void iput(struct inode *in){
-	// if ref_count on in is already 0, return
-	if (in->ref_count == 0) {
-		return;
-	} else {
-		// decrement ref count
-		in->ref_count--;
-		// if ref_count is 0
-		if(in->ref_count == 0) {
-			// save the inode to disk with write_inode()
-			write_inode(in);
+	STATS_START(started);
+	unsigned int ref = __atomic_load_n(&in->ref_count, __ATOMIC_ACQUIRE);
+
+	// if ref_count on in is already 0, return. otherwise decrement it,
+	// retrying if another thread changed it first
+	do {
+		if (ref == 0) {
+			STATS_END(STAT_IPUT, started, 0);
+			return;
 		}
+	} while (!__atomic_compare_exchange_n(&in->ref_count, &ref, ref - 1, 0,
+					      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	// if ref_count is 0, keep it cached in case it's wanted again soon.
+	// a dirty inode is written by inode_sync() or when its slot is reused
+	if (ref == 1) {
+		incore_release(in);
 	}
+	STATS_END(STAT_IPUT, started, 0);
+}
+
+void inode_lock(struct inode *in){
+	pthread_rwlock_wrlock(&in->lock);
+}
+
+void inode_lock_shared(struct inode *in){
+	pthread_rwlock_rdlock(&in->lock);
+}
+
+void inode_unlock(struct inode *in){
+	pthread_rwlock_unlock(&in->lock);
 }
 
 // helper function to create a new incor einode
@@ -155,30 +560,27 @@ void new_incore_inode(struct inode *in, int inode_num)
 	in->owner_id = 0;
 	in->permissions = 0;
 	in->flags = 0;
-    for (int i = 0; i < INODE_PTR_COUNT; i++) {
-    	in->block_ptr[i] = 0;
-    }
+	in->link_count = 0;
+    memset(in->extents, 0, sizeof(in->extents));
+    in->extent_count = 0;
+    in->extent_block = 0;
+    in->index_block = 0;
+    in->inline_data = 0;
+    memset(in->inline_buf, 0, sizeof(in->inline_buf));
     // give it an inode number
     in->inode_num = inode_num;
 }
 
 // allocate blocks from theri respective free maps
 // expanded for project 6
-struct inode *ialloc(void){
-	unsigned char block[BLOCK_SIZE] = {0};
-    // get the inode map
-	bread(1, block);
-    // locate a free inode
-	int num = find_free(block);
+static struct inode *ialloc_one(int goal){
+    // locate a free inode in the inode map and mark it as non free
+	int num = free_map_alloc_near(&inode_map, goal);
 
     // if there are no free inodes, return null
 	if (num == FAILED) {
 		return NULL;
 	} else {
-        // mark it as non free
-		set_free(block, num, 1);
-        // save inode back out to disk
-		bwrite(1, block);
 	    // Get an in-core version of the inode (iget())
 		struct inode *incore_inode = iget(num);
 	    // If not found:
@@ -187,16 +589,187 @@ struct inode *ialloc(void){
 	    } else {
 		    // Initialize the inode:
 	    	new_incore_inode(incore_inode, num);
-		    // Save the inode to disk (write_inode())
-	    	write_inode(incore_inode);
+		    // it reaches the disk with the next inode_sync()
+	    	mark_inode_dirty(incore_inode);
 		    // Return the pointer to the in-core inode.
 	    	return incore_inode;
 	    }
 	}
 }
 
+static struct inode *ialloc_goal(int goal){
+	STATS_START(started);
+	TRACE_ENTER(TRACE_OP_IALLOC);
+	struct inode *in = ialloc_one(goal);
+	TRACE_LEAVE();
+	STATS_END(STAT_IALLOC, started, 0);
+	return in;
+}
+
+struct inode *ialloc(void){
+	return ialloc_goal(FAILED);
+}
+
+// allocate an inode for something new in the directory parent, placed
+// for locality. it takes the first free inode after the parent's, so
+// siblings share inode table blocks with each other and the parent.
+// a directory made at the top of the tree starts a new group chosen by
+// free_group_spread() instead, so separate trees don't crowd each other
+struct inode *ialloc_near(struct inode *parent, int directory){
+	int goal = parent->inode_num;
+
+	if (directory && parent->inode_num == ROOT_INODE_NUM && sb.group_count > 1) {
+		int group = free_group_spread();
+		if (group != FAILED) {
+			goal = group * sb.inodes_per_group;
+		}
+	}
+	return ialloc_goal(goal);
+}
+
+// allocate count inodes in one pass over the inode map and return
+// them initialized and referenced in out. all or nothing: returns count,
+// or FAILED with nothing allocated
+int ialloc_n(int count, struct inode **out){
+	int nums[count > 0 ? count : 1];
+
+	if (free_map_alloc_n(&inode_map, count, nums) == FAILED) {
+		return FAILED;
+	}
+	inode_prefetch(nums, count);
+	for (int i = 0; i < count; i++) {
+		out[i] = iget(nums[i]);
+		// out of in-core inodes, undo the whole batch
+		if (out[i] == NULL) {
+			for (int j = 0; j < i; j++) {
+				iput(out[j]);
+			}
+			for (int j = 0; j < count; j++) {
+				free_map_free(&inode_map, nums[j]);
+			}
+			return FAILED;
+		}
+		new_incore_inode(out[i], nums[i]);
+		mark_inode_dirty(out[i]);
+	}
+	return count;
+}
+
+// fetch the inode table blocks behind a batch of inodes in one go, so
+// the iget()s that follow don't each wait on their own miss
+void inode_prefetch(int *inode_nums, int count){
+	int block_nums[count > 0 ? count : 1];
+
+	for (int i = 0; i < count; i++) {
+		block_nums[i] = inode_block_num(inode_nums[i]);
+	}
+	bprefetch(block_nums, count);
+}
+
+struct stat_slot {
+	int block_num;
+	int index;
+};
+
+static int compare_stat_slots(const void *a, const void *b)
+{
+	const struct stat_slot *x = a;
+	const struct stat_slot *y = b;
+
+	if (x->block_num != y->block_num) {
+		return x->block_num < y->block_num ? -1 : 1;
+	}
+	return x->index - y->index;
+}
+
+// the attributes of a batch of inodes, for listings. an inode that's
+// in core may be newer than its record, so it's copied from there. the
+// rest are parsed straight out of the inode table without taking
+// in-core slots, with their table blocks fetched together and each one
+// visited once however many of the batch it holds
+void inode_stat_n(unsigned int *inode_nums, int count, struct inode_stat *out){
+	struct stat_slot slots[count > 0 ? count : 1];
+	int block_nums[count > 0 ? count : 1];
+	int on_disk = 0;
+
+	for (int i = 0; i < count; i++) {
+		out[i].inode_num = inode_nums[i];
+		struct inode *in = NULL;
+		if (find_incore(inode_nums[i]) != NULL) {
+			in = iget(inode_nums[i]);
+		}
+		if (in != NULL) {
+			inode_lock_shared(in);
+			out[i].size = in->size;
+			out[i].owner_id = in->owner_id;
+			out[i].permissions = in->permissions;
+			out[i].flags = in->flags;
+			out[i].link_count = in->link_count;
+			inode_unlock(in);
+			iput(in);
+			continue;
+		}
+		slots[on_disk].block_num = inode_block_num(inode_nums[i]);
+		slots[on_disk].index = i;
+		block_nums[on_disk] = slots[on_disk].block_num;
+		on_disk++;
+	}
+	if (on_disk == 0) {
+		return;
+	}
+	bprefetch(block_nums, on_disk);
+	qsort(slots, on_disk, sizeof(struct stat_slot), compare_stat_slots);
+
+	int i = 0;
+	while (i < on_disk) {
+		int block_num = slots[i].block_num;
+		unsigned char *block = bget(block_num);
+		for (; i < on_disk && slots[i].block_num == block_num; i++) {
+			struct inode_stat *st = &out[slots[i].index];
+			unsigned char *record = block + inode_record_offset(st->inode_num);
+			st->size = read_u32(record);
+			st->owner_id = read_u16(record + OWNER_ID_OFFSET);
+			st->permissions = read_u8(record + PERMISSIONS_OFFSET);
+			st->flags = read_u8(record + FLAGS_OFFSET);
+			st->link_count = read_u8(record + LINK_COUNT_OFFSET);
+		}
+		brelse(block_num);
+	}
+}
+
+// walk an absolute path one component at a time from the root and
+// return the referenced inode it names, or NULL if any component is
+// missing or a non-directory is walked through
 struct inode *namei(char *path)
 {
-	(void) path; 
-	return iget(ROOT_INODE_NUM);
-}
\ No newline at end of file
+	// there's no current directory, so only absolute paths resolve
+	if (path == NULL || path[0] != '/') {
+		return NULL;
+	}
+
+	int inode_num = ROOT_INODE_NUM;
+	char *p = path;
+	while (*p != '\0') {
+		// skip the slashes between components
+		while (*p == '/') {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		size_t len = strcspn(p, "/");
+		char name[DIRECTORY_NAME_MAX + 1];
+		// too long to be in any directory
+		if (len > DIRECTORY_NAME_MAX) {
+			return NULL;
+		}
+		memcpy(name, p, len);
+		name[len] = '\0';
+		inode_num = directory_lookup(inode_num, name);
+		if (inode_num == FAILED) {
+			return NULL;
+		}
+		p += len;
+	}
+	return iget(inode_num);
+}
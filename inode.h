@@ -1,6 +1,8 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <pthread.h>
+
 #define FAILED -1
 #define BLOCK_SIZE 4096
 #define INODE_SIZE 64
@@ -8,18 +10,48 @@
 
 #define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
 
-#define INODE_PTR_COUNT 16
+// images made with inline data have bigger records, fewer to a table
+// block. the bytes past the first INODE_SIZE hold a small directory's
+// entries in place of a data block
+#define INODE_SIZE_INLINE 256
+#define INODE_INLINE_MAX (INODE_SIZE_INLINE - INODE_SIZE)
+
+#define INODE_EXTENT_COUNT 3
 #define MAX_SYS_OPEN_FILES 64
+#define INODE_LOCK_STRIPES 16
 
 // offsets from project spec
 #define OWNER_ID_OFFSET 4
 #define PERMISSIONS_OFFSET 6
 #define FLAGS_OFFSET 7
 #define LINK_COUNT_OFFSET 8
-#define BLOCK_POINTER_OFFSET 9
+#define EXTENT_OFFSET 9
+#define INDEX_BLOCK_OFFSET 41
+#define EXTENT_BLOCK_OFFSET 45
+#define EXTENT_COUNT_OFFSET 49
+// nonzero when the data is in the record's inline area
+#define INLINE_DATA_OFFSET 39
 
 #define ROOT_INODE_NUM 0
 
+// length file blocks from logical on, stored in consecutive disk
+// blocks from physical on
+struct extent {
+    unsigned int logical;
+    unsigned int physical;
+    unsigned short length;
+};
+
+// the attributes of an inode a listing wants, without bringing the
+// inode in core
+struct inode_stat {
+    unsigned int inode_num;
+    unsigned int size;
+    unsigned short owner_id;
+    unsigned char permissions;
+    unsigned char flags;
+    unsigned char link_count;
+};
 
 struct inode {
     unsigned int size;
@@ -27,24 +59,52 @@ struct inode {
     unsigned char permissions;
     unsigned char flags;
     unsigned char link_count;
-    unsigned short block_ptr[INODE_PTR_COUNT];
+    struct extent extents[INODE_EXTENT_COUNT];
+    unsigned short extent_count;  // including the ones in extent_block
+    unsigned int extent_block;    // overflow extents, 0 if none
+    unsigned int index_block;  // directory hash index, 0 if none
+    unsigned char inline_data;  // the data is in inline_buf, not in blocks
+    unsigned char inline_buf[INODE_INLINE_MAX];
 
-    unsigned int ref_count;  // in-core only
+    unsigned int ref_count;  // in-core only, changed atomically
     unsigned int inode_num;
+    unsigned char dirty;     // changed since it was last written
+
+    // in-core table links
+    struct inode *hash_next;
+    struct inode *lru_prev;
+    struct inode *lru_next;
+    unsigned char hashed;
+    unsigned char in_lru;
+
+    // held shared to read the inode and its data, exclusive to change them
+    pthread_rwlock_t lock;
 };
 
 // int block_num = inode_num / INODES_PER_BLOCK + INODE_FIRST_BLOCK;
 // int block_offset_bytes = block_offset * INODE_SIZE;
+int inode_table_init(int capacity);
+int inode_table_capacity(void);
 struct inode *find_incore_free(void);
 struct inode *find_incore(unsigned int inode_num);
 void read_inode(struct inode *in, int inode_num);
 void write_inode(struct inode *in);
+void mark_inode_dirty(struct inode *in);
+void inode_sync(void);
 // int flags = read_u8(block + block_offset_bytes + 7);
 void clear_incore_inodes(void);
 void mark_incore_in_use(void);
+void invalidate_incore_inodes(void);
 struct inode *iget(int inode_num);
 void iput(struct inode *in);
+void inode_lock(struct inode *in);
+void inode_lock_shared(struct inode *in);
+void inode_unlock(struct inode *in);
 struct inode *ialloc(void);
+struct inode *ialloc_near(struct inode *parent, int directory);
+int ialloc_n(int count, struct inode **out);
+void inode_prefetch(int *inode_nums, int count);
+void inode_stat_n(unsigned int *inode_nums, int count, struct inode_stat *out);
 struct inode *namei(char *path);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,858 @@
+// write-ahead metadata journal with group commit.
+//
+// operations wrap their updates in a handle. the blocks dirtied under
+// a handle join the running transaction and are tagged in the cache
+// with its id, which keeps them from being written home until that
+// transaction is committed. each handle reserves the entries it will
+// need up front, so a transaction never outgrows the log and the
+// cache, and an operation too big for one fails or is split before it
+// changes anything. a handle's journal_stop() waits for the
+// commit, and whoever commits takes every handle that has finished by
+// then: the transaction's blocks go into the log with one sequential
+// write and one fdatasync() however many operations it holds.
+//
+// once committed, blocks may be written home whenever the cache likes.
+// a background thread checkpoints when the log is half full: it
+// flushes the cache, writes home the log's copy of any committed block
+// the running transaction holds, syncs, and starts the log over. the image
+// is opened by replaying every complete transaction still in the log.
+//
+// file data isn't journaled at all, see file.c
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "block.h"
+#include "cache.h"
+#include "image.h"
+#include "inode.h"
+#include "pack.h"
+#include "superblock.h"
+#include "journal.h"
+#include "trace.h"
+
+#define LOGGED_EMPTY -1
+
+struct transaction {
+    unsigned int tid;
+    int handles;
+    int reserved;      // credits its handles hold and haven't used yet
+    int block_count;
+    int revoke_count;
+    int blocks[JOURNAL_DESC_ENTRIES];
+    int revokes[JOURNAL_DESC_ENTRIES];
+};
+
+static int enabled = 0;
+static unsigned int head = 1;  // next free block of the log
+static unsigned int committed_tid = 0;
+static int committing = 0;
+static int locked = 0;         // the running transaction takes no new handles
+static int failed = 0;         // a handle overran, nothing more is committed
+static int capacity = 0;       // most entries one transaction may hold
+static struct transaction running;
+static struct journal_stats stats = {0};
+
+// blocks in the log since the last checkpoint, an open addressing set.
+// freeing one of them needs a revoke so replay can't clobber its reuse.
+// logged_at is where in the log each one's latest committed copy is,
+// 0 once a committed revoke has made that copy dead
+static int *logged = NULL;
+static unsigned int *logged_at = NULL;
+static int logged_mask = 0;
+
+// journal_lock covers the state above. commit_lock is held across the
+// log write and checkpoints, which are the slow parts, so handles can
+// keep joining the next transaction meanwhile
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handles_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t unlocked = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+
+static pthread_t checkpointer;
+static int checkpointer_running = 0;
+static int checkpoint_wanted = 0;
+static int checkpointer_stop = 0;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+
+// the calling thread's handle
+static __thread int handle_depth = 0;
+static __thread unsigned int handle_tid = 0;
+static __thread int handle_credits = 0;
+static __thread struct inode *handle_inodes[JOURNAL_HANDLE_INODES];
+static __thread struct inode **handle_overflow = NULL;  // the rest, on the heap
+static __thread int handle_overflow_space = 0;
+static __thread int handle_inode_count = 0;
+
+// fnv-1a, carried across calls
+static unsigned int checksum(unsigned int h, const unsigned char *data, int len)
+{
+    for (int i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void sync_image(void)
+{
+    if (fdatasync(image_fd) == FAILED)
+        exit(1);
+}
+
+static void write_header(unsigned int seq)
+{
+    unsigned char block[BLOCK_SIZE] = {0};
+
+    write_u32(block + JOURNAL_MAGIC_OFFSET, JOURNAL_HEADER_MAGIC);
+    write_u32(block + JOURNAL_SEQ_OFFSET, seq);
+    block_write_disk(sb.journal_start, block);
+}
+
+static int logged_find(int block_num)
+{
+    int i = (unsigned int)block_num * 2654435761u & logged_mask;
+
+    while (logged[i] != LOGGED_EMPTY && logged[i] != block_num)
+        i = (i + 1) & logged_mask;
+    return i;
+}
+
+static void logged_clear(void)
+{
+    for (int i = 0; i <= logged_mask; i++)
+        logged[i] = LOGGED_EMPTY;
+}
+
+// start an empty log on a freshly made file system, and make it all
+// durable
+void journal_format(void)
+{
+    if (sb.journal_blocks == 0)
+        return;
+    write_header(1);
+    sync_image();
+}
+
+// ---- recovery
+
+struct revoke {
+    int block_num;
+    unsigned int seq;
+};
+
+// read the transaction at pos of the log into desc and data. returns
+// the number of log blocks it takes, or 0 if there isn't a complete,
+// intact transaction seq there
+static int read_transaction(unsigned int pos, unsigned int seq, unsigned char *desc, unsigned char **data)
+{
+    unsigned char commit[BLOCK_SIZE];
+
+    if (pos + 2 > sb.journal_blocks)
+        return 0;
+    block_read_disk(sb.journal_start + pos, desc);
+    unsigned int blocks = read_u32(desc + JOURNAL_BLOCK_COUNT_OFFSET);
+    unsigned int revokes = read_u32(desc + JOURNAL_REVOKE_COUNT_OFFSET);
+    if (read_u32(desc + JOURNAL_MAGIC_OFFSET) != JOURNAL_DESC_MAGIC ||
+        read_u32(desc + JOURNAL_SEQ_OFFSET) != seq ||
+        blocks + revokes > JOURNAL_DESC_ENTRIES ||
+        pos + 2 + blocks > sb.journal_blocks)
+        return 0;
+
+    if (blocks > 0)
+        block_readv_disk(sb.journal_start + pos + 1, data, blocks);
+    block_read_disk(sb.journal_start + pos + 1 + blocks, commit);
+
+    unsigned int sum = checksum(2166136261u, desc, BLOCK_SIZE);
+    for (unsigned int i = 0; i < blocks; i++)
+        sum = checksum(sum, data[i], BLOCK_SIZE);
+    if (read_u32(commit + JOURNAL_MAGIC_OFFSET) != JOURNAL_COMMIT_MAGIC ||
+        read_u32(commit + JOURNAL_SEQ_OFFSET) != seq ||
+        read_u32(commit + JOURNAL_CHECKSUM_OFFSET) != sum)
+        return 0;
+    return blocks + 2;
+}
+
+// replay every complete transaction in the log, oldest first, skipping
+// blocks a later transaction revoked. returns the sequence number the
+// next transaction gets
+static unsigned int journal_recover(void)
+{
+    unsigned char header[BLOCK_SIZE];
+    unsigned char desc[BLOCK_SIZE];
+
+    block_read_disk(sb.journal_start, header);
+    if (read_u32(header + JOURNAL_MAGIC_OFFSET) != JOURNAL_HEADER_MAGIC)
+        return 1;
+    unsigned int first = read_u32(header + JOURNAL_SEQ_OFFSET);
+
+    unsigned char *space = malloc((size_t)sb.journal_blocks * BLOCK_SIZE);
+    unsigned char **data = malloc(sizeof(unsigned char *) * sb.journal_blocks);
+    struct revoke *revokes = NULL;
+    if (space == NULL || data == NULL)
+        exit(1);
+    for (unsigned int i = 0; i < sb.journal_blocks; i++)
+        data[i] = space + (size_t)i * BLOCK_SIZE;
+
+    // first pass: how far the log goes, and what it revokes
+    int revoke_count = 0;
+    int revoke_space = 0;
+    unsigned int pos = 1;
+    unsigned int seq = first;
+    int len;
+    while ((len = read_transaction(pos, seq, desc, data)) > 0) {
+        unsigned int blocks = read_u32(desc + JOURNAL_BLOCK_COUNT_OFFSET);
+        unsigned int count = read_u32(desc + JOURNAL_REVOKE_COUNT_OFFSET);
+        if (revoke_count + (int)count > revoke_space) {
+            revoke_space = (revoke_count + count) * 2;
+            revokes = realloc(revokes, sizeof(struct revoke) * revoke_space);
+            if (revokes == NULL)
+                exit(1);
+        }
+        for (unsigned int i = 0; i < count; i++) {
+            revokes[revoke_count].block_num = read_u32(desc + JOURNAL_ENTRIES_OFFSET + 4 * (blocks + i));
+            revokes[revoke_count].seq = seq;
+            revoke_count++;
+        }
+        pos += len;
+        seq++;
+    }
+    unsigned int last = seq;
+
+    // second pass: write the logged blocks home
+    pos = 1;
+    for (seq = first; seq < last; seq++) {
+        len = read_transaction(pos, seq, desc, data);
+        unsigned int blocks = read_u32(desc + JOURNAL_BLOCK_COUNT_OFFSET);
+        for (unsigned int i = 0; i < blocks; i++) {
+            int block_num = read_u32(desc + JOURNAL_ENTRIES_OFFSET + 4 * i);
+            int revoked = 0;
+            for (int r = 0; r < revoke_count; r++) {
+                if (revokes[r].block_num == block_num && revokes[r].seq >= seq)
+                    revoked = 1;
+            }
+            if (!revoked)
+                block_write_disk(block_num, data[i]);
+        }
+        stats.replayed++;
+        pos += len;
+    }
+
+    free(revokes);
+    free(data);
+    free(space);
+
+    // the log is home, start it over
+    if (last != first)
+        sync_image();
+    write_header(last);
+    sync_image();
+    return last;
+}
+
+// ---- checkpoints
+
+// a block a later, uncommitted transaction dirtied again is held in
+// the cache, so its committed contents are only in the log. write the
+// log's copy home before the log is started over
+static void restore_held(void)
+{
+    unsigned char block[BLOCK_SIZE];
+    int count = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    int *held = malloc(sizeof(int) * (logged_mask + 1));
+    unsigned int *at = malloc(sizeof(unsigned int) * (logged_mask + 1));
+    if (held == NULL || at == NULL)
+        exit(1);
+    for (int i = 0; i <= logged_mask; i++) {
+        if (logged[i] != LOGGED_EMPTY && logged_at[i] != 0 && cache_journal_held(logged[i])) {
+            held[count] = logged[i];
+            at[count] = logged_at[i];
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    for (int i = 0; i < count; i++) {
+        block_read_disk(sb.journal_start + at[i], block);
+        block_write_disk(held[i], block);
+    }
+    free(at);
+    free(held);
+}
+
+// write every committed block home and empty the log. commit_lock is
+// held, so nothing is being committed meanwhile
+static void checkpoint_locked(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    unsigned int next = committed_tid + 1;
+    int empty = head == 1;
+    pthread_mutex_unlock(&journal_lock);
+    if (empty)
+        return;
+
+    // the cache holds back blocks of transactions that aren't committed
+    // yet, everything else goes out. the committed versions of the ones
+    // held back come from the log
+    bflush();
+    restore_held();
+    sync_image();
+    write_header(next);
+    sync_image();
+
+    pthread_mutex_lock(&journal_lock);
+    head = 1;
+    logged_clear();
+    stats.checkpoints++;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_checkpoint(void)
+{
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&commit_lock);
+    checkpoint_locked();
+    pthread_mutex_unlock(&commit_lock);
+}
+
+static void *checkpoint_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    for (;;) {
+        while (!checkpoint_wanted && !checkpointer_stop)
+            pthread_cond_wait(&checkpoint_cond, &journal_lock);
+        if (checkpointer_stop)
+            break;
+        checkpoint_wanted = 0;
+        pthread_mutex_unlock(&journal_lock);
+        journal_checkpoint();
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+// ---- commits
+
+// commit the running transaction. called with commit_lock held and
+// committing set
+static void commit_running(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    // let the handles in it finish, and keep new ones out meanwhile
+    locked = 1;
+    while (running.handles > 0)
+        pthread_cond_wait(&handles_done, &journal_lock);
+    // one of them overran it, so it's never committed
+    if (failed) {
+        locked = 0;
+        pthread_cond_broadcast(&unlocked);
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+
+    struct transaction txn = running;
+    int count = txn.block_count;
+    unsigned char *space = malloc((size_t)(count + 2) * BLOCK_SIZE);
+    unsigned char **log = malloc(sizeof(unsigned char *) * (count + 2));
+    if (space == NULL || log == NULL)
+        exit(1);
+    for (int i = 0; i < count + 2; i++)
+        log[i] = space + (size_t)i * BLOCK_SIZE;
+
+    // copy the blocks now, before the next transaction can touch them.
+    // they're held in the cache. bwritev() and bsubmit() go around it,
+    // but only file data is written that way and it's never logged
+    for (int i = 0; i < count; i++) {
+        if (!cache_copy(txn.blocks[i], log[i + 1]))
+            block_read_disk(txn.blocks[i], log[i + 1]);
+    }
+
+    running.tid = txn.tid + 1;
+    running.handles = 0;
+    running.reserved = 0;
+    running.block_count = 0;
+    running.revoke_count = 0;
+    locked = 0;
+    pthread_cond_broadcast(&unlocked);
+    pthread_mutex_unlock(&journal_lock);
+
+    unsigned char *desc = log[0];
+    unsigned char *commit = log[count + 1];
+    memset(desc, 0, BLOCK_SIZE);
+    memset(commit, 0, BLOCK_SIZE);
+    write_u32(desc + JOURNAL_MAGIC_OFFSET, JOURNAL_DESC_MAGIC);
+    write_u32(desc + JOURNAL_SEQ_OFFSET, txn.tid);
+    write_u32(desc + JOURNAL_BLOCK_COUNT_OFFSET, count);
+    write_u32(desc + JOURNAL_REVOKE_COUNT_OFFSET, txn.revoke_count);
+    for (int i = 0; i < count; i++)
+        write_u32(desc + JOURNAL_ENTRIES_OFFSET + 4 * i, txn.blocks[i]);
+    for (int i = 0; i < txn.revoke_count; i++)
+        write_u32(desc + JOURNAL_ENTRIES_OFFSET + 4 * (count + i), txn.revokes[i]);
+    unsigned int sum = checksum(2166136261u, desc, BLOCK_SIZE);
+    for (int i = 0; i < count; i++)
+        sum = checksum(sum, log[i + 1], BLOCK_SIZE);
+    write_u32(commit + JOURNAL_MAGIC_OFFSET, JOURNAL_COMMIT_MAGIC);
+    write_u32(commit + JOURNAL_SEQ_OFFSET, txn.tid);
+    write_u32(commit + JOURNAL_CHECKSUM_OFFSET, sum);
+
+    // make room when the log is full. the checkpoint's header names
+    // this transaction as the first one in the log
+    if (head + count + 2 > sb.journal_blocks)
+        checkpoint_locked();
+
+    // one sequential write and one sync for the whole group
+    block_writev_disk(sb.journal_start + head, log, count + 2);
+    sync_image();
+    free(log);
+    free(space);
+
+    pthread_mutex_lock(&journal_lock);
+    for (int i = 0; i < count; i++) {
+        int slot = logged_find(txn.blocks[i]);
+        logged[slot] = txn.blocks[i];
+        logged_at[slot] = head + 1 + i;
+    }
+    // replay skips a revoked block, so there's no committed copy of it
+    for (int i = 0; i < txn.revoke_count; i++) {
+        int slot = logged_find(txn.revokes[i]);
+        if (logged[slot] == txn.revokes[i])
+            logged_at[slot] = 0;
+    }
+    head += count + 2;
+    committed_tid = txn.tid;
+    cache_journal_committed(txn.tid);
+    stats.transactions++;
+    stats.blocks += count;
+    stats.revokes += txn.revoke_count;
+    if (head > sb.journal_blocks / 2) {
+        checkpoint_wanted = 1;
+        pthread_cond_signal(&checkpoint_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// wait until transaction tid is committed, committing it ourselves if
+// no one else is already at it. journal_lock is held
+static void wait_for_commit(unsigned int tid)
+{
+    while (committed_tid < tid && !failed) {
+        if (committing) {
+            pthread_cond_wait(&commit_done, &journal_lock);
+            continue;
+        }
+        committing = 1;
+        pthread_mutex_unlock(&journal_lock);
+        pthread_mutex_lock(&commit_lock);
+        commit_running();
+        pthread_mutex_unlock(&commit_lock);
+        pthread_mutex_lock(&journal_lock);
+        committing = 0;
+        pthread_cond_broadcast(&commit_done);
+    }
+}
+
+// commit whatever is in the running transaction and wait for it
+void journal_commit(void)
+{
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    if (!failed && (running.block_count > 0 || running.revoke_count > 0))
+        wait_for_commit(running.tid);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// ---- handles
+
+// entry i of the calling thread's inode list
+static struct inode **handle_inode(int i)
+{
+    if (i < JOURNAL_HANDLE_INODES)
+        return &handle_inodes[i];
+    return &handle_overflow[i - JOURNAL_HANDLE_INODES];
+}
+
+// empty the calling thread's inode list, giving back any heap it grew
+static void handle_inodes_reset(void)
+{
+    free(handle_overflow);
+    handle_overflow = NULL;
+    handle_overflow_space = 0;
+    handle_inode_count = 0;
+}
+
+// start an atomic update. handles nest, the outermost one counts. call
+// before taking any inode locks: a new handle can wait for a commit,
+// and a commit waits for the handles already in it. returns FAILED,
+// without starting a handle, once the journal has failed
+int journal_start(void)
+{
+    if (!enabled)
+        return 0;
+    if (handle_depth > 0) {
+        handle_depth++;
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    for (;;) {
+        if (failed) {
+            pthread_mutex_unlock(&journal_lock);
+            return FAILED;
+        }
+        while (locked)
+            pthread_cond_wait(&unlocked, &journal_lock);
+        // no room for another operation next to the ones already in
+        // the transaction, commit what's there first
+        if (running.block_count + running.revoke_count + running.reserved +
+            JOURNAL_HANDLE_CREDITS > capacity &&
+            (running.handles > 0 || running.block_count > 0 || running.revoke_count > 0)) {
+            wait_for_commit(running.tid);
+            continue;
+        }
+        break;
+    }
+    handle_depth = 1;
+    running.handles++;
+    handle_tid = running.tid;
+    handle_credits = JOURNAL_HANDLE_CREDITS < capacity ? JOURNAL_HANDLE_CREDITS : capacity;
+    running.reserved += handle_credits;
+    stats.handles++;
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+}
+
+// finish the update and wait until it's durable. returns FAILED if the
+// journal failed first: the update is lost along with the rest of the
+// transaction, and the image opens at the last commit before it
+int journal_stop(void)
+{
+    if (!enabled || handle_depth == 0)
+        return 0;
+    if (handle_depth > 1) {
+        handle_depth--;
+        return 0;
+    }
+
+    // inodes are written into their table blocks now, inside the
+    // handle, so those blocks join the transaction too
+    TRACE_ENTER(TRACE_OP_JOURNAL);
+    for (int i = 0; i < handle_inode_count; i++) {
+        struct inode *in = *handle_inode(i);
+        inode_lock_shared(in);
+        write_inode(in);
+        inode_unlock(in);
+        iput(in);
+    }
+    TRACE_LEAVE();
+    handle_inodes_reset();
+    handle_depth = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    running.reserved -= handle_credits;
+    handle_credits = 0;
+    if (--running.handles == 0)
+        pthread_cond_broadcast(&handles_done);
+    wait_for_commit(handle_tid);
+    int status = failed ? FAILED : 0;
+    pthread_mutex_unlock(&journal_lock);
+    return status;
+}
+
+// reserve credits more entries in the running transaction for the
+// caller's handle, before an operation that dirties or frees more than
+// JOURNAL_HANDLE_CREDITS blocks changes anything. the handle is already
+// part of the transaction, so this can't wait for a commit to make
+// room: FAILED means it's too full, and the caller fails or splits the
+// operation instead
+int journal_extend(int credits)
+{
+    if (!journal_active())
+        return 0;
+    pthread_mutex_lock(&journal_lock);
+    int room = capacity - running.block_count - running.revoke_count - running.reserved;
+    int granted = credits <= room;
+    if (granted) {
+        running.reserved += credits;
+        handle_credits += credits;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return granted ? 0 : FAILED;
+}
+
+// make sure the caller's handle has at least credits entries left
+// unused, reserving the difference. for operations that go a step at
+// a time and mostly reuse what earlier steps dirtied
+int journal_ensure(int credits)
+{
+    if (!journal_active() || handle_credits >= credits)
+        return 0;
+    return journal_extend(credits - handle_credits);
+}
+
+// the calling thread is inside a handle
+int journal_active(void)
+{
+    return enabled && handle_depth > 0;
+}
+
+// most entries the caller's handle could ever reserve, or 0 if it
+// isn't in one and there's nothing to reserve
+int journal_capacity(void)
+{
+    return journal_active() ? capacity : 0;
+}
+
+// one more entry in the running transaction, paid for out of the
+// calling handle's credits or else out of room nobody reserved. an
+// operation that overruns both can't be logged as a unit, and writing
+// its blocks home anyway would break the atomicity everything else
+// relies on. so the journal fails instead, as if the machine had
+// stopped: the running transaction is never committed, its blocks stay
+// held in the cache, and every handle after it is refused. returns
+// FAILED then. journal_lock is held
+static int take_credit(void)
+{
+    if (handle_credits > 0) {
+        handle_credits--;
+        running.reserved--;
+        return 0;
+    }
+    if (running.block_count + running.revoke_count + running.reserved >= capacity) {
+        failed = 1;
+        pthread_cond_broadcast(&commit_done);
+        return FAILED;
+    }
+    return 0;
+}
+
+// a block freed earlier in the running transaction is in use again.
+// its revoke would make replay skip the copy this transaction logs, so
+// it's dropped, and the entry goes back to the handle reusing the block
+static void cancel_revoke(int block_num)
+{
+    for (int i = 0; i < running.revoke_count; i++) {
+        if (running.revokes[i] == block_num) {
+            running.revokes[i] = running.revokes[--running.revoke_count];
+            if (journal_active()) {
+                handle_credits++;
+                running.reserved++;
+            }
+            return;
+        }
+    }
+}
+
+// add a block the cache just tagged to the running transaction.
+// previous is the transaction that had it before
+static void journal_add(int block_num, int previous)
+{
+    if (failed)
+        return;
+    cancel_revoke(block_num);
+    if (previous == (int)running.tid || take_credit() == FAILED)
+        return;
+    running.blocks[running.block_count++] = block_num;
+}
+
+// a block dirtied in place under the caller's handle. the block is
+// pinned, so it can't be written home before it's tagged
+void journal_dirty(int block_num)
+{
+    if (!journal_active())
+        return;
+    pthread_mutex_lock(&journal_lock);
+    int previous = cache_journal(block_num, running.tid);
+    if (previous != FAILED)
+        journal_add(block_num, previous);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// a whole block written under the caller's handle
+void journal_write(int block_num, unsigned char *block)
+{
+    pthread_mutex_lock(&journal_lock);
+    journal_add(block_num, cache_write_journaled(block_num, block, running.tid));
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// an inode changed under the caller's handle. it's written into the
+// log when the handle stops, so it's held until then, and changes made
+// to it after this call are logged too
+void journal_dirty_inode(struct inode *in)
+{
+    if (!journal_active())
+        return;
+    for (int i = 0; i < handle_inode_count; i++) {
+        if (*handle_inode(i) == in)
+            return;
+    }
+    // a handle that changes more inodes than usual lists the rest on
+    // the heap until it stops
+    if (handle_inode_count == JOURNAL_HANDLE_INODES + handle_overflow_space) {
+        int space = handle_overflow_space ? handle_overflow_space * 2 : JOURNAL_HANDLE_INODES;
+        struct inode **more = realloc(handle_overflow, sizeof(struct inode *) * space);
+        if (more == NULL)
+            exit(1);
+        handle_overflow = more;
+        handle_overflow_space = space;
+    }
+    *handle_inode(handle_inode_count++) = iget(in->inode_num);
+}
+
+// block_num was freed. if the log has an old copy of it, record that
+// the copy is dead so replay can't write it over the block's next use
+void journal_revoke(int block_num)
+{
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    int slot = logged_find(block_num);
+    // a copy a committed revoke already killed needs no second one
+    int logged_before = logged[slot] == block_num && logged_at[slot] != 0;
+    int in_running = 0;
+    for (int i = 0; i < running.block_count; i++) {
+        if (running.blocks[i] == block_num)
+            in_running = 1;
+    }
+    for (int i = 0; i < running.revoke_count; i++) {
+        if (running.revokes[i] == block_num)
+            logged_before = in_running = 0;
+    }
+    if (failed) {
+        // nothing more is committed, so there's nothing to revoke
+    } else if (logged_before || in_running) {
+        if (journal_active()) {
+            if (take_credit() == 0)
+                running.revokes[running.revoke_count++] = block_num;
+        } else if (running.block_count + running.revoke_count + running.reserved < capacity) {
+            // freed outside any handle, by an update that isn't
+            // journaled. it only gets room nobody reserved
+            running.revokes[running.revoke_count++] = block_num;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// ---- setup
+
+int journal_enabled(void)
+{
+    return enabled;
+}
+
+// replay the log of the image that was just opened and start
+// journaling, if the image has a journal. the mapping writes blocks
+// home behind our back, so it's recovered but not journaled
+int journal_open(void)
+{
+    enabled = 0;
+    if (sb.journal_blocks == 0)
+        return 0;
+    if (sb.journal_blocks < JOURNAL_MIN_BLOCKS)
+        return FAILED;
+
+    unsigned int next = journal_recover();
+    if (image_map != NULL)
+        return 0;
+
+    int slots = 1;
+    while (slots < (int)sb.journal_blocks * 2)
+        slots <<= 1;
+    logged = malloc(sizeof(int) * slots);
+    logged_at = malloc(sizeof(unsigned int) * slots);
+    if (logged == NULL || logged_at == NULL)
+        exit(1);
+    logged_mask = slots - 1;
+    logged_clear();
+
+    // a transaction takes a descriptor and a commit block as well, and
+    // its blocks are held in the cache until it's committed
+    capacity = sb.journal_blocks - 2;
+    if (capacity > JOURNAL_DESC_ENTRIES)
+        capacity = JOURNAL_DESC_ENTRIES;
+    if (capacity > cache_slot_count() / 2)
+        capacity = cache_slot_count() / 2;
+
+    head = 1;
+    committed_tid = next - 1;
+    cache_journal_committed(committed_tid);
+    running.tid = next;
+    running.handles = 0;
+    running.reserved = 0;
+    running.block_count = 0;
+    running.revoke_count = 0;
+    locked = 0;
+    failed = 0;
+    committing = 0;
+    checkpoint_wanted = 0;
+    checkpointer_stop = 0;
+    if (pthread_create(&checkpointer, NULL, checkpoint_thread, NULL) != 0)
+        exit(1);
+    checkpointer_running = 1;
+    enabled = 1;
+    return 0;
+}
+
+static void stop_checkpointer(void)
+{
+    if (!checkpointer_running)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    checkpointer_stop = 1;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&journal_lock);
+    pthread_join(checkpointer, NULL);
+    checkpointer_running = 0;
+}
+
+// commit and checkpoint everything, leaving an empty log
+void journal_close(void)
+{
+    if (!enabled)
+        return;
+    stop_checkpointer();
+    // a failed journal is left to be replayed, like after a crash. what
+    // the failed transaction dirtied is still held, and dropped with
+    // the cache
+    if (!failed) {
+        journal_commit();
+        journal_checkpoint();
+    }
+    enabled = 0;
+    free(logged);
+    free(logged_at);
+    logged = NULL;
+    logged_at = NULL;
+}
+
+// stop journaling without writing anything, as if the machine had
+// stopped. whatever wasn't committed is lost and the log is replayed
+// on the next open. the cache has to be dropped along with it
+void journal_abort(void)
+{
+    stop_checkpointer();
+    enabled = 0;
+    handle_depth = 0;
+    handle_credits = 0;
+    for (int i = 0; i < handle_inode_count; i++)
+        iput(*handle_inode(i));
+    handle_inodes_reset();
+    free(logged);
+    free(logged_at);
+    logged = NULL;
+    logged_at = NULL;
+}
+
+void journal_get_stats(struct journal_stats *out)
+{
+    pthread_mutex_lock(&journal_lock);
+    *out = stats;
+    pthread_mutex_unlock(&journal_lock);
+}
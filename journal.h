@@ -0,0 +1,70 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "inode.h"
+
+// write-ahead journal for metadata. updates made between
+// journal_start() and journal_stop() form one atomic unit; every block
+// they dirty is logged before it may reach its home location.
+//
+// the region starts with a header block holding the sequence number of
+// the first transaction still in the log. each transaction after it is
+// a descriptor block listing the blocks it logs and the blocks it
+// revokes, a copy of each logged block, and a commit block with a
+// checksum over all of it
+#define JOURNAL_HEADER_MAGIC 0x4a524e4c  // "JRNL"
+#define JOURNAL_DESC_MAGIC 0x4a444553    // "JDES"
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54  // "JCMT"
+#define JOURNAL_MIN_BLOCKS 16
+
+// header and commit blocks
+#define JOURNAL_MAGIC_OFFSET 0
+#define JOURNAL_SEQ_OFFSET 4
+#define JOURNAL_CHECKSUM_OFFSET 8
+
+// descriptor blocks
+#define JOURNAL_BLOCK_COUNT_OFFSET 8
+#define JOURNAL_REVOKE_COUNT_OFFSET 12
+#define JOURNAL_ENTRIES_OFFSET 16
+#define JOURNAL_DESC_ENTRIES ((BLOCK_SIZE - JOURNAL_ENTRIES_OFFSET) / 4)
+
+// entries a handle reserves in the running transaction when it starts,
+// enough for the blocks one ordinary operation dirties and frees. a
+// transaction that couldn't take another handle's worth is committed
+// before a new handle joins it. an operation that may need more asks
+// for it with journal_extend() before it changes anything
+#define JOURNAL_HANDLE_CREDITS 8
+// inodes a handle writes into the log when it stops, before it has to
+// make room for more
+#define JOURNAL_HANDLE_INODES 8
+
+struct journal_stats {
+    unsigned long handles;
+    unsigned long transactions;
+    unsigned long blocks;
+    unsigned long revokes;
+    unsigned long checkpoints;
+    unsigned long replayed;
+};
+
+int journal_open(void);
+void journal_close(void);
+void journal_abort(void);
+int journal_enabled(void);
+void journal_format(void);
+
+int journal_start(void);
+int journal_stop(void);
+int journal_extend(int credits);
+int journal_ensure(int credits);
+int journal_active(void);
+int journal_capacity(void);
+void journal_dirty(int block_num);
+void journal_write(int block_num, unsigned char *block);
+void journal_dirty_inode(struct inode *in);
+void journal_revoke(int block_num);
+void journal_commit(void);
+void journal_checkpoint(void);
+void journal_get_stats(struct journal_stats *stats);
+
+#endif
@@ -1,22 +1,121 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "inode.h"
 #include "directory.h"
 #include "block.h"
 #include "mkfs.h"
 #include "pack.h"
 #include "ls.h"
+#include "trace.h"
 
-void ls(int inode_num)
+struct ls_entry {
+    struct directory_entry ent;
+    struct inode_stat st;
+};
+
+static int compare_names(const void *a, const void *b)
+{
+    const struct ls_entry *x = a;
+    const struct ls_entry *y = b;
+
+    return strcmp(x->ent.name, y->ent.name);
+}
+
+static char type_char(unsigned char flags)
+{
+    if (flags == DIRECTORY_FLAG)
+        return 'd';
+    if (flags == FILE_FLAG)
+        return '-';
+    return '?';
+}
+
+// write all of len bytes, however many calls the kernel wants
+static int write_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == FAILED)
+            return FAILED;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// list the directory with the given inode number to fd. entries are
+// pulled out LS_BATCH at a time, and for a long listing their inodes are
+// looked up a batch at a time too, so inodes sharing an inode table
+// block share its read. the whole listing is formatted into one buffer
+// and goes out in a single write().
+// returns the number of entries listed, or FAILED
+int ls_with_options(int inode_num, int flags, int fd)
 {
     struct directory *dir;
-    struct directory_entry ent;
+    struct ls_entry *entries = NULL;
+    struct directory_entry ents[LS_BATCH];
+    int count = 0;
+    int got;
 
+    TRACE_ENTER(TRACE_OP_LS);
     dir = directory_open(inode_num);
+    if (dir == NULL) {
+        TRACE_LEAVE();
+        return FAILED;
+    }
 
-    while (directory_get(dir, &ent) != -1)
-        printf("%d %s\n", ent.inode_num, ent.name);
+    while ((got = directory_get_batch(dir, ents, LS_BATCH)) > 0) {
+        entries = realloc(entries, sizeof(struct ls_entry) * (count + got));
+        if (entries == NULL)
+            exit(1);
+        for (int i = 0; i < got; i++)
+            entries[count + i].ent = ents[i];
 
+        // still in directory order here, which keeps inodes made
+        // together in the same batch
+        if (flags & LS_LONG) {
+            unsigned int nums[LS_BATCH];
+            struct inode_stat st[LS_BATCH];
+            for (int i = 0; i < got; i++)
+                nums[i] = ents[i].inode_num;
+            inode_stat_n(nums, got, st);
+            for (int i = 0; i < got; i++)
+                entries[count + i].st = st[i];
+        }
+        count += got;
+    }
     directory_close(dir);
-}
\ No newline at end of file
+
+    if (flags & LS_SORT)
+        qsort(entries, count, sizeof(struct ls_entry), compare_names);
+
+    char *out = malloc((size_t)count * LS_LINE_MAX + 1);
+    if (out == NULL)
+        exit(1);
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        struct ls_entry *e = &entries[i];
+        if (flags & LS_LONG)
+            len += sprintf(out + len, "%c%03o %3u %5u %10u %5u %s\n",
+                           type_char(e->st.flags), e->st.permissions, e->st.link_count,
+                           e->st.owner_id, e->st.size, e->ent.inode_num, e->ent.name);
+        else
+            len += sprintf(out + len, "%u %s\n", e->ent.inode_num, e->ent.name);
+    }
+    int status = write_all(fd, out, len) == FAILED ? FAILED : count;
+
+    free(out);
+    free(entries);
+    TRACE_LEAVE();
+    return status;
+}
+
+// list the directory to standard output, in directory order
+void ls(int inode_num)
+{
+    // anything already printed through stdio goes first
+    fflush(stdout);
+    ls_with_options(inode_num, 0, STDOUT_FILENO);
+}
@@ -1,6 +1,17 @@
 #ifndef LS_H
 #define LS_H
 
+#define LS_BATCH 128
+
+// ls_with_options() flags
+#define LS_SORT 1  // by name, instead of directory order
+#define LS_LONG 2  // type, permissions, links, owner, size and inode number too
+
+// longest line a listing can produce: the long format's fields, a
+// name of up to DIRECTORY_NAME_MAX bytes and the newline
+#define LS_LINE_MAX 304
+
 void ls(int inode_num);
+int ls_with_options(int inode_num, int flags, int fd);
 
-#endif
\ No newline at end of file
+#endif
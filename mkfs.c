@@ -1,47 +1,225 @@
 #include <stdio.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include "image.h"
 #include "block.h"
+#include "cache.h"
+#include "free.h"
+#include "dcache.h"
+#include "superblock.h"
+#include "extent.h"
 #include "mkfs.h"
 #include "inode.h"
 #include "pack.h"
 #include "directory.h"
+#include "journal.h"
+#include "trace.h"
 
 // construct the file system
-// 1. zero out every block of the file system.
-// 2. mark blocks 0-6 as allocated in the free block map.
+// 1. size the image with ftruncate(), which zeros every block without
+//    writing any of them.
+// 2. write the superblock with the geometry and free counts, and
+//    mark the metadata blocks (and anything past the end of the image)
+//    as allocated in the free maps, built in memory and written together.
 // 3. add the root directory and other things to bootstrap the 
 // file system
+//
+// the inode table is never written here. the truncate leaves it all
+// zeros, and each record is initialized by ialloc() the first time
+// its inode is handed out
 
-// create the file system
-void mkfs(void)
+// inode table blocks each of groups groups needs for inode_count
+// inodes, per_block records to a block
+static int group_inode_blocks(int inode_count, int groups, int per_block)
+{
+	int per_group = (inode_count + groups - 1) / groups;
+	return (per_group + per_block - 1) / per_block;
+}
+
+void mkfs_default_options(struct mkfs_options *options)
+{
+	options->image_size = FOUR_MB_IMAGE;
+	options->inode_count = DEFAULT_INODE_COUNT;
+	options->block_size = BLOCK_SIZE;
+	options->preallocate = 0;
+	options->journal_blocks = 0;
+	options->inline_data = 0;
+	options->variable_dirents = 0;
+}
+
+static int mkfs_build(struct mkfs_options *options)
 {
-	unsigned char initialize_data[FOUR_MB_IMAGE];
-	memset(initialize_data, 0, FOUR_MB_IMAGE);
-	write(image_fd, initialize_data, FOUR_MB_IMAGE);
-	for (int i = 0; i < METADATA; i++) {
-		alloc();
+	// the block size is fixed when the library is built
+	if (options->block_size != BLOCK_SIZE) {
+		return -1;
+	}
+	long long block_count = options->image_size / BLOCK_SIZE;
+	if (options->inode_count <= 0 || block_count <= 0 || block_count > MAX_BLOCK_COUNT) {
+		return -1;
+	}
+	// inline data needs the bigger inode records
+	int inode_size = options->inline_data ? INODE_SIZE_INLINE : INODE_SIZE;
+	int per_block = BLOCK_SIZE / inode_size;
+	// a group for each block map's worth of blocks, each with an equal
+	// share of the inodes rounded up to whole inode table blocks. a last
+	// group too small to hold its own maps and table is left off
+	int groups = (block_count + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+	int inode_blocks = group_inode_blocks(options->inode_count, groups, per_block);
+	long long tail = block_count - (long long)(groups - 1) * FREE_MAP_BITS;
+	if (groups > 1 && tail <= GROUP_INODE_TABLE + inode_blocks) {
+		block_count -= tail;
+		groups--;
+		inode_blocks = group_inode_blocks(options->inode_count, groups, per_block);
+	}
+	int inodes_per_group = inode_blocks * per_block;
+	int inode_count = inodes_per_group * groups;
+	// the journal sits between group 0's inode table and its data blocks
+	int journal_start = INODE_FIRST_BLOCK + inode_blocks;
+	int metadata = journal_start + options->journal_blocks;
+	// each group's maps are a single block each, inode numbers have to
+	// fit in a directory entry, and there has to be room for the root
+	if (inodes_per_group > FREE_MAP_BITS || inode_count > MAX_INODE_COUNT ||
+	    block_count <= metadata || metadata >= FREE_MAP_BITS) {
+		return -1;
+	}
+	if (options->journal_blocks != 0 && options->journal_blocks < JOURNAL_MIN_BLOCKS) {
+		return -1;
+	}
+
+	// anything cached is from the old contents of the image, and so is
+	// anything the journal was holding
+	journal_abort();
+	cache_invalidate();
+	invalidate_incore_inodes();
+	dcache_clear();
+	free_map_reset();
+	superblock_defaults();
+
+	// throw the old contents away and size the image, sparse unless
+	// the caller wants the space reserved up front
+	off_t size = block_count * BLOCK_SIZE;
+	if (ftruncate(image_fd, 0) == -1 || ftruncate(image_fd, size) == -1) {
+		return -1;
+	}
+	if (options->preallocate && posix_fallocate(image_fd, 0, size) != 0) {
+		return -1;
+	}
+
+	// build each group's two maps in memory and write them in one pass.
+	// group 0's sit at blocks 1 and 2, the others' open their groups
+	unsigned char maps[2][BLOCK_SIZE];
+	unsigned char *map_blocks[2] = {maps[0], maps[1]};
+	for (int g = 0; g < groups; g++) {
+		long long first = (long long)g * FREE_MAP_BITS;
+		int used = g == 0 ? metadata : GROUP_INODE_TABLE + inode_blocks;
+		int blocks = block_count - first < FREE_MAP_BITS ? block_count - first : FREE_MAP_BITS;
+		memset(maps, 0, sizeof(maps));
+		for (int i = inodes_per_group; i < FREE_MAP_BITS; i++) {
+			set_free(maps[0], i, 1);
+		}
+		for (int i = 0; i < used; i++) {
+			set_free(maps[1], i, 1);
+		}
+		for (int i = blocks; i < FREE_MAP_BITS; i++) {
+			set_free(maps[1], i, 1);
+		}
+		bwritev(g == 0 ? FREE_INODE : first + GROUP_INODE_MAP, map_blocks, 2);
+	}
+
+	// record the geometry. the counters go down as the root directory
+	// is allocated below
+	sb.magic = SUPERBLOCK_MAGIC;
+	sb.version = SUPERBLOCK_MIN_VERSION;
+	if (groups > 1) {
+		sb.version = SUPERBLOCK_GROUPS_VERSION;
 	}
+	if (options->inline_data) {
+		sb.features |= FEATURE_INLINE_DATA;
+	}
+	if (options->variable_dirents) {
+		sb.features |= FEATURE_VARIABLE_DIRENTS;
+	}
+	if (sb.features != 0) {
+		sb.version = SUPERBLOCK_VERSION;
+	}
+	sb.block_size = BLOCK_SIZE;
+	sb.block_count = block_count;
+	sb.inode_count = inode_count;
+	sb.inode_map = FREE_INODE;
+	sb.block_map = FREE_DATA;
+	sb.inode_table = INODE_FIRST_BLOCK;
+	sb.inode_table_blocks = inode_blocks * groups;
+	sb.first_data_block = metadata;
+	sb.journal_start = options->journal_blocks ? journal_start : 0;
+	sb.journal_blocks = options->journal_blocks;
+	sb.group_count = groups;
+	sb.blocks_per_group = FREE_MAP_BITS;
+	sb.inodes_per_group = inodes_per_group;
+	sb.inode_size = inode_size;
+	sb.valid = 1;
+	free_map_setup();
+	free_map_recount();
+
     // call ialloc to get a new inode
 	struct inode *root_inode = ialloc();
-    // call alloc to get a new data block
-	int directory_block = alloc();
 	// initiaize the inode returned from ialloc.
     // flags set to 2, size set to bye size of directory (64)
 	root_inode->flags = DIRECTORY_FLAG;
-	root_inode->size = ROOT_DIR_SIZE;
-	root_inode->block_ptr[0] = get_block_position(directory_block);
+	mark_inode_dirty(root_inode);
     // make this array to populate with new directory data
-	unsigned char block[BLOCK_SIZE];
-
-	// pack the . and .. directory entries in here
-	write_u16(block, root_inode->inode_num);
-	strcpy((char *)block + FILE_OFFSET, ".");
-	write_u16(block + FIXED_LENGTH_RECORD_SIZE, root_inode->inode_num);
-	strcpy((char *)block + FILE_OFFSET + FIXED_LENGTH_RECORD_SIZE, "..");
-	// write the directory data block back out to disk with bwrite()
-	bwrite(directory_block, block);
+	unsigned char block[BLOCK_SIZE] = {0};
+	// with inline data the entries go in the inode and there's no block
+	unsigned char *entries = block;
+	if (options->inline_data) {
+		root_inode->inline_data = 1;
+		entries = root_inode->inline_buf;
+	}
+
+	// pack the . and .. directory entries in here, in whichever format
+	// the image uses. fixed length ones come to ROOT_DIR_SIZE
+	root_inode->size = directory_entry_put(entries, root_inode->inode_num, ".");
+	root_inode->size += directory_entry_put(entries + root_inode->size, root_inode->inode_num, "..");
+	if (!options->inline_data) {
+	    // call alloc to get a new data block
+		int directory_block = alloc();
+		extent_append(root_inode, directory_block, 1);
+		// write the directory data block back out to disk with bwrite()
+		bwrite(directory_block, block);
+	}
 	// write new directory inode out to disk and free incore inode
 	iput(root_inode);
-}
\ No newline at end of file
+	superblock_sync();
+
+	// with a journal the new file system is made durable before the
+	// journal takes over
+	if (options->journal_blocks > 0) {
+		inode_sync();
+		bflush();
+		journal_format();
+		if (journal_open() == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// create a file system with the given geometry. returns 0, or -1 if the
+// geometry can't be represented
+int mkfs_with_options(struct mkfs_options *options)
+{
+	TRACE_ENTER(TRACE_OP_MKFS);
+	int status = mkfs_build(options);
+	TRACE_LEAVE();
+	return status;
+}
+
+// create the file system with the default 4 MiB geometry
+void mkfs(void)
+{
+	struct mkfs_options options;
+
+	mkfs_default_options(&options);
+	mkfs_with_options(&options);
+}
@@ -4,10 +4,29 @@
 #define FOUR_MB_IMAGE 4096*1024
 #define ZEROS 0
 #define METADATA 7
+#define FILE_FLAG 1
 #define DIRECTORY_FLAG 2
 #define FIXED_LENGTH_RECORD_SIZE 32
 #define ROOT_DIR_SIZE FIXED_LENGTH_RECORD_SIZE*2
+#define DEFAULT_INODE_COUNT 256
+// directory entries hold 16 bit inode numbers
+#define MAX_INODE_COUNT 65536
+// block numbers are ints
+#define MAX_BLOCK_COUNT 0x7fffffffLL
 
+// geometry for mkfs_with_options()
+struct mkfs_options {
+    long long image_size;  // bytes, rounded down to whole blocks
+    int inode_count;       // rounded up to whole inode table blocks
+    int block_size;        // must be BLOCK_SIZE
+    int preallocate;       // fallocate the image instead of leaving it sparse
+    int journal_blocks;    // size of the metadata journal, 0 for none
+    int inline_data;       // keep small directories in their inodes
+    int variable_dirents;  // variable length directory records, long names
+};
+
+void mkfs_default_options(struct mkfs_options *options);
+int mkfs_with_options(struct mkfs_options *options);
 void mkfs(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+// offline analysis and replay of block access traces made with
+// trace_start().
+//
+//   simfs_replay trace [image]
+//
+// prints the trace's working set, how often blocks are read again,
+// the blocks read most, and the lengths of its sequential runs. given
+// an image it then replays the trace against it as fast as it will go
+// and reports the rate and what the buffer cache made of it
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "image.h"
+#include "block.h"
+#include "cache.h"
+#include "trace.h"
+
+#define TOP_BLOCKS 10
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double percent(unsigned long part, unsigned long whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+// the TOP_BLOCKS blocks read most often, most first
+static void print_top_blocks(struct trace_summary *s)
+{
+    unsigned int top[TOP_BLOCKS];
+    int found = 0;
+
+    for (unsigned int b = 0; b < s->block_count; b++) {
+        if (s->block_reads[b] < 2)
+            continue;
+        int at = found < TOP_BLOCKS ? found++ : TOP_BLOCKS;
+        while (at > 0 && s->block_reads[top[at - 1]] < s->block_reads[b]) {
+            if (at < TOP_BLOCKS)
+                top[at] = top[at - 1];
+            at--;
+        }
+        if (at < TOP_BLOCKS)
+            top[at] = b;
+    }
+    if (found == 0)
+        return;
+    printf("\nmost read blocks\n");
+    printf("%10s %10s %10s\n", "block", "reads", "rereads");
+    for (int i = 0; i < found; i++)
+        printf("%10u %10u %10u\n", top[i], s->block_reads[top[i]], s->block_reads[top[i]] - 1);
+}
+
+static void print_summary(struct trace_summary *s)
+{
+    printf("records          %lu over %.3f ms\n", s->records, s->ns / 1e6);
+    printf("reads            %lu\n", s->reads);
+    printf("writes           %lu\n", s->writes);
+    printf("working set      %lu blocks, %lu KiB\n", s->working_set, s->working_set * BLOCK_SIZE / 1024);
+    printf("read set         %lu blocks\n", s->read_set);
+    printf("rereads          %lu, %.1f%% of reads\n", s->rereads, percent(s->rereads, s->reads));
+
+    printf("\ncaller\n");
+    for (int c = 0; c < TRACE_OP_COUNT; c++)
+        if (s->by_caller[c] > 0)
+            printf("%-18s %10lu %5.1f%%\n", trace_caller_name(c), s->by_caller[c],
+                   percent(s->by_caller[c], s->records));
+
+    print_top_blocks(s);
+
+    printf("\nsequential runs  %lu, %.2f blocks on average\n", s->runs,
+           s->runs ? (double)s->records / s->runs : 0.0);
+    printf("%10s %10s\n", "blocks", "runs");
+    for (int b = 0; b < TRACE_RUN_BUCKETS; b++) {
+        if (s->run_lengths[b] == 0)
+            continue;
+        if (b == 0)
+            printf("%10s %10lu\n", "1", s->run_lengths[b]);
+        else
+            printf("%4lu-%-5lu %10lu\n", 1UL << b, (2UL << b) - 1, s->run_lengths[b]);
+    }
+}
+
+static int replay(char *image, struct trace_record *records, int count)
+{
+    struct cache_stats cs;
+
+    if (image_open(image, 0) == FAILED) {
+        fprintf(stderr, "simfs_replay: can't open %s\n", image);
+        return FAILED;
+    }
+    cache_reset_stats();
+    long long started = now_ns();
+    trace_replay(records, count);
+    bflush();
+    long long ns = now_ns() - started;
+    cache_get_stats(&cs);
+    image_close();
+
+    printf("\nreplay           %d records in %.3f ms, %.0f per second\n", count, ns / 1e6,
+           ns ? count * 1e9 / ns : 0.0);
+    printf("cache            %lu hits, %lu misses, %.1f%% hit rate, %lu writebacks\n",
+           cs.hits, cs.misses, percent(cs.hits, cs.hits + cs.misses), cs.writebacks);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct trace_record *records;
+    struct trace_summary s;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: simfs_replay trace [image]\n");
+        return 1;
+    }
+    int count = trace_load(argv[1], &records);
+    if (count == FAILED) {
+        fprintf(stderr, "simfs_replay: %s isn't a trace\n", argv[1]);
+        return 1;
+    }
+
+    trace_analyze(records, count, &s);
+    print_summary(&s);
+    trace_summary_free(&s);
+
+    int status = 0;
+    if (argc == 3 && replay(argv[2], records, count) == FAILED)
+        status = 1;
+    free(records);
+    return status;
+}
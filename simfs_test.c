@@ -1,15 +1,27 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "ctest.h"
 #include "image.h"
 #include "block.h"
+#include "cache.h"
 #include "free.h"
 #include "inode.h"
 #include "mkfs.h"
 #include "pack.h"
 #include "directory.h"
+#include "dirindex.h"
 #include "ls.h"
+#include "dcache.h"
+#include "superblock.h"
+#include "extent.h"
+#include "file.h"
+#include "async.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 // macros
 #define FREE_BLOCK_MAP_NUM 2
@@ -52,6 +64,124 @@ void test_image_open_and_close(void)
 	CTEST_ASSERT(image_close() == 0, "testing closing file");
 }
 
+void test_cache(void)
+{
+	struct cache_stats stats;
+	unsigned char test_block[BLOCK_SIZE];
+	unsigned char disk_block[BLOCK_SIZE];
+	image_open("test_image", 0);
+	cache_init(2);
+	cache_reset_stats();
+
+	// first read misses, the repeat is served from the cache
+	bread(3, test_block);
+	bread(3, test_block);
+	cache_get_stats(&stats);
+	CTEST_ASSERT(stats.misses == 1, "testing first bread misses the cache");
+	CTEST_ASSERT(stats.hits == 1, "testing repeat bread hits the cache");
+
+	// writes stay in the cache until bflush()
+	block_for_testing(test_block, 7);
+	bwrite(3, test_block);
+	block_read_disk(3, disk_block);
+	CTEST_ASSERT(disk_block[0] != 7, "testing bwrite is held in the cache");
+	bflush();
+	block_read_disk(3, disk_block);
+	CTEST_ASSERT(memcmp(test_block, disk_block, BLOCK_SIZE) == 0, "testing bflush writes dirty blocks out");
+
+	// a dirty block pushed out of a full cache is written back
+	block_for_testing(test_block, 9);
+	bwrite(4, test_block);
+	bread(5, disk_block);
+	bread(6, disk_block);
+	block_read_disk(4, disk_block);
+	CTEST_ASSERT(memcmp(test_block, disk_block, BLOCK_SIZE) == 0, "testing lru eviction writes back dirty block");
+	cache_get_stats(&stats);
+	CTEST_ASSERT(stats.evictions == 2, "testing evictions are counted");
+
+	cache_init(CACHE_DEFAULT_SLOTS);
+	image_close();
+}
+
+void test_breadv_and_bwritev(void)
+{
+	unsigned char blocks[3][BLOCK_SIZE];
+	unsigned char *run[3] = {blocks[0], blocks[1], blocks[2]};
+	unsigned char read_block[BLOCK_SIZE];
+	image_open("test_image", 0);
+
+	for (int i = 0; i < 3; i++)
+		block_for_testing(blocks[i], i + 1);
+	bwritev(10, run, 3);
+	block_read_disk(11, read_block);
+	CTEST_ASSERT(memcmp(blocks[1], read_block, BLOCK_SIZE) == 0, "testing bwritev writes the whole run");
+
+	// a newer cached copy wins over what's on disk
+	block_for_testing(read_block, 42);
+	bwrite(12, read_block);
+	memset(blocks, 0, sizeof(blocks));
+	breadv(10, run, 3);
+	CTEST_ASSERT(blocks[0][0] == 1 && blocks[1][0] == 2, "testing breadv reads the whole run");
+	CTEST_ASSERT(blocks[2][0] == 42, "testing breadv sees dirty cached blocks");
+
+	image_close();
+}
+
+void test_bget_and_brelse(void)
+{
+	unsigned char test_block[BLOCK_SIZE];
+	image_open("test_image", 0);
+
+	// bget hands out the cached block itself, not a copy
+	unsigned char *block = bget(13);
+	block_for_testing(block, 5);
+	bdirty(13);
+	brelse(13);
+	bread(13, test_block);
+	CTEST_ASSERT(test_block[BLOCK_SIZE - 1] == 5, "testing in place changes are seen by bread");
+	bflush();
+	block_read_disk(13, test_block);
+	CTEST_ASSERT(test_block[0] == 5, "testing bdirty blocks are flushed");
+
+	image_close();
+}
+
+void test_image_mmap(void)
+{
+	unsigned char test_block[BLOCK_SIZE];
+	int fd = image_open("test_image", IMAGE_TRUNCATE | IMAGE_MMAP);
+	CTEST_ASSERT(fd != -1 && image_map != NULL, "testing opening a mapped image");
+
+	// a write through the mapping shows up in a zero-copy bget
+	block_for_testing(test_block, 3);
+	bwrite(20, test_block);
+	unsigned char *block = bget(20);
+	CTEST_ASSERT(block == image_map + 20 * BLOCK_SIZE, "testing bget points into the mapping");
+	CTEST_ASSERT(block[100] == 3, "testing mapped block contents");
+	block[0] = 4;
+	bdirty(20);
+	brelse(20);
+	bflush();
+	block_read_disk(20, test_block);
+	CTEST_ASSERT(test_block[0] == 4 && test_block[1] == 3, "testing msync reaches the image");
+
+	// reading past the end doesn't grow the image
+	struct stat st;
+	fstat(image_fd, &st);
+	off_t size = st.st_size;
+	memset(test_block, 1, BLOCK_SIZE);
+	bread(200, test_block);
+	CTEST_ASSERT(test_block[0] == 0 && test_block[BLOCK_SIZE - 1] == 0, "testing a mapped block past the end reads as zeros");
+	fstat(image_fd, &st);
+	CTEST_ASSERT(st.st_size == size, "testing a read past the end leaves the image's size alone");
+
+	// the metadata paths work unchanged on a mapped image
+	mkfs();
+	CTEST_ASSERT(directory_make("/foo") == 0, "testing directory_make on a mapped image");
+	image_close();
+	CTEST_ASSERT(image_map == NULL, "testing image_close unmaps the image");
+}
+
 void test_set_free(void)
 {
     // arbitrary value for testing
@@ -88,6 +218,32 @@ void test_find_free(void)
 	CTEST_ASSERT(find_free(test_block) == num, "testing if find_free locates free block");
 }
 
+void test_find_free_from_and_run(void)
+{
+	unsigned char test_block[BLOCK_SIZE];
+	block_for_testing(test_block, ONLY_ONE);
+	CTEST_ASSERT(find_free(test_block) == -1, "testing full map has no free bit");
+
+	// the last bit of the map is found past all the full words
+	set_free(test_block, BLOCK_SIZE * BYTE - 1, 0);
+	CTEST_ASSERT(find_free(test_block) == BLOCK_SIZE * BYTE - 1, "testing free bit at the end of the map");
+
+	// next-fit starts at the cursor and wraps around
+	set_free(test_block, 100, 0);
+	set_free(test_block, 3000, 0);
+	CTEST_ASSERT(find_free_from(test_block, 101) == 3000, "testing next-fit starts at the cursor");
+	CTEST_ASSERT(find_free_from(test_block, BLOCK_SIZE * BYTE) == 100, "testing next-fit wraps around");
+
+	// runs skip holes that are too small
+	for (int i = 200; i < 203; i++)
+		set_free(test_block, i, 0);
+	for (int i = 500; i < 520; i++)
+		set_free(test_block, i, 0);
+	CTEST_ASSERT(find_free_run(test_block, 0, 3) == 200, "testing run fits exactly");
+	CTEST_ASSERT(find_free_run(test_block, 0, 10) == 500, "testing run skips small holes");
+	CTEST_ASSERT(find_free_run(test_block, 0, 21) == -1, "testing run too long for any hole");
+}
+
 void test_alloc(void)
 {
     // arbitrary value for testing
@@ -110,6 +266,15 @@ void test_alloc(void)
 	alloc_num = alloc();
 	CTEST_ASSERT(alloc_num == num, "testing if alloc() finds free block");
 
+	// contiguous runs come out of the same map
+	block_for_testing(test_block, ONLY_ONE);
+	for (int i = 300; i < 310; i++)
+		set_free(test_block, i, 0);
+	bwrite(FREE_BLOCK_MAP_NUM, test_block);
+	alloc_num = alloc_run(4);
+	CTEST_ASSERT(alloc_num == 300, "testing alloc_run finds a contiguous run");
+	CTEST_ASSERT(alloc() == 304, "testing alloc continues after the run");
+
 	image_close();	
 }
 
@@ -141,6 +306,34 @@ void test_ialloc(void)
 	mark_incore_in_use();
 	ialloc_inode = ialloc();
 	CTEST_ASSERT(ialloc_inode == NULL, "testing no freeincore inodes");
+	clear_incore_inodes();
+
+	image_close();
+}
+
+void test_alloc_n_and_ialloc_n(void)
+{
+	int blocks[5];
+	struct inode *inodes[3];
+	unsigned char map[BLOCK_SIZE];
+	image_open("test_image", 0);
+	mkfs();
+
+	CTEST_ASSERT(alloc_n(5, blocks) == 5, "testing alloc_n hands out a batch");
+	CTEST_ASSERT(blocks[0] == 8 && blocks[4] == 12, "testing alloc_n takes the next free blocks");
+	bread(FREE_BLOCK_MAP_NUM, map);
+	CTEST_ASSERT(find_free(map) == 13, "testing the batch is in the block map");
+
+	CTEST_ASSERT(ialloc_n(3, inodes) == 3, "testing ialloc_n hands out a batch");
+	CTEST_ASSERT(inodes[0]->inode_num == 1 && inodes[2]->inode_num == 3, "testing ialloc_n inode numbers");
+	for (int i = 0; i < 3; i++)
+		iput(inodes[i]);
+
+	// a batch that can't be satisfied takes nothing
+	int too_many[FREE_MAP_BITS];
+	CTEST_ASSERT(alloc_n(FREE_MAP_BITS, too_many) == -1, "testing alloc_n fails when the map is short");
+	bread(FREE_BLOCK_MAP_NUM, map);
+	CTEST_ASSERT(find_free(map) == 13, "testing failed batch leaves the map alone");
 
 	image_close();
 }
@@ -173,6 +366,413 @@ void test_mkfs(void)
 	image_close();
 }
 
+void test_mkfs_with_options(void)
+{
+	struct mkfs_options options;
+	struct stat st;
+	unsigned char block[BLOCK_SIZE];
+	image_open("test_image", 0);
+
+	mkfs_default_options(&options);
+	options.block_size = 1024;
+	CTEST_ASSERT(mkfs_with_options(&options) == -1, "testing unsupported block size is rejected");
+	mkfs_default_options(&options);
+	options.inode_count = MAX_INODE_COUNT + 1;
+	CTEST_ASSERT(mkfs_with_options(&options) == -1, "testing more inodes than directory entries can name is rejected");
+
+	// 64 MiB with 1000 inodes: 16 inode table blocks, root at block 19
+	mkfs_default_options(&options);
+	options.image_size = 64 * 1024 * 1024;
+	options.inode_count = 1000;
+	CTEST_ASSERT(mkfs_with_options(&options) == 0, "testing mkfs with custom geometry");
+	fstat(image_fd, &st);
+	CTEST_ASSERT(st.st_size == 64 * 1024 * 1024, "testing image is sized by mkfs");
+	CTEST_ASSERT(st.st_blocks * 512 < 1024 * 1024, "testing image is sparse");
+
+	bflush();
+	bread(FREE_BLOCK_MAP_NUM, block);
+	CTEST_ASSERT(find_free(block) == 20, "testing metadata covers the larger inode table");
+	set_free(block, 20, 1);
+	CTEST_ASSERT(find_free_from(block, 16383) == 16383, "testing last block of the image is free");
+	CTEST_ASSERT(find_free_from(block, 16384) == 21, "testing blocks past the image are reserved");
+	bread(1, block);
+	CTEST_ASSERT(find_free_from(block, 1023) == 1023 && find_free_from(block, 1024) == 1, "testing inode count is rounded up and the rest reserved");
+
+	struct inode *root = namei("/");
+	CTEST_ASSERT(bmap(root, 0, NULL) == 19, "testing root directory follows the inode table");
+	iput(root);
+
+	image_close();
+}
+
+void test_groups(void)
+{
+	struct mkfs_options options;
+	struct simfs_statfs st;
+	unsigned char block[BLOCK_SIZE];
+	image_open("test_image", 0);
+
+	// a single group is laid out as before and stays version 2
+	mkfs();
+	CTEST_ASSERT(sb.group_count == 1 && sb.version == SUPERBLOCK_MIN_VERSION, "testing a small image has one group");
+
+	// 300 MiB with 3000 inodes: three groups of 1024 inodes, each with
+	// 16 inode table blocks
+	mkfs_default_options(&options);
+	options.image_size = 300LL * 1024 * 1024;
+	options.inode_count = 3000;
+	CTEST_ASSERT(mkfs_with_options(&options) == 0, "testing mkfs beyond one block map");
+	CTEST_ASSERT(sb.group_count == 3 && sb.inodes_per_group == 1024 && sb.version == SUPERBLOCK_GROUPS_VERSION, "testing the groups are recorded");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.blocks == 76800 && st.inodes == 3072, "testing statfs over every group");
+	CTEST_ASSERT(st.free_blocks == 76800 - 19 - 18 - 18 - 1 && st.free_inodes == 3071, "testing each group's metadata is counted as used");
+	bread(32768 + GROUP_BLOCK_MAP, block);
+	CTEST_ASSERT(find_free(block) == 18, "testing group 1's map reserves its maps and inode table");
+
+	// runs stay inside a group, and a full group is passed over
+	CTEST_ASSERT(alloc_run(FREE_MAP_BITS) == -1, "testing a run can't span groups");
+	CTEST_ASSERT(alloc_run(32768 - 20) == 20, "testing group 0 can be filled with a run");
+	CTEST_ASSERT(alloc() == 32768 + 18, "testing allocation moves on to the next group");
+	free_map_free(&block_map, 32768 + 18);
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_blocks == 76800 - 56 - (32768 - 20), "testing counts across groups");
+
+	// inodes past group 0 live in group 1's slice of the inode table
+	for (int i = 1; i < 1024; i++)
+		iput(ialloc());
+	struct inode *in = ialloc();
+	CTEST_ASSERT(in != NULL && in->inode_num == 1024, "testing inodes come from the next group");
+	in->size = 1234;
+	mark_inode_dirty(in);
+	iput(in);
+	inode_sync();
+	bread(32768 + GROUP_INODE_TABLE, block);
+	CTEST_ASSERT(read_u32(block) == 1234, "testing the inode is in its group's table");
+	image_close();
+
+	// per-group counts are rebuilt on open
+	image_open("test_image", 0);
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_inodes == 3072 - 1025, "testing counts survive a reopen");
+	in = iget(1024);
+	CTEST_ASSERT(in->size == 1234, "testing an inode in another group reads back");
+	iput(in);
+	CTEST_ASSERT(alloc() == 32768 + 18, "testing the full group is skipped after a reopen");
+
+	// a last group too small for its own metadata is left off
+	mkfs_default_options(&options);
+	options.image_size = (2LL * FREE_MAP_BITS + 4) * BLOCK_SIZE;
+	mkfs_with_options(&options);
+	CTEST_ASSERT(sb.group_count == 2 && sb.block_count == 2 * FREE_MAP_BITS, "testing a sliver of a group is dropped");
+
+	// multi-GiB images
+	options.image_size = 4LL * 1024 * 1024 * 1024;
+	options.inode_count = 65536;
+	CTEST_ASSERT(mkfs_with_options(&options) == 0 && sb.group_count == 32, "testing a 4 GiB image");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.blocks == 1024 * 1024 && st.free_inodes == 65535, "testing statfs of a 4 GiB image");
+	CTEST_ASSERT(directory_make("/big") == 0 && namei("/big") != NULL, "testing a 4 GiB image works");
+
+	mkfs();
+	image_close();
+}
+
+void test_locality(void)
+{
+	struct mkfs_options options;
+	char path[32];
+	unsigned char data[BLOCK_SIZE] = {1};
+	image_open("test_image", 0);
+	mkfs_default_options(&options);
+	options.image_size = 300LL * 1024 * 1024;
+	options.inode_count = 3000;
+	mkfs_with_options(&options);
+
+	// top-level directories go to different groups
+	directory_make("/a");
+	directory_make("/b");
+	struct inode *a = namei("/a");
+	struct inode *b = namei("/b");
+	int group_a = a->inode_num / sb.inodes_per_group;
+	CTEST_ASSERT(group_a != 0 && group_a != (int)(b->inode_num / sb.inodes_per_group), "testing top-level directories are spread out");
+	CTEST_ASSERT(bmap(a, 0, NULL) / FREE_MAP_BITS == group_a, "testing a directory's block is in its inode's group");
+
+	// files made in a directory follow it in the inode table
+	int same_block = 1;
+	for (int i = 0; i < 10; i++) {
+		sprintf(path, "/a/f%d", i);
+		int fd = file_open(path, FILE_CREATE);
+		struct inode *f = namei(path);
+		same_block &= f->inode_num == a->inode_num + 1 + i &&
+			      f->inode_num / INODES_PER_BLOCK == a->inode_num / INODES_PER_BLOCK;
+		if (i == 0)
+			file_write(fd, data, sizeof(data));
+		if (i == 0)
+			CTEST_ASSERT(bmap(f, 0, NULL) / FREE_MAP_BITS == group_a, "testing file data goes in the file's group");
+		iput(f);
+		file_close(fd);
+	}
+	CTEST_ASSERT(same_block, "testing siblings share an inode table block");
+
+	// a subdirectory's block lands just after its parent's, past the
+	// block /a/f0 took
+	directory_make("/a/s");
+	struct inode *sub = namei("/a/s");
+	CTEST_ASSERT(sub->inode_num / sb.inodes_per_group == (unsigned int)group_a, "testing a subdirectory stays in its parent's group");
+	CTEST_ASSERT(bmap(sub, 0, NULL) == bmap(a, 0, NULL) + 2, "testing a subdirectory's block follows its parent's");
+	iput(sub);
+	iput(b);
+	iput(a);
+
+	mkfs();
+	image_close();
+}
+
+void test_inline_dirs(void)
+{
+	struct mkfs_options options;
+	struct simfs_statfs st;
+	struct cache_stats cs;
+	struct directory_entry ents[8];
+	char path[32];
+	image_open("test_image", 0);
+
+	// default images keep 64 byte records and no features
+	mkfs();
+	CTEST_ASSERT(sb.inode_size == INODE_SIZE && sb.features == 0, "testing inline data is opt-in");
+
+	// 256 inodes at 16 to a block take 16 table blocks, and the root
+	// takes no data block
+	mkfs_default_options(&options);
+	options.inline_data = 1;
+	CTEST_ASSERT(mkfs_with_options(&options) == 0, "testing mkfs with inline data");
+	CTEST_ASSERT(sb.version == SUPERBLOCK_VERSION && sb.features == FEATURE_INLINE_DATA && sb.inode_size == INODE_SIZE_INLINE, "testing the feature is recorded");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_blocks == 1024 - 19, "testing the root directory takes no block");
+	struct inode *root = iget(ROOT_INODE_NUM);
+	CTEST_ASSERT(root->inline_data && root->extent_count == 0, "testing the root directory is inline");
+	iput(root);
+
+	// a new directory lives in its inode too
+	CTEST_ASSERT(directory_make("/a") == 0, "testing making an inline directory");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_blocks == 1024 - 19, "testing a new directory takes no block");
+	struct inode *a = namei("/a");
+	CTEST_ASSERT(a->inline_data && a->size == 64, "testing a new directory is inline");
+
+	// six entries fit, the seventh moves it out to a block
+	for (int i = 1; i <= 4; i++) {
+		sprintf(path, "/a/%d", i);
+		directory_make(path);
+	}
+	CTEST_ASSERT(a->inline_data && a->extent_count == 0, "testing a full inline directory stays inline");
+	directory_make("/a/5");
+	CTEST_ASSERT(!a->inline_data && a->extent_count == 1 && a->size == 7 * FIXED_LENGTH_RECORD_SIZE, "testing a growing directory moves to a block");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_blocks == 1024 - 19 - 1, "testing only the grown directory took a block");
+	int found = 1;
+	for (int i = 1; i <= 5; i++) {
+		sprintf(path, "/a/%d", i);
+		struct inode *in = namei(path);
+		found &= in != NULL && in->inline_data;
+		if (in != NULL)
+			iput(in);
+	}
+	CTEST_ASSERT(found, "testing entries survive the move");
+	iput(a);
+	image_close();
+
+	// inline entries persist, and listing one costs only the inode read
+	image_open("test_image", 0);
+	cache_reset_stats();
+	struct directory *dir = directory_open(ROOT_INODE_NUM);
+	int count = directory_get_batch(dir, ents, 8);
+	directory_close(dir);
+	cache_get_stats(&cs);
+	CTEST_ASSERT(count == 3 && strcmp(ents[2].name, "a") == 0, "testing an inline directory reads back");
+	CTEST_ASSERT(cs.misses == 1, "testing an inline directory is read with its inode");
+	CTEST_ASSERT(directory_lookup(directory_lookup(ROOT_INODE_NUM, "a"), "5") != -1, "testing a moved directory reads back");
+
+	mkfs();
+	image_close();
+}
+
+void test_variable_dirents(void)
+{
+	struct mkfs_options options;
+	struct directory_entry ents[LS_BATCH];
+	char long_name[DIRECTORY_NAME_MAX + 2];
+	char path[DIRECTORY_NAME_MAX + 8];
+	char expect[16];
+	char out[16384];
+	image_open("test_image", 0);
+
+	mkfs_default_options(&options);
+	options.inode_count = 1024;
+	options.variable_dirents = 1;
+	CTEST_ASSERT(mkfs_with_options(&options) == 0, "testing mkfs with variable length entries");
+	CTEST_ASSERT(sb.version == SUPERBLOCK_VERSION && sb.features == FEATURE_VARIABLE_DIRENTS, "testing the format is recorded");
+	struct inode *root = iget(ROOT_INODE_NUM);
+	CTEST_ASSERT(root->size == DIRENT_LEN(1) + DIRENT_LEN(2), "testing . and .. take only what they need");
+
+	// names up to DIRECTORY_NAME_MAX bytes
+	memset(long_name, 'x', 199);
+	long_name[199] = '\0';
+	sprintf(path, "/%s", long_name);
+	CTEST_ASSERT(directory_make(path) == 0, "testing a long name");
+	memset(long_name, 'y', DIRECTORY_NAME_MAX + 1);
+	long_name[DIRECTORY_NAME_MAX + 1] = '\0';
+	sprintf(path, "/%s", long_name);
+	CTEST_ASSERT(directory_make(path) == -1, "testing a name past the longest is refused");
+	long_name[DIRECTORY_NAME_MAX] = '\0';
+	sprintf(path, "/%s", long_name);
+	CTEST_ASSERT(directory_make(path) == 0, "testing the longest name");
+	struct inode *in = namei(path);
+	CTEST_ASSERT(in != NULL, "testing a long name resolves");
+	iput(in);
+
+	// 400 entries of 12 bytes, where fixed records would take four
+	// blocks. they don't divide a block evenly, so one is stretched
+	for (int i = 0; i < 400; i++) {
+		sprintf(path, "/f%06d", i);
+		file_close(file_open(path, FILE_CREATE));
+		// the index comes with the 129th entry, though it's still well
+		// within a block
+		if (i == 123)
+			CTEST_ASSERT(root->index_block == 0, "testing 128 entries aren't indexed");
+		if (i == 124)
+			CTEST_ASSERT(root->index_block != 0 && root->size < BLOCK_SIZE, "testing the index threshold counts entries");
+	}
+	CTEST_ASSERT(root->size <= 2 * BLOCK_SIZE, "testing entries are packed densely");
+	CTEST_ASSERT(root->index_block != 0, "testing a big directory is indexed");
+	iput(root);
+
+	struct directory *dir = directory_open(ROOT_INODE_NUM);
+	int total = 0;
+	int in_order = 1;
+	int got;
+	while ((got = directory_get_batch(dir, ents, LS_BATCH)) > 0) {
+		for (int i = 0; i < got; i++, total++) {
+			if (total >= 4) {
+				sprintf(expect, "f%06d", total - 4);
+				in_order &= strcmp(ents[i].name, expect) == 0;
+			}
+		}
+	}
+	directory_close(dir);
+	CTEST_ASSERT(total == 404 && in_order, "testing a scan steps across blocks");
+
+	// lookups through the index, with nothing cached
+	dcache_clear();
+	int found = 1;
+	for (int i = 0; i < 400; i++) {
+		sprintf(expect, "f%06d", i);
+		found &= directory_lookup(ROOT_INODE_NUM, expect) != -1;
+	}
+	CTEST_ASSERT(found, "testing the index finds variable length entries");
+
+	FILE *f = tmpfile();
+	int listed = ls_with_options(ROOT_INODE_NUM, LS_SORT, fileno(f));
+	size_t len = pread(fileno(f), out, sizeof(out) - 1, 0);
+	out[len] = '\0';
+	fclose(f);
+	CTEST_ASSERT(listed == 404 && strstr(out, long_name) != NULL, "testing ls lists long names");
+	image_close();
+
+	// the format survives a reopen
+	image_open("test_image", 0);
+	sprintf(path, "/%s", long_name);
+	in = namei(path);
+	CTEST_ASSERT(in != NULL && sb.features == FEATURE_VARIABLE_DIRENTS, "testing entries read back");
+	iput(in);
+
+	// a record running past its block ends a scan instead of reading
+	// beyond it
+	struct directory_entry ent;
+	directory_make("/c");
+	in = namei("/c");
+	int c_block = bmap(in, 0, NULL);
+	unsigned char *block = bget(c_block);
+	write_u16(block + DIRENT_LEN(1) + DIRENT_REC_LEN_OFFSET, BLOCK_SIZE);
+	bdirty(c_block);
+	brelse(c_block);
+	dir = directory_open(in->inode_num);
+	total = 0;
+	while (directory_get(dir, &ent) == 0)
+		total++;
+	directory_close(dir);
+	CTEST_ASSERT(total == 1, "testing a record crossing its block is rejected");
+	iput(in);
+
+	// inline directories hold more of them
+	options.inline_data = 1;
+	mkfs_with_options(&options);
+	directory_make("/d");
+	for (int i = 0; i < 10; i++) {
+		sprintf(path, "/d/f%05d", i);
+		file_close(file_open(path, FILE_CREATE));
+	}
+	in = namei("/d");
+	CTEST_ASSERT(in->inline_data && directory_lookup(in->inode_num, "f00009") != -1, "testing an inline directory packs variable length entries");
+
+	// records too short for their names, or empty, aren't followed
+	dcache_clear();
+	write_u8(in->inline_buf + DIRENT_NAME_LEN_OFFSET, 200);
+	CTEST_ASSERT(directory_lookup(in->inode_num, "f00009") == -1, "testing a record shorter than its name is rejected");
+	write_u8(in->inline_buf + DIRENT_NAME_LEN_OFFSET, 1);
+	write_u16(in->inline_buf + DIRENT_REC_LEN_OFFSET, 0);
+	dcache_clear();
+	dir = directory_open(in->inode_num);
+	CTEST_ASSERT(directory_get(dir, &ent) == -1 && directory_lookup(in->inode_num, "f00009") == -1, "testing an empty record ends a scan");
+	directory_close(dir);
+	iput(in);
+
+	mkfs();
+	image_close();
+}
+
+void test_superblock(void)
+{
+	struct simfs_statfs st;
+	unsigned char block[BLOCK_SIZE];
+	int blocks[4];
+
+	// an image that was never formatted has nothing to count with
+	image_open("test_image", IMAGE_TRUNCATE);
+	CTEST_ASSERT(simfs_statfs(&st) == -1, "testing statfs needs a superblock");
+	mkfs();
+	CTEST_ASSERT(simfs_statfs(&st) == 0, "testing statfs after mkfs");
+	CTEST_ASSERT(st.block_size == BLOCK_SIZE && st.blocks == 1024 && st.inodes == 256, "testing statfs geometry");
+	CTEST_ASSERT(st.free_blocks == 1024 - 8 && st.free_inodes == 255, "testing root directory is counted as used");
+
+	alloc_n(4, blocks);
+	free_map_free(&block_map, blocks[0]);
+	free_map_free(&block_map, blocks[0]);
+	directory_make("/sub");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_blocks == 1024 - 8 - 3 - 1 && st.free_inodes == 254, "testing counters follow alloc and free");
+	image_close();
+
+	// the counters and layout survive a reopen
+	image_open("test_image", 0);
+	bread(SUPERBLOCK_BLOCK, block);
+	CTEST_ASSERT(read_u32(block) == SUPERBLOCK_MAGIC, "testing superblock magic is on disk");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_blocks == 1024 - 12 && st.free_inodes == 254, "testing counters are persistent");
+	CTEST_ASSERT(sb.inode_table == 3 && sb.first_data_block == 7, "testing layout is loaded");
+
+	image_close();
+
+	// refuse images from a newer version
+	FILE *fp = fopen("test_image", "r+b");
+	write_u32(block + 4, SUPERBLOCK_VERSION + 1);
+	fwrite(block, 1, 8, fp);
+	fclose(fp);
+	CTEST_ASSERT(image_open("test_image", 0) == -1, "testing newer superblock version is rejected");
+	image_open("test_image", IMAGE_TRUNCATE);
+	image_close();
+}
+
 void test_read_and_write_inode(void)
 {
 	unsigned int test_num = 420;
@@ -186,7 +786,10 @@ void test_read_and_write_inode(void)
 	new_inode->permissions = 10;
 	new_inode->flags = 15;
 	new_inode->link_count = 20;
-	new_inode->block_ptr[0] = 25;
+	new_inode->extents[0].logical = 0;
+	new_inode->extents[0].physical = 25;
+	new_inode->extents[0].length = 1;
+	new_inode->extent_count = 1;
 	write_inode(new_inode);
 	struct inode inode_read_buffer = {0};
 	read_inode(&inode_read_buffer, test_num);
@@ -198,7 +801,7 @@ void test_read_and_write_inode(void)
 	CTEST_ASSERT(new_inode->permissions == inode_read_buffer.permissions, "testing to see write/read permissions are matching");
 	CTEST_ASSERT(new_inode->flags == inode_read_buffer.flags, "testing if write/read flags are matching");
 	CTEST_ASSERT(new_inode->link_count == inode_read_buffer.link_count, "testing if write/read link_count are matching");
-	CTEST_ASSERT(new_inode->block_ptr[0] == inode_read_buffer.block_ptr[0], "testing if write/read block_ptr[0] are matching");
+	CTEST_ASSERT(new_inode->extents[0].physical == inode_read_buffer.extents[0].physical, "testing if write/read extents[0] are matching");
 }
 
 void test_iget(void)
@@ -248,6 +851,86 @@ void test_iput(void)
 }
 
 
+void test_inode_table(void)
+{
+	struct cache_stats before, after;
+	image_open("test_image", 0);
+	mkfs();
+	inode_table_init(4);
+	CTEST_ASSERT(inode_table_capacity() == 4, "testing table is sized at runtime");
+
+	// a released inode is revived from the lru list without a read
+	struct inode *in = iget(7);
+	in->size = 1234;
+	iput(in);
+	cache_get_stats(&before);
+	in = iget(7);
+	cache_get_stats(&after);
+	CTEST_ASSERT(in->size == 1234, "testing revived inode keeps its contents");
+	CTEST_ASSERT(after.hits == before.hits && after.misses == before.misses, "testing revive does no block I/O");
+	CTEST_ASSERT(find_incore(7) == in, "testing hashed lookup");
+	iput(in);
+
+	// referenced inodes are never reused, released ones are
+	struct inode *held[4];
+	for (int i = 0; i < 4; i++)
+		held[i] = iget(10 + i);
+	CTEST_ASSERT(iget(20) == NULL, "testing full table of referenced inodes");
+	iput(held[0]);
+	in = iget(20);
+	CTEST_ASSERT(in == held[0] && find_incore(10) == NULL, "testing lru inode is reused");
+	iput(in);
+	for (int i = 1; i < 4; i++)
+		iput(held[i]);
+
+	inode_table_init(MAX_SYS_OPEN_FILES);
+	image_close();
+}
+
+void test_inode_writeback(void)
+{
+	struct cache_stats before, after;
+	struct inode *inodes[10];
+	struct inode on_disk = {0};
+	image_open("test_image", 0);
+	mkfs();
+
+	// writing one inode leaves its neighbours in the table block alone
+	ialloc_n(2, inodes);
+	inodes[0]->size = 111;
+	inodes[1]->size = 222;
+	write_inode(inodes[0]);
+	write_inode(inodes[1]);
+	read_inode(&on_disk, inodes[0]->inode_num);
+	CTEST_ASSERT(on_disk.size == 111, "testing write_inode keeps the other records in its block");
+	iput(inodes[0]);
+	iput(inodes[1]);
+
+	// releasing a clean inode writes nothing
+	struct inode *in = iget(inodes[0]->inode_num);
+	cache_get_stats(&before);
+	iput(in);
+	cache_get_stats(&after);
+	CTEST_ASSERT(after.hits == before.hits && after.misses == before.misses, "testing iput of a clean inode does no I/O");
+
+	// ten dirty inodes in one table block are written with one block access
+	ialloc_n(10, inodes);
+	for (int i = 0; i < 10; i++) {
+		inodes[i]->size = 1000 + i;
+		iput(inodes[i]);
+	}
+	read_inode(&on_disk, inodes[9]->inode_num);
+	CTEST_ASSERT(on_disk.size == 0, "testing dirty inodes wait for writeback");
+	cache_get_stats(&before);
+	inode_sync();
+	cache_get_stats(&after);
+	CTEST_ASSERT((after.hits + after.misses) - (before.hits + before.misses) == 1, "testing writeback touches each table block once");
+	read_inode(&on_disk, inodes[9]->inode_num);
+	CTEST_ASSERT(on_disk.size == 1009, "testing inode_sync writes dirty inodes");
+
+	image_close();
+}
+
 void test_directory(void)
 {
 	int root_directory = 0;
@@ -268,6 +951,61 @@ void test_directory(void)
 	image_close();
 }
 
+void test_directory_get_batch(void)
+{
+	struct cache_stats before, after;
+	struct directory_entry ents[50];
+	char path[32];
+	image_open("test_image", 0);
+	mkfs();
+	for (int i = 0; i < 150; i++) {
+		sprintf(path, "/d%d", i);
+		directory_make(path);
+	}
+
+	// 152 entries over two blocks: one block lookup per block in each
+	// batch, not per entry
+	struct directory *dir = directory_open(ROOT_INODE_NUM);
+	cache_get_stats(&before);
+	int total = 0, count, in_order = 1;
+	while ((count = directory_get_batch(dir, ents, 50)) > 0) {
+		for (int i = 0; i < count; i++)
+			if (total + i >= 2 && (int)ents[i].inode_num != total + i - 1)
+				in_order = 0;
+		total += count;
+	}
+	cache_get_stats(&after);
+	CTEST_ASSERT(total == 152, "testing batches cover the whole directory");
+	CTEST_ASSERT(in_order, "testing batches come back in directory order");
+	CTEST_ASSERT((after.hits + after.misses) - (before.hits + before.misses) == 5, "testing one block access per directory block in each batch");
+	CTEST_ASSERT(directory_get_batch(dir, ents, 50) == 0, "testing batch at the end returns 0");
+	directory_close(dir);
+
+	// open directories hold no blocks between calls, so more of them
+	// than the cache has slots still leave it room to work
+	struct directory *dirs[CACHE_DEFAULT_SLOTS + 8];
+	unsigned char block[BLOCK_SIZE];
+	inode_sync();
+	inode_table_init(CACHE_DEFAULT_SLOTS * 2);
+	for (int i = 0; i < CACHE_DEFAULT_SLOTS + 8; i++) {
+		sprintf(path, "d%d", i);
+		dirs[i] = directory_open(directory_lookup(ROOT_INODE_NUM, path));
+		directory_get(dirs[i], &ents[0]);
+	}
+	for (int i = 0; i < 8; i++)
+		bread(1000 + i, block);
+	int reads_on = 1;
+	for (int i = 0; i < CACHE_DEFAULT_SLOTS + 8; i++) {
+		reads_on &= directory_get(dirs[i], &ents[0]) == 0 && strcmp(ents[0].name, "..") == 0;
+		directory_close(dirs[i]);
+	}
+	CTEST_ASSERT(reads_on, "testing more open directories than cache slots");
+	inode_sync();
+	inode_table_init(MAX_SYS_OPEN_FILES);
+
+	image_close();
+}
+
 void test_directory_failures(void)
 {
 	int root_directory = 0;
@@ -301,6 +1039,47 @@ void test_ls(void)
 	image_close();
 }
 
+void test_ls_options(void)
+{
+	char out[4096];
+	char expect[256];
+	unsigned char data[5000] = {0};
+	image_open("test_image", 0);
+	mkfs();
+	directory_make("/b");
+	directory_make("/a");
+	int fd = file_open("/c", FILE_CREATE);
+	file_write(fd, data, sizeof(data));
+	file_close(fd);
+
+	FILE *f = tmpfile();
+	int listed = ls_with_options(ROOT_INODE_NUM, LS_SORT, fileno(f));
+	size_t len = pread(fileno(f), out, sizeof(out) - 1, 0);
+	out[len] = '\0';
+	fclose(f);
+	CTEST_ASSERT(listed == 5, "testing ls lists every entry");
+	CTEST_ASSERT(strcmp(out, "0 .\n0 ..\n2 a\n1 b\n3 c\n") == 0, "testing a sorted listing");
+
+	f = tmpfile();
+	ls_with_options(ROOT_INODE_NUM, LS_SORT | LS_LONG, fileno(f));
+	len = pread(fileno(f), out, sizeof(out) - 1, 0);
+	out[len] = '\0';
+	fclose(f);
+	sprintf(expect, "-%03o %3u %5u %10u %5u c\n", 0, 0, 0, 5000, 3);
+	CTEST_ASSERT(strncmp(out, "d", 1) == 0 && strstr(out, expect) != NULL, "testing a long listing shows types and sizes");
+
+	// the long listing reads inodes that aren't in core from the table
+	inode_sync();
+	invalidate_incore_inodes();
+	f = tmpfile();
+	ls_with_options(ROOT_INODE_NUM, LS_SORT | LS_LONG, fileno(f));
+	len = pread(fileno(f), out, sizeof(out) - 1, 0);
+	out[len] = '\0';
+	fclose(f);
+	CTEST_ASSERT(strstr(out, expect) != NULL, "testing a long listing from the inode table");
+	image_close();
+}
+
 void test_namei(void)
 {
 	unsigned int root_inode = 0;
@@ -312,6 +1091,910 @@ void test_namei(void)
 	image_close();
 }
 
+void test_namei_walk(void)
+{
+	struct dcache_stats before, after;
+	image_open("test_image", 0);
+	mkfs();
+	directory_make("/a");
+	directory_make("/a/b");
+	directory_make("/a/b/c");
+
+	struct inode *in = namei("/a/b/c");
+	CTEST_ASSERT(in != NULL && in->inode_num == 3, "testing namei walks nested directories");
+	iput(in);
+	in = namei("//a///b/");
+	CTEST_ASSERT(in != NULL && in->inode_num == 2, "testing namei skips repeated slashes");
+	iput(in);
+	in = namei("/a/b/..");
+	CTEST_ASSERT(in != NULL && in->inode_num == 1, "testing namei follows ..");
+	iput(in);
+	CTEST_ASSERT(namei("/a/x/c") == NULL, "testing namei fails on a missing component");
+	CTEST_ASSERT(namei("a/b") == NULL, "testing namei rejects relative paths");
+
+	// repeated walks are answered by the dentry cache, misses included
+	dcache_get_stats(&before);
+	in = namei("/a/b/c");
+	iput(in);
+	CTEST_ASSERT(namei("/a/x") == NULL, "testing cached miss");
+	dcache_get_stats(&after);
+	CTEST_ASSERT(after.hits - before.hits == 4, "testing namei hits the dentry cache");
+	CTEST_ASSERT(after.negative_hits - before.negative_hits == 1, "testing negative dentry");
+	CTEST_ASSERT(after.misses == before.misses, "testing no directory scans");
+
+	// creating a name replaces its negative entry
+	CTEST_ASSERT(directory_make("/a/x") == 0, "testing directory_make in a subdirectory");
+	in = namei("/a/x");
+	CTEST_ASSERT(in != NULL && in->inode_num == 4, "testing new directory is found after a cached miss");
+	iput(in);
+	CTEST_ASSERT(directory_make("/a/x") == -1, "testing directory_make rejects an existing name");
+	CTEST_ASSERT(directory_make("/nope/x") == -1, "testing directory_make needs an existing parent");
+
+	image_close();
+}
+
+void test_directory_index(void)
+{
+	char path[32];
+	image_open("test_image", 0);
+	mkfs();
+
+	// enough entries to spill past the first block and get an index
+	for (int i = 0; i < 200; i++) {
+		sprintf(path, "/d%d", i);
+		directory_make(path);
+	}
+	struct inode *root = iget(ROOT_INODE_NUM);
+	CTEST_ASSERT(root->size == 202 * FIXED_LENGTH_RECORD_SIZE, "testing directory grows past one block");
+	CTEST_ASSERT(root->index_block != 0, "testing large directory gets a hash index");
+
+	// go through the index rather than the dentry cache
+	dcache_clear();
+	int all_found = 1;
+	for (int i = 0; i < 200; i++) {
+		sprintf(path, "d%d", i);
+		if (directory_lookup(ROOT_INODE_NUM, path) != i + 1)
+			all_found = 0;
+	}
+	CTEST_ASSERT(all_found, "testing every entry is found through the index");
+	CTEST_ASSERT(directory_lookup(ROOT_INODE_NUM, "nope") == -1, "testing index lookup of a missing name");
+	CTEST_ASSERT(directory_lookup(ROOT_INODE_NUM, "..") == 0, "testing index covers the first block");
+
+	// the index grows when its pages fill up
+	directory_make("/big");
+	struct inode *big = namei("/big");
+	for (int i = 0; i < 600; i++) {
+		sprintf(path, "e%d", i);
+		directory_link(big, path, 1000 + i);
+	}
+	dcache_clear();
+	CTEST_ASSERT(directory_lookup(big->inode_num, "e0") == 1000, "testing lookup after the index grew");
+	CTEST_ASSERT(directory_lookup(big->inode_num, "e599") == 1599, "testing last entry after the index grew");
+	iput(big);
+
+	// small directories stay linear
+	struct inode *small = iget(1);
+	CTEST_ASSERT(small->index_block == 0, "testing small directory has no index");
+	iput(small);
+	iput(root);
+
+	image_close();
+}
+
+void test_extents(void)
+{
+	char name[16];
+	unsigned int run;
+	image_open("test_image", 0);
+	mkfs();
+
+	// a contiguous allocation is a single extent
+	struct inode *in = ialloc();
+	int first = extent_alloc(in, 10);
+	CTEST_ASSERT(first == 8 && in->extent_count == 1, "testing contiguous blocks make one extent");
+	CTEST_ASSERT(bmap(in, 3, &run) == 11 && run == 7, "testing bmap returns the rest of the run");
+	CTEST_ASSERT(bmap(in, 10, NULL) == -1, "testing bmap past the end");
+
+	// scattered blocks, each with a hole before it, spill into the
+	// extent block
+	for (int i = 0; i < 10; i++) {
+		int p = alloc_run(2);
+		extent_append(in, p + 1, 1);
+		free_map_free(&block_map, p);
+	}
+	CTEST_ASSERT(in->extent_count == 11 && in->extent_block != 0, "testing extents overflow into the extent block");
+	CTEST_ASSERT(bmap(in, 19, &run) == bmap(in, 18, NULL) + 2 && run == 1, "testing bmap through the extent block");
+	CTEST_ASSERT(extent_blocks(in) == 20, "testing mapped block count");
+
+	// the mapping survives the inode leaving memory
+	int num = in->inode_num;
+	int last = bmap(in, 19, NULL);
+	iput(in);
+	inode_sync();
+	invalidate_incore_inodes();
+	in = iget(num);
+	CTEST_ASSERT(in->extent_count == 11 && bmap(in, 19, NULL) == last, "testing extents are written with the inode");
+
+	// truncating gives back the blocks and the extent block
+	struct simfs_statfs st;
+	simfs_statfs(&st);
+	unsigned int free_before = st.free_blocks;
+	extent_truncate(in, 5);
+	simfs_statfs(&st);
+	CTEST_ASSERT(in->extent_count == 1 && in->extent_block == 0 && bmap(in, 5, NULL) == -1, "testing truncate drops extents");
+	CTEST_ASSERT(st.free_blocks == free_before + 16, "testing truncate frees blocks and the extent block");
+
+	// spilling leaves the blocks after the new extent free, so the
+	// file keeps growing into them
+	for (int i = 0; i < 3; i++) {
+		int p = alloc_run(2);
+		extent_append(in, p + 1, 1);
+		free_map_free(&block_map, p);
+	}
+	last = bmap(in, extent_blocks(in) - 1, NULL);
+	CTEST_ASSERT(in->extent_count == 4 && in->extent_block != 0 && (int)in->extent_block != last + 1, "testing the extent block isn't put after the last extent");
+	extent_alloc(in, 1);
+	CTEST_ASSERT(in->extent_count == 4 && bmap(in, extent_blocks(in) - 1, NULL) == last + 1, "testing the file still grows contiguously");
+	iput(in);
+
+	// directories aren't limited to 16 blocks any more
+	struct inode *root = iget(ROOT_INODE_NUM);
+	for (int i = 0; i < 20 * 128; i++) {
+		sprintf(name, "f%d", i);
+		directory_link(root, name, i % 256);
+	}
+	CTEST_ASSERT(root->size == (20 * 128 + 2) * FIXED_LENGTH_RECORD_SIZE, "testing directory grows past 16 blocks");
+	dcache_clear();
+	CTEST_ASSERT(directory_lookup(ROOT_INODE_NUM, "f2559") == 2559 % 256, "testing lookup in the last block");
+	iput(root);
+
+	image_close();
+}
+
+void test_file_read_and_write(void)
+{
+	struct cache_stats before, after;
+	static unsigned char big[64 * 1024];
+	static unsigned char back[64 * 1024];
+	char buf[64];
+	image_open("test_image", 0);
+	mkfs();
+
+	CTEST_ASSERT(file_open("/f", 0) == -1, "testing open of a missing file");
+	CTEST_ASSERT(file_open("/", 0) == -1, "testing directories can't be opened as files");
+	CTEST_ASSERT(file_open("/nope/f", FILE_CREATE) == -1, "testing create needs the parent");
+	int fd = file_open("/f", FILE_CREATE);
+	CTEST_ASSERT(fd >= 0 && file_size(fd) == 0, "testing create makes an empty file");
+
+	// lots of small writes land in the cache and are read back the same
+	for (int i = 0; i < 1000; i++) {
+		sprintf(buf, "line %04d\n", i);
+		file_write(fd, buf, 10);
+	}
+	CTEST_ASSERT(file_size(fd) == 10000, "testing small writes grow the file");
+	file_seek(fd, 9990);
+	CTEST_ASSERT(file_read(fd, buf, 64) == 10 && memcmp(buf, "line 0999\n", 10) == 0, "testing read stops at the end of the file");
+	CTEST_ASSERT(file_read(fd, buf, 64) == 0, "testing read at the end returns 0");
+	file_close(fd);
+
+	// block-aligned data goes around the cache both ways
+	for (int i = 0; i < (int)sizeof(big); i++)
+		big[i] = i * 7;
+	fd = file_open("/big", FILE_CREATE);
+	cache_get_stats(&before);
+	CTEST_ASSERT(file_write(fd, big, sizeof(big)) == sizeof(big), "testing aligned write");
+	file_seek(fd, 0);
+	CTEST_ASSERT(file_read(fd, back, sizeof(back)) == sizeof(back), "testing aligned read");
+	cache_get_stats(&after);
+	CTEST_ASSERT(memcmp(big, back, sizeof(big)) == 0, "testing aligned data reads back");
+	CTEST_ASSERT(after.hits + after.misses == before.hits + before.misses, "testing aligned I/O bypasses the cache");
+
+	// a small sequential reader gets the following blocks fetched ahead
+	file_close(fd);
+	image_close();
+	image_open("test_image", 0);
+	fd = file_open("/big", 0);
+	cache_get_stats(&before);
+	int same = 1;
+	for (int i = 0; i < (int)sizeof(big) / 64; i++) {
+		file_read(fd, buf, 64);
+		if (memcmp(buf, big + i * 64, 64) != 0)
+			same = 0;
+	}
+	cache_get_stats(&after);
+	CTEST_ASSERT(same, "testing small sequential reads");
+	CTEST_ASSERT(after.readahead - before.readahead == 15, "testing readahead fetches the rest of the file");
+	CTEST_ASSERT(after.misses - before.misses == 1, "testing only the first block misses");
+
+	// overwrite the middle, and write past the end leaving a gap
+	file_seek(fd, 5000);
+	file_write(fd, "hello", 5);
+	file_seek(fd, sizeof(big) + 10000);
+	file_write(fd, "end", 3);
+	file_seek(fd, 4998);
+	file_read(fd, buf, 9);
+	CTEST_ASSERT(memcmp(buf, big + 4998, 2) == 0 && memcmp(buf + 2, "hello", 5) == 0 && memcmp(buf + 7, big + 5005, 2) == 0, "testing overwrite in the middle");
+	file_seek(fd, sizeof(big));
+	file_read(fd, back, 10003);
+	int zeros = 1;
+	for (int i = 0; i < 10000; i++)
+		if (back[i] != 0)
+			zeros = 0;
+	CTEST_ASSERT(zeros && memcmp(back + 10000, "end", 3) == 0, "testing gap reads back as zeros");
+	file_close(fd);
+	image_close();
+
+	// data is in the image after a reopen, truncate empties the file
+	image_open("test_image", 0);
+	fd = file_open("/big", 0);
+	CTEST_ASSERT(file_size(fd) == sizeof(big) + 10003, "testing size persists");
+	file_read(fd, back, 4096);
+	CTEST_ASSERT(memcmp(back, big, 4096) == 0, "testing data persists");
+	file_close(fd);
+	struct simfs_statfs st;
+	simfs_statfs(&st);
+	unsigned int free_before = st.free_blocks;
+	fd = file_open("/big", FILE_TRUNCATE);
+	simfs_statfs(&st);
+	CTEST_ASSERT(file_size(fd) == 0 && st.free_blocks == free_before + 19, "testing truncate frees the blocks");
+	CTEST_ASSERT(file_close(fd) == 0 && file_close(fd) == -1, "testing close of a closed descriptor");
+	image_close();
+}
+
+#define STRESS_THREADS 4
+#define STRESS_DIRS 40
+
+struct stress_result {
+	int id;
+	int made;
+	int shared_made;
+	int data_ok;
+};
+
+static void *stress_thread(void *arg)
+{
+	struct stress_result *r = arg;
+	char path[32];
+	unsigned char data[20000];
+	unsigned char back[20000];
+
+	sprintf(path, "/t%d", r->id);
+	directory_make(path);
+	// everyone races for the same name, only one may win
+	r->shared_made = directory_make("/shared") == 0;
+	for (int i = 0; i < STRESS_DIRS; i++) {
+		sprintf(path, "/t%d/d%d", r->id, i);
+		if (directory_make(path) == 0)
+			r->made++;
+		// look around in the other threads' directories meanwhile
+		sprintf(path, "/t%d", (r->id + 1) % STRESS_THREADS);
+		struct inode *in = namei(path);
+		if (in != NULL)
+			iput(in);
+	}
+
+	memset(data, r->id + 1, sizeof(data));
+	sprintf(path, "/t%d/f", r->id);
+	int fd = file_open(path, FILE_CREATE);
+	file_write(fd, data, sizeof(data));
+	file_seek(fd, 0);
+	r->data_ok = file_read(fd, back, sizeof(back)) == sizeof(back) && memcmp(data, back, sizeof(data)) == 0;
+	file_close(fd);
+	return NULL;
+}
+
+void test_threads(void)
+{
+	pthread_t threads[STRESS_THREADS];
+	struct stress_result results[STRESS_THREADS];
+	struct simfs_statfs st;
+	char path[32];
+	image_open("test_image", 0);
+	mkfs();
+
+	for (int t = 0; t < STRESS_THREADS; t++) {
+		memset(&results[t], 0, sizeof(results[t]));
+		results[t].id = t;
+		pthread_create(&threads[t], NULL, stress_thread, &results[t]);
+	}
+	int made = 0, shared = 0, data_ok = 1;
+	for (int t = 0; t < STRESS_THREADS; t++) {
+		pthread_join(threads[t], NULL);
+		made += results[t].made;
+		shared += results[t].shared_made;
+		data_ok &= results[t].data_ok;
+	}
+	CTEST_ASSERT(made == STRESS_THREADS * STRESS_DIRS, "testing concurrent directory_make");
+	CTEST_ASSERT(shared == 1, "testing a name is only created once");
+	CTEST_ASSERT(data_ok, "testing concurrent file I/O");
+
+	// everything is there afterwards, including after the caches are dropped
+	dcache_clear();
+	int all_found = 1;
+	for (int t = 0; t < STRESS_THREADS; t++) {
+		for (int i = 0; i < STRESS_DIRS; i++) {
+			sprintf(path, "/t%d/d%d", t, i);
+			struct inode *in = namei(path);
+			if (in == NULL)
+				all_found = 0;
+			else
+				iput(in);
+		}
+	}
+	CTEST_ASSERT(all_found, "testing every directory made by the threads is found");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_inodes == 255 - STRESS_THREADS * (STRESS_DIRS + 2) - 1, "testing free inode count after the threads");
+	image_close();
+}
+
+void test_async(void)
+{
+	static unsigned char data[96][BLOCK_SIZE];
+	static unsigned char back[96][BLOCK_SIZE];
+	unsigned char *out[96], *in[96];
+	unsigned char block[BLOCK_SIZE];
+	struct block_io ios[48];
+	struct cache_stats before, after;
+	int engines[] = {ASYNC_URING, ASYNC_POOL};
+	image_open("test_image", 0);
+	mkfs();
+
+	for (int i = 0; i < 96; i++) {
+		out[i] = data[i];
+		in[i] = back[i];
+	}
+	for (int e = 0; e < 2; e++) {
+		// not every kernel has io_uring, the pool always works
+		if (async_set_engine(engines[e]) == FAILED) {
+			CTEST_ASSERT(engines[e] == ASYNC_URING, "testing only io_uring can be missing");
+			continue;
+		}
+		CTEST_ASSERT(async_engine() == engines[e], "testing the engine can be chosen");
+		for (int i = 0; i < 96; i++)
+			memset(data[i], i + e * 100, BLOCK_SIZE);
+		memset(back, 0, sizeof(back));
+		// 48 two-block writes spread over the image, last one first
+		for (int i = 0; i < 48; i++) {
+			ios[i].op = BLOCK_IO_WRITE;
+			ios[i].block_num = 500 + (47 - i) * 4;
+			ios[i].count = 2;
+			ios[i].blocks = &out[i * 2];
+		}
+		bsubmit(ios, 48);
+		for (int i = 0; i < 48; i++) {
+			ios[i].op = BLOCK_IO_READ;
+			ios[i].blocks = &in[i * 2];
+		}
+		bsubmit(ios, 48);
+		CTEST_ASSERT(memcmp(data, back, sizeof(data)) == 0, "testing a batch of writes reads back");
+		block_read_disk(500, block);
+		CTEST_ASSERT(memcmp(block, data[94], BLOCK_SIZE) == 0, "testing a batch goes to the image");
+
+		// past the end of the image reads as zeros, and the cache's
+		// newer copy wins over the image
+		memset(block, 'x', BLOCK_SIZE);
+		bwrite(501, block);
+		ios[0].block_num = 5000;
+		ios[0].count = 1;
+		ios[1].block_num = 501;
+		ios[1].count = 1;
+		bsubmit(ios, 2);
+		CTEST_ASSERT(back[0][0] == 0 && back[0][BLOCK_SIZE - 1] == 0, "testing reads past the end are zeros");
+		CTEST_ASSERT(back[2][0] == 'x', "testing a batch sees cached writes");
+	}
+	CTEST_ASSERT(async_set_engine(ASYNC_AUTO) == 0, "testing back to the default engine");
+
+	// a flush sends scattered dirty blocks out as one batch
+	for (int i = 0; i < 8; i++) {
+		memset(block, 'a' + i, BLOCK_SIZE);
+		bwrite(600 + i * 3, block);
+	}
+	bflush();
+	int flushed = 1;
+	for (int i = 0; i < 8; i++) {
+		block_read_disk(600 + i * 3, block);
+		flushed &= block[0] == 'a' + i && block[BLOCK_SIZE - 1] == 'a' + i;
+	}
+	CTEST_ASSERT(flushed, "testing bflush writes every dirty block");
+
+	// prefetched blocks are cached once, repeats and all
+	int wanted[] = {703, 700, 709, 700, 701};
+	cache_reset_stats();
+	bprefetch(wanted, 5);
+	cache_get_stats(&before);
+	CTEST_ASSERT(before.readahead == 4 && before.misses == 0, "testing bprefetch reads each missing block once");
+	for (int i = 0; i < 5; i++)
+		bread(wanted[i], block);
+	cache_get_stats(&after);
+	CTEST_ASSERT(after.misses == 0 && after.hits == 5, "testing prefetched blocks are hits");
+	int nums[] = {70, 130, 250};
+	cache_reset_stats();
+	inode_prefetch(nums, 3);
+	for (int i = 0; i < 3; i++)
+		iput(iget(nums[i]));
+	cache_get_stats(&after);
+	CTEST_ASSERT(after.misses == 0, "testing inode_prefetch fetches the inode table blocks");
+	image_close();
+
+	// the ring's descriptor is gone with the image
+	CTEST_ASSERT(image_open("test_image", 0) == 3, "testing image_close shuts the engine down");
+	image_close();
+}
+
+#define JOURNAL_THREADS 4
+#define JOURNAL_DIRS 10
+
+void *journal_thread(void *arg)
+{
+	char path[32];
+	int id = *(int *)arg;
+	for (int i = 0; i < JOURNAL_DIRS; i++) {
+		sprintf(path, "/g%d_%d", id, i);
+		directory_make(path);
+	}
+	return NULL;
+}
+
+void test_journal(void)
+{
+	struct mkfs_options options;
+	struct journal_stats before, after;
+	struct simfs_statfs st;
+	pthread_t threads[JOURNAL_THREADS];
+	int ids[JOURNAL_THREADS];
+	char path[32];
+	image_open("test_image", 0);
+
+	mkfs_default_options(&options);
+	options.journal_blocks = 8;
+	CTEST_ASSERT(mkfs_with_options(&options) == -1, "testing a journal too small to use");
+	options.journal_blocks = 64;
+	CTEST_ASSERT(mkfs_with_options(&options) == 0, "testing mkfs with a journal");
+	CTEST_ASSERT(journal_enabled() && sb.journal_start == 7 && sb.first_data_block == 71, "testing the journal follows the inode table");
+	struct inode *root = iget(0);
+	CTEST_ASSERT(bmap(root, 0, NULL) == 71, "testing data starts after the journal");
+	iput(root);
+
+	// each operation is a transaction, nested handles make one
+	journal_get_stats(&before);
+	directory_make("/a");
+	journal_start();
+	directory_make("/b");
+	directory_make("/c");
+	journal_stop();
+	journal_get_stats(&after);
+	CTEST_ASSERT(after.transactions - before.transactions == 2, "testing nested handles commit together");
+	CTEST_ASSERT(after.handles - before.handles == 2 && after.blocks > before.blocks, "testing handles are counted");
+
+	// crash with one update still open: what was committed comes back
+	// from the log, the rest is gone
+	journal_start();
+	directory_make("/lost");
+	journal_abort();
+	invalidate_incore_inodes();
+	dcache_clear();
+	free_map_reset();
+	cache_invalidate();
+	close(image_fd);
+	journal_get_stats(&before);
+	image_open("test_image", 0);
+	journal_get_stats(&after);
+	CTEST_ASSERT(after.replayed - before.replayed == 2, "testing committed transactions are replayed");
+	int found = 1;
+	char *names[] = {"/a", "/b", "/c"};
+	for (int i = 0; i < 3; i++) {
+		struct inode *in = namei(names[i]);
+		found &= in != NULL;
+		if (in != NULL)
+			iput(in);
+	}
+	CTEST_ASSERT(found, "testing committed directories survive a crash");
+	CTEST_ASSERT(namei("/lost") == NULL, "testing an uncommitted directory is gone");
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_inodes == 252 && st.free_blocks == 1024 - 71 - 4, "testing free counts are rebuilt after a crash");
+
+	// concurrent operations share commits, and the log is checkpointed
+	// as it fills
+	journal_get_stats(&before);
+	for (int t = 0; t < JOURNAL_THREADS; t++) {
+		ids[t] = t;
+		pthread_create(&threads[t], NULL, journal_thread, &ids[t]);
+	}
+	for (int t = 0; t < JOURNAL_THREADS; t++)
+		pthread_join(threads[t], NULL);
+	journal_get_stats(&after);
+	CTEST_ASSERT(after.handles - before.handles == JOURNAL_THREADS * JOURNAL_DIRS, "testing every mkdir had a handle");
+	CTEST_ASSERT(after.transactions - before.transactions <= JOURNAL_THREADS * JOURNAL_DIRS, "testing commits are grouped");
+	CTEST_ASSERT(after.checkpoints > before.checkpoints, "testing the log is checkpointed");
+	image_close();
+
+	// a clean close leaves nothing to replay
+	journal_get_stats(&before);
+	image_open("test_image", 0);
+	journal_get_stats(&after);
+	CTEST_ASSERT(after.replayed == before.replayed, "testing a clean close empties the log");
+	found = 1;
+	for (int t = 0; t < JOURNAL_THREADS; t++) {
+		for (int i = 0; i < JOURNAL_DIRS; i++) {
+			sprintf(path, "/g%d_%d", t, i);
+			struct inode *in = namei(path);
+			found &= in != NULL;
+			if (in != NULL)
+				iput(in);
+		}
+	}
+	CTEST_ASSERT(found, "testing directories made by the threads are all there");
+	image_close();
+}
+
+void test_journal_checkpoint(void)
+{
+	struct mkfs_options options;
+	image_open("test_image", 0);
+	mkfs_default_options(&options);
+	options.journal_blocks = 64;
+	mkfs_with_options(&options);
+
+	// /x is committed but still only in the cache and the log. the
+	// open update dirties the root's block again, so a checkpoint
+	// can't flush that block and has to write /x's version home itself
+	directory_make("/x");
+	journal_start();
+	directory_make("/y");
+	journal_checkpoint();
+	journal_abort();
+	invalidate_incore_inodes();
+	dcache_clear();
+	free_map_reset();
+	cache_invalidate();
+	close(image_fd);
+
+	image_open("test_image", 0);
+	struct inode *in = namei("/x");
+	CTEST_ASSERT(in != NULL, "testing a checkpoint keeps a committed block the running update holds");
+	if (in != NULL)
+		iput(in);
+	CTEST_ASSERT(namei("/y") == NULL, "testing the running update is still lost");
+	image_close();
+}
+
+void test_journal_credits(void)
+{
+	struct mkfs_options options;
+	struct journal_stats before, after;
+	unsigned char block[BLOCK_SIZE] = {0};
+	char path[64];
+	image_open("test_image", 0);
+	mkfs_default_options(&options);
+	options.journal_blocks = JOURNAL_MIN_BLOCKS;
+	mkfs_with_options(&options);
+
+	// a handle can't reserve more than a transaction holds
+	journal_start();
+	CTEST_ASSERT(journal_extend(JOURNAL_MIN_BLOCKS) == FAILED, "testing a reservation bigger than the log is refused");
+	CTEST_ASSERT(journal_extend(1) == 0, "testing a reservation that fits is granted");
+	journal_stop();
+
+	// indexing the root once it's past a block takes more than this
+	// log's transactions hold, so it goes without an index and every
+	// mkdir still commits whole
+	int made = 1;
+	for (int i = 0; i < 160; i++) {
+		sprintf(path, "/dir%03d", i);
+		made &= directory_make(path) == 0;
+	}
+	struct inode *root = iget(0);
+	CTEST_ASSERT(made && root->index_block == 0, "testing an index too big for the log isn't built");
+	iput(root);
+
+	// two files taking turns get a block at a time, so each is a long
+	// list of one block extents, freed by as many handles as it takes
+	int a = file_open("/f", FILE_CREATE);
+	int b = file_open("/g", FILE_CREATE);
+	for (int i = 0; i < 40; i++) {
+		file_write(a, block, BLOCK_SIZE);
+		file_write(b, block, BLOCK_SIZE);
+	}
+	file_close(a);
+	file_close(b);
+	journal_get_stats(&before);
+	a = file_open("/f", FILE_TRUNCATE);
+	journal_get_stats(&after);
+	CTEST_ASSERT(file_size(a) == 0 && after.transactions > before.transactions, "testing a fragmented file is truncated under a small log");
+	file_close(a);
+
+	// all of it was committed
+	journal_abort();
+	invalidate_incore_inodes();
+	dcache_clear();
+	free_map_reset();
+	cache_invalidate();
+	close(image_fd);
+	image_open("test_image", 0);
+	int found = 1;
+	for (int i = 0; i < 160; i++) {
+		sprintf(path, "/dir%03d", i);
+		struct inode *in = namei(path);
+		found &= in != NULL;
+		if (in != NULL)
+			iput(in);
+	}
+	CTEST_ASSERT(found, "testing the unindexed directory survives a crash");
+	a = file_open("/f", 0);
+	CTEST_ASSERT(a != FAILED && file_size(a) == 0, "testing the truncate survives a crash");
+	file_close(a);
+
+	// a handle changing more inodes than its list starts with still
+	// logs the last state of every one of them
+	struct inode *made_inodes[JOURNAL_HANDLE_INODES + 2];
+	journal_start();
+	for (int i = 0; i < JOURNAL_HANDLE_INODES + 2; i++)
+		made_inodes[i] = ialloc();
+	int last = made_inodes[JOURNAL_HANDLE_INODES + 1]->inode_num;
+	for (int i = 0; i < JOURNAL_HANDLE_INODES + 2; i++) {
+		made_inodes[i]->size = 100 + i;
+		iput(made_inodes[i]);
+	}
+	journal_stop();
+
+	// a handle that dirties more than the transaction holds fails the
+	// journal rather than the process. none of it reaches the image
+	unsigned char before_overrun[BLOCK_SIZE];
+	int far = sb.block_count - 20;
+	bread(far, before_overrun);
+	journal_start();
+	for (int i = 0; i < 20; i++) {
+		unsigned char *dirty = bget(far + i);
+		memset(dirty, 'x', BLOCK_SIZE);
+		bdirty(far + i);
+		brelse(far + i);
+	}
+	CTEST_ASSERT(journal_stop() == FAILED, "testing a handle overrunning the transaction fails");
+	CTEST_ASSERT(journal_start() == FAILED && directory_make("/late") == FAILED, "testing a failed journal refuses updates");
+	image_close();
+
+	image_open("test_image", 0);
+	struct inode *in = iget(last);
+	CTEST_ASSERT(in->size == 100 + JOURNAL_HANDLE_INODES + 1, "testing an inode past the handle's list keeps later changes");
+	iput(in);
+	bread(far, block);
+	CTEST_ASSERT(memcmp(block, before_overrun, BLOCK_SIZE) == 0, "testing an overrun transaction is lost whole");
+	CTEST_ASSERT(namei("/late") == NULL && journal_start() == 0, "testing the journal works again once reopened");
+	journal_stop();
+	image_close();
+}
+
+void test_journal_index(void)
+{
+	struct mkfs_options options;
+	char path[64];
+	image_open("test_image", 0);
+	mkfs_default_options(&options);
+	options.image_size = 8 * 1024 * 1024;
+	options.inode_count = 4096;
+	options.journal_blocks = 256;
+	options.variable_dirents = 1;
+	mkfs_with_options(&options);
+
+	// the index is sized by how many entries there are, not by how
+	// many of the shortest would fit, so long names don't price it out
+	// of the transaction
+	int made = 1;
+	for (int i = 0; i < 3000; i++) {
+		sprintf(path, "/a_rather_long_file_name_%05d", i);
+		int fd = file_open(path, FILE_CREATE);
+		made &= fd != FAILED;
+		file_close(fd);
+	}
+	struct inode *root = iget(ROOT_INODE_NUM);
+	CTEST_ASSERT(made && root->index_block != 0, "testing a big directory of long names keeps its index");
+	unsigned char *header = bget(root->index_block);
+	unsigned int pages = read_u32(header + DIRINDEX_PAGES_OFFSET);
+	brelse(root->index_block);
+	CTEST_ASSERT(pages <= 3000 / (DIRINDEX_PAGE_FULL / 2) + 1, "testing the index is sized by its entries");
+	iput(root);
+	struct inode *in = namei("/a_rather_long_file_name_02999");
+	CTEST_ASSERT(in != NULL, "testing a lookup through it");
+	if (in != NULL)
+		iput(in);
+	image_close();
+}
+
+void test_journal_file(void)
+{
+	struct mkfs_options options;
+	struct simfs_statfs st;
+	unsigned char data[2 * BLOCK_SIZE];
+	unsigned char back[sizeof(data)];
+	image_open("test_image", 0);
+	mkfs_default_options(&options);
+	options.journal_blocks = 64;
+	mkfs_with_options(&options);
+
+	// a write's size and blocks are committed with it. the data itself
+	// isn't journaled, but whole blocks go straight to the image
+	memset(data, 'j', sizeof(data));
+	int fd = file_open("/f", FILE_CREATE);
+	CTEST_ASSERT(file_write(fd, data, sizeof(data)) == (int)sizeof(data), "testing a write under a journal");
+	file_close(fd);
+	simfs_statfs(&st);
+	unsigned int free_blocks = st.free_blocks;
+	journal_abort();
+	invalidate_incore_inodes();
+	dcache_clear();
+	free_map_reset();
+	cache_invalidate();
+	close(image_fd);
+
+	image_open("test_image", 0);
+	fd = file_open("/f", 0);
+	CTEST_ASSERT(fd != FAILED && file_size(fd) == (int)sizeof(data), "testing a write's size survives a crash");
+	CTEST_ASSERT(file_read(fd, back, sizeof(back)) == (int)sizeof(back) && memcmp(back, data, sizeof(data)) == 0, "testing the written blocks read back");
+	file_close(fd);
+	simfs_statfs(&st);
+	CTEST_ASSERT(st.free_blocks == free_blocks, "testing a write's blocks stay allocated after a crash");
+	image_close();
+}
+
+void test_journal_reuse(void)
+{
+	struct mkfs_options options;
+	unsigned char block[BLOCK_SIZE];
+	image_open("test_image", 0);
+	mkfs_default_options(&options);
+	options.journal_blocks = 64;
+	mkfs_with_options(&options);
+
+	// a block freed and allocated again by the same transaction is
+	// revoked and then logged. replay has to keep its new contents
+	journal_start();
+	int num = alloc();
+	memset(block, 'A', BLOCK_SIZE);
+	bwrite(num, block);
+	free_map_free(&block_map, num);
+	int again = alloc_near(num);
+	memset(block, 'B', BLOCK_SIZE);
+	bwrite(again, block);
+	journal_stop();
+	CTEST_ASSERT(again == num, "testing the freed block is allocated again");
+	journal_abort();
+	invalidate_incore_inodes();
+	dcache_clear();
+	free_map_reset();
+	cache_invalidate();
+	close(image_fd);
+
+	image_open("test_image", 0);
+	bread(again, block);
+	CTEST_ASSERT(block[0] == 'B' && block[BLOCK_SIZE - 1] == 'B', "testing a block reused in one transaction is replayed");
+	image_close();
+}
+
+void *stats_thread(void *arg)
+{
+	unsigned char block[BLOCK_SIZE];
+	(void)arg;
+	for (int i = 0; i < 100; i++)
+		bread(100 + i % 4, block);
+	return NULL;
+}
+
+void test_stats(void)
+{
+	struct simfs_stats s;
+	unsigned char block[BLOCK_SIZE] = {0};
+	char dump[8192];
+	pthread_t threads[2];
+	image_open("test_image", 0);
+	mkfs();
+
+	simfs_stats_reset();
+	if (simfs_stats(&s) == FAILED) {
+		CTEST_ASSERT(s.ops[STAT_BREAD].calls == 0, "testing stats that aren't built in read as zeros");
+		image_close();
+		return;
+	}
+	CTEST_ASSERT(s.ops[STAT_BREAD].calls == 0 && s.ops[STAT_IGET_HIT].calls == 0, "testing stats start at zero after a reset");
+
+	for (int i = 0; i < 3; i++)
+		bread(100, block);
+	bwrite(101, block);
+	alloc();
+	iput(iget(0));
+	iput(iget(200));
+	directory_make("/s");
+	// counts from threads that have exited are kept
+	for (int t = 0; t < 2; t++)
+		pthread_create(&threads[t], NULL, stats_thread, NULL);
+	for (int t = 0; t < 2; t++)
+		pthread_join(threads[t], NULL);
+
+	simfs_stats(&s);
+	struct simfs_op_stats *reads = &s.ops[STAT_BREAD];
+	CTEST_ASSERT(reads->calls == 203 && reads->bytes == 203ULL * BLOCK_SIZE, "testing bread calls and bytes");
+	unsigned long long in_histogram = 0;
+	for (int b = 0; b < STATS_BUCKETS; b++)
+		in_histogram += reads->histogram[b];
+	CTEST_ASSERT(in_histogram == reads->calls && reads->ns > 0, "testing every call lands in the histogram");
+	CTEST_ASSERT(simfs_stats_percentile(reads, 0.5) <= simfs_stats_percentile(reads, 0.99), "testing percentiles are ordered");
+	CTEST_ASSERT(s.ops[STAT_BWRITE].calls >= 1 && s.ops[STAT_ALLOC].calls >= 2, "testing bwrite and alloc are counted");
+	CTEST_ASSERT(s.ops[STAT_IGET_HIT].calls >= 1 && s.ops[STAT_IGET_READ].calls >= 1, "testing iget hits and reads are told apart");
+	CTEST_ASSERT(s.ops[STAT_IPUT].calls >= 2 && s.ops[STAT_IALLOC].calls == 1, "testing iput and ialloc are counted");
+	CTEST_ASSERT(s.ops[STAT_DIRECTORY_MAKE].calls == 1, "testing directory_make is counted");
+	// an iput() with nothing left to drop is counted too
+	struct inode *in = iget(200);
+	iput(in);
+	iput(in);
+	struct simfs_stats after;
+	simfs_stats(&after);
+	CTEST_ASSERT(after.ops[STAT_IPUT].calls == s.ops[STAT_IPUT].calls + 2, "testing every iput is counted");
+
+	FILE *f = tmpfile();
+	simfs_stats_dump(f, STATS_JSON);
+	rewind(f);
+	size_t len = fread(dump, 1, sizeof(dump) - 1, f);
+	dump[len] = '\0';
+	fclose(f);
+	CTEST_ASSERT(strncmp(dump, "{\"enabled\": true,", 17) == 0 &&
+		     strstr(dump, "\"directory_make\": {\"calls\": 1,") != NULL, "testing the JSON dump");
+	image_close();
+}
+
+void test_trace(void)
+{
+	struct trace_record *records;
+	struct trace_summary sum;
+	unsigned char block[BLOCK_SIZE];
+	unsigned char before[BLOCK_SIZE];
+	image_open("test_image", 0);
+
+	CTEST_ASSERT(trace_start("test_trace") == 0, "testing a trace starts");
+	mkfs();
+	directory_make("/t");
+	bread(100, block);
+	bread(100, block);
+	bwrite(101, block);
+	trace_stop();
+	// nothing is recorded once the trace stops
+	bread(102, block);
+
+	int count = trace_load("test_trace", &records);
+	CTEST_ASSERT(count > 3, "testing the trace holds records");
+	struct trace_record *last = &records[count - 3];
+	CTEST_ASSERT(last[0].block_num == 100 && last[0].op == TRACE_READ && last[1].block_num == 100 &&
+		     last[2].block_num == 101 && last[2].op == TRACE_WRITE, "testing accesses are recorded in order");
+	CTEST_ASSERT(last[0].caller == TRACE_OP_NONE && last[0].thread == 1, "testing untagged accesses and the thread");
+	int mkfs_seen = 0, make_seen = 0, ordered = 1;
+	for (int i = 0; i < count; i++) {
+		mkfs_seen |= records[i].caller == TRACE_OP_MKFS;
+		make_seen |= records[i].caller == TRACE_OP_DIRECTORY_MAKE;
+		if (i > 0 && records[i].ns < records[i - 1].ns)
+			ordered = 0;
+	}
+	CTEST_ASSERT(mkfs_seen && make_seen, "testing accesses are tagged with their caller");
+	CTEST_ASSERT(ordered, "testing timestamps don't go backwards");
+
+	trace_analyze(records, count, &sum);
+	CTEST_ASSERT(sum.records == (unsigned long)count && sum.reads + sum.writes == sum.records, "testing reads and writes add up");
+	CTEST_ASSERT(sum.block_reads[100] == 2 && sum.rereads >= 1, "testing rereads are counted");
+	CTEST_ASSERT(sum.working_set >= sum.read_set && sum.working_set <= sum.records, "testing the working set");
+	unsigned long in_runs = 0;
+	for (int b = 0; b < TRACE_RUN_BUCKETS; b++)
+		in_runs += sum.run_lengths[b];
+	CTEST_ASSERT(sum.runs > 0 && in_runs == sum.runs, "testing every run lands in a bucket");
+	trace_summary_free(&sum);
+
+	// a replay leaves the image as it was
+	bread(7, before);
+	trace_replay(records, count);
+	bread(7, block);
+	CTEST_ASSERT(memcmp(before, block, BLOCK_SIZE) == 0, "testing a replay doesn't change the image");
+	free(records);
+
+	CTEST_ASSERT(trace_load("test_image", &records) == FAILED, "testing a file that isn't a trace is refused");
+	image_close();
+}
+
 void test_directory_make_failures(void)
 {
 	image_open("test_image", 0);
@@ -362,20 +2045,50 @@ int main(void)
     CTEST_VERBOSE(1);
 	test_image_open_and_close();
 	test_bread_and_bwrite();
+	test_cache();
+	test_breadv_and_bwritev();
+	test_bget_and_brelse();
+	test_image_mmap();
 	test_set_free();
 	test_find_free();
+	test_find_free_from_and_run();
 	test_alloc();
 	test_ialloc();
 	test_mkfs();
+	test_alloc_n_and_ialloc_n();
+	test_mkfs_with_options();
+	test_superblock();
+	test_groups();
+	test_locality();
+	test_inline_dirs();
+	test_variable_dirents();
 	// test_read_and_write_inode();
 	// test_iget();
 	// test_iput();
+	test_inode_table();
+	test_inode_writeback();
 	test_directory();
 	test_directory_failures();
+	test_directory_get_batch();
 	test_namei();
 	test_directory_make_failures();
 	test_directory_make_success();
+	test_namei_walk();
+	test_directory_index();
+	test_extents();
+	test_file_read_and_write();
+	test_threads();
+	test_async();
+	test_journal();
+	test_journal_checkpoint();
+	test_journal_credits();
+	test_journal_index();
+	test_journal_file();
+	test_journal_reuse();
+	test_stats();
+	test_trace();
 	test_ls();
+	test_ls_options();
 
     CTEST_RESULTS();
     CTEST_COLOR(1);
@@ -0,0 +1,214 @@
+// counters and latency histograms for the library's main operations.
+// each thread counts into its own block with uncontended atomic adds,
+// so recording takes no lock; simfs_stats() adds the blocks up
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "block.h"
+#include "stats.h"
+
+static const char *op_names[STAT_OP_COUNT] = {
+    "bread",
+    "bwrite",
+    "alloc",
+    "ialloc",
+    "iget_hit",
+    "iget_read",
+    "iput",
+    "inode_writeback",
+    "directory_get",
+    "directory_make",
+};
+
+const char *simfs_stats_name(int op)
+{
+    if (op < 0 || op >= STAT_OP_COUNT)
+        return NULL;
+    return op_names[op];
+}
+
+#ifdef SIMFS_STATS
+
+struct thread_stats {
+    struct simfs_stats stats;
+    struct thread_stats *next;
+};
+
+// live threads' blocks, and the totals of threads that have exited.
+// the lock is only for registering, retiring and reading
+static struct thread_stats *threads = NULL;
+static struct simfs_stats retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_stats *mine = NULL;
+
+static void add_stats(struct simfs_stats *to, struct simfs_stats *from)
+{
+    for (int i = 0; i < STAT_OP_COUNT; i++) {
+        struct simfs_op_stats *t = &to->ops[i];
+        struct simfs_op_stats *f = &from->ops[i];
+        t->calls += __atomic_load_n(&f->calls, __ATOMIC_RELAXED);
+        t->bytes += __atomic_load_n(&f->bytes, __ATOMIC_RELAXED);
+        t->ns += __atomic_load_n(&f->ns, __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            t->histogram[b] += __atomic_load_n(&f->histogram[b], __ATOMIC_RELAXED);
+    }
+}
+
+// a thread is exiting, fold its counts into the totals
+static void retire_thread(void *arg)
+{
+    struct thread_stats *ts = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    struct thread_stats **link = &threads;
+    while (*link != ts)
+        link = &(*link)->next;
+    *link = ts->next;
+    add_stats(&retired, &ts->stats);
+    pthread_mutex_unlock(&stats_lock);
+    free(ts);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&stats_key, retire_thread);
+}
+
+static struct thread_stats *thread_stats(void)
+{
+    if (mine != NULL)
+        return mine;
+
+    pthread_once(&stats_once, make_key);
+    mine = calloc(1, sizeof(struct thread_stats));
+    if (mine == NULL)
+        exit(1);
+    pthread_mutex_lock(&stats_lock);
+    mine->next = threads;
+    threads = mine;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, mine);
+    return mine;
+}
+
+long long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// count one call of op that began at started
+void stats_record(int op, long long started, unsigned long long bytes)
+{
+    unsigned long long ns = stats_now() - started;
+    struct simfs_op_stats *s = &thread_stats()->stats.ops[op];
+    int bucket = 63 - __builtin_clzll(ns | 1);
+
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+    __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// totals over every thread. returns FAILED if the library was built
+// without SIMFS_STATS, with out zeroed
+int simfs_stats(struct simfs_stats *out)
+{
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&stats_lock);
+    add_stats(out, &retired);
+    for (struct thread_stats *ts = threads; ts != NULL; ts = ts->next)
+        add_stats(out, &ts->stats);
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+}
+
+static void zero_stats(struct simfs_stats *s)
+{
+    unsigned long long *counter = (unsigned long long *)s;
+    int count = sizeof(*s) / sizeof(*counter);
+
+    for (int i = 0; i < count; i++)
+        __atomic_store_n(&counter[i], 0, __ATOMIC_RELAXED);
+}
+
+void simfs_stats_reset(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    zero_stats(&retired);
+    for (struct thread_stats *ts = threads; ts != NULL; ts = ts->next)
+        zero_stats(&ts->stats);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+#else
+
+int simfs_stats(struct simfs_stats *out)
+{
+    memset(out, 0, sizeof(*out));
+    return FAILED;
+}
+
+void simfs_stats_reset(void)
+{
+}
+
+#endif
+
+// the latency below which fraction of the calls fell, in ns. the
+// histogram only knows powers of two, so this is a bucket's upper end
+unsigned long long simfs_stats_percentile(struct simfs_op_stats *op, double fraction)
+{
+    unsigned long long seen = 0;
+
+    if (op->calls == 0)
+        return 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += op->histogram[b];
+        if (seen >= op->calls * fraction)
+            return 2ULL << b;
+    }
+    return 2ULL << (STATS_BUCKETS - 1);
+}
+
+// print the totals as a table or as one JSON object keyed by operation
+void simfs_stats_dump(FILE *f, int format)
+{
+    struct simfs_stats s;
+    int enabled = simfs_stats(&s) == 0;
+
+    if (format == STATS_JSON) {
+        fprintf(f, "{\"enabled\": %s", enabled ? "true" : "false");
+        for (int i = 0; i < STAT_OP_COUNT; i++) {
+            struct simfs_op_stats *op = &s.ops[i];
+            fprintf(f, ", \"%s\": {\"calls\": %llu, \"bytes\": %llu, \"ns\": %llu, \"histogram\": [",
+                    op_names[i], op->calls, op->bytes, op->ns);
+            for (int b = 0; b < STATS_BUCKETS; b++)
+                fprintf(f, "%s%llu", b ? ", " : "", op->histogram[b]);
+            fprintf(f, "]}");
+        }
+        fprintf(f, "}\n");
+        return;
+    }
+
+    if (!enabled) {
+        fprintf(f, "stats not built in, rebuild with -DSIMFS_STATS\n");
+        return;
+    }
+    fprintf(f, "%-16s %10s %12s %12s %10s %10s %10s\n",
+            "operation", "calls", "bytes", "total us", "avg ns", "p50 ns", "p99 ns");
+    for (int i = 0; i < STAT_OP_COUNT; i++) {
+        struct simfs_op_stats *op = &s.ops[i];
+        fprintf(f, "%-16s %10llu %12llu %12.1f %10llu %10llu %10llu\n",
+                op_names[i], op->calls, op->bytes, op->ns / 1000.0,
+                op->calls ? op->ns / op->calls : 0,
+                simfs_stats_percentile(op, 0.5), simfs_stats_percentile(op, 0.99));
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+// operations that are counted and timed
+#define STAT_BREAD 0
+#define STAT_BWRITE 1
+#define STAT_ALLOC 2
+#define STAT_IALLOC 3
+#define STAT_IGET_HIT 4        // found in core
+#define STAT_IGET_READ 5       // read from the inode table
+#define STAT_IPUT 6
+// iput() never writes, a dirty inode is written when its slot is reused
+// or by inode_sync(). those writes are counted here
+#define STAT_INODE_WRITEBACK 7
+#define STAT_DIRECTORY_GET 8
+#define STAT_DIRECTORY_MAKE 9
+#define STAT_OP_COUNT 10
+
+// latency histogram bucket b counts calls taking [2^b, 2^(b+1)) ns
+#define STATS_BUCKETS 40
+
+// simfs_stats_dump() formats
+#define STATS_TEXT 0
+#define STATS_JSON 1
+
+struct simfs_op_stats {
+    unsigned long long calls;
+    unsigned long long bytes;
+    unsigned long long ns;
+    unsigned long long histogram[STATS_BUCKETS];
+};
+
+struct simfs_stats {
+    struct simfs_op_stats ops[STAT_OP_COUNT];
+};
+
+// the instrumentation itself. built with SIMFS_STATS it reads the clock
+// around each counted call; without it these expand to nothing
+#ifdef SIMFS_STATS
+#define STATS_START(t) long long t = stats_now()
+#define STATS_END(op, t, bytes) stats_record((op), (t), (bytes))
+long long stats_now(void);
+void stats_record(int op, long long started, unsigned long long bytes);
+#else
+#define STATS_START(t)
+#define STATS_END(op, t, bytes)
+#endif
+
+int simfs_stats(struct simfs_stats *out);
+void simfs_stats_reset(void);
+const char *simfs_stats_name(int op);
+unsigned long long simfs_stats_percentile(struct simfs_op_stats *op, double fraction);
+void simfs_stats_dump(FILE *f, int format);
+
+#endif
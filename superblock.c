@@ -0,0 +1,176 @@
+// the superblock in block 0: layout of the image and free space counters
+#include "block.h"
+#include "free.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "pack.h"
+#include "superblock.h"
+
+struct superblock sb;
+
+// the fixed layout images had before there was a superblock
+void superblock_defaults(void)
+{
+    sb.magic = 0;
+    sb.version = 0;
+    sb.block_size = BLOCK_SIZE;
+    sb.block_count = FOUR_MB_IMAGE / BLOCK_SIZE;
+    sb.inode_count = DEFAULT_INODE_COUNT;
+    sb.inode_map = FREE_INODE;
+    sb.block_map = FREE_DATA;
+    sb.inode_table = INODE_FIRST_BLOCK;
+    sb.inode_table_blocks = DEFAULT_INODE_COUNT / INODES_PER_BLOCK;
+    sb.first_data_block = METADATA;
+    sb.free_blocks = 0;
+    sb.free_inodes = 0;
+    sb.journal_start = 0;
+    sb.journal_blocks = 0;
+    sb.group_count = 1;
+    sb.blocks_per_group = FREE_MAP_BITS;
+    sb.inodes_per_group = DEFAULT_INODE_COUNT;
+    sb.features = 0;
+    sb.inode_size = INODE_SIZE;
+    sb.valid = 0;
+
+    free_map_setup();
+}
+
+// read the superblock of the open image. images without one get the
+// default layout and no free space accounting. returns FAILED if the
+// image was made by a newer version
+int superblock_load(void)
+{
+    unsigned char *block = bget(SUPERBLOCK_BLOCK);
+    int status = 0;
+
+    superblock_defaults();
+    // version 1 inodes had block pointers where the extents are now.
+    // such an image can only be reformatted, so it's opened as if it
+    // had no superblock
+    if (read_u32(block + SB_MAGIC_OFFSET) == SUPERBLOCK_MAGIC &&
+        read_u32(block + SB_VERSION_OFFSET) >= SUPERBLOCK_MIN_VERSION) {
+        sb.magic = SUPERBLOCK_MAGIC;
+        sb.version = read_u32(block + SB_VERSION_OFFSET);
+        sb.block_size = read_u32(block + SB_BLOCK_SIZE_OFFSET);
+        sb.block_count = read_u32(block + SB_BLOCK_COUNT_OFFSET);
+        sb.inode_count = read_u32(block + SB_INODE_COUNT_OFFSET);
+        sb.inode_map = read_u32(block + SB_INODE_MAP_OFFSET);
+        sb.block_map = read_u32(block + SB_BLOCK_MAP_OFFSET);
+        sb.inode_table = read_u32(block + SB_INODE_TABLE_OFFSET);
+        sb.inode_table_blocks = read_u32(block + SB_INODE_TABLE_BLOCKS_OFFSET);
+        sb.first_data_block = read_u32(block + SB_FIRST_DATA_BLOCK_OFFSET);
+        sb.free_blocks = read_u32(block + SB_FREE_BLOCKS_OFFSET);
+        sb.free_inodes = read_u32(block + SB_FREE_INODES_OFFSET);
+        sb.journal_start = read_u32(block + SB_JOURNAL_START_OFFSET);
+        sb.journal_blocks = read_u32(block + SB_JOURNAL_BLOCKS_OFFSET);
+        sb.group_count = read_u32(block + SB_GROUP_COUNT_OFFSET);
+        sb.blocks_per_group = read_u32(block + SB_BLOCKS_PER_GROUP_OFFSET);
+        sb.inodes_per_group = read_u32(block + SB_INODES_PER_GROUP_OFFSET);
+        sb.features = read_u32(block + SB_FEATURES_OFFSET);
+        sb.inode_size = read_u32(block + SB_INODE_SIZE_OFFSET);
+        sb.valid = 1;
+        if (sb.group_count == 0) {
+            sb.group_count = 1;
+            sb.blocks_per_group = FREE_MAP_BITS;
+            sb.inodes_per_group = sb.inode_count;
+        }
+        if (sb.inode_size == 0)
+            sb.inode_size = INODE_SIZE;
+
+        // don't touch an image we can't make sense of, not even to
+        // write the superblock back on close
+        if (sb.version > SUPERBLOCK_VERSION || sb.block_size != BLOCK_SIZE ||
+            sb.blocks_per_group != FREE_MAP_BITS || sb.inodes_per_group > FREE_MAP_BITS ||
+            (sb.features & ~FEATURES_SUPPORTED) != 0 ||
+            sb.inode_size != ((sb.features & FEATURE_INLINE_DATA) ? INODE_SIZE_INLINE : INODE_SIZE)) {
+            superblock_defaults();
+            status = FAILED;
+        }
+        free_map_setup();
+    }
+
+    brelse(SUPERBLOCK_BLOCK);
+    return status;
+}
+
+// write the in-core superblock back to block 0
+void superblock_sync(void)
+{
+    if (!sb.valid)
+        return;
+
+    unsigned char *block = bget(SUPERBLOCK_BLOCK);
+
+    write_u32(block + SB_MAGIC_OFFSET, sb.magic);
+    write_u32(block + SB_VERSION_OFFSET, sb.version);
+    write_u32(block + SB_BLOCK_SIZE_OFFSET, sb.block_size);
+    write_u32(block + SB_BLOCK_COUNT_OFFSET, sb.block_count);
+    write_u32(block + SB_INODE_COUNT_OFFSET, sb.inode_count);
+    write_u32(block + SB_INODE_MAP_OFFSET, sb.inode_map);
+    write_u32(block + SB_BLOCK_MAP_OFFSET, sb.block_map);
+    write_u32(block + SB_INODE_TABLE_OFFSET, sb.inode_table);
+    write_u32(block + SB_INODE_TABLE_BLOCKS_OFFSET, sb.inode_table_blocks);
+    write_u32(block + SB_FIRST_DATA_BLOCK_OFFSET, sb.first_data_block);
+    write_u32(block + SB_FREE_BLOCKS_OFFSET, sb.free_blocks);
+    write_u32(block + SB_FREE_INODES_OFFSET, sb.free_inodes);
+    write_u32(block + SB_JOURNAL_START_OFFSET, sb.journal_start);
+    write_u32(block + SB_JOURNAL_BLOCKS_OFFSET, sb.journal_blocks);
+    write_u32(block + SB_GROUP_COUNT_OFFSET, sb.group_count);
+    write_u32(block + SB_BLOCKS_PER_GROUP_OFFSET, sb.blocks_per_group);
+    write_u32(block + SB_INODES_PER_GROUP_OFFSET, sb.inodes_per_group);
+    write_u32(block + SB_FEATURES_OFFSET, sb.features);
+    // left zero unless it differs, so older images stay as they were
+    write_u32(block + SB_INODE_SIZE_OFFSET, sb.inode_size == INODE_SIZE ? 0 : sb.inode_size);
+
+    bdirty(SUPERBLOCK_BLOCK);
+    brelse(SUPERBLOCK_BLOCK);
+}
+
+// the counters are only written back on close, so after a crash they
+// are rebuilt from the maps. the per-group counts allocation steers by
+// are never on disk, so they're counted on every open
+void superblock_recount(void)
+{
+    free_map_recount();
+}
+
+unsigned int group_first_block(int group)
+{
+    return (unsigned int)group * sb.blocks_per_group;
+}
+
+unsigned int group_inode_map(int group)
+{
+    if (group == 0)
+        return sb.inode_map;
+    return group_first_block(group) + GROUP_INODE_MAP;
+}
+
+unsigned int group_block_map(int group)
+{
+    if (group == 0)
+        return sb.block_map;
+    return group_first_block(group) + GROUP_BLOCK_MAP;
+}
+
+unsigned int group_inode_table(int group)
+{
+    if (group == 0)
+        return sb.inode_table;
+    return group_first_block(group) + GROUP_INODE_TABLE;
+}
+
+// size and free space of the open image, straight from the counters.
+// returns FAILED if the image has no superblock to count with
+int simfs_statfs(struct simfs_statfs *buf)
+{
+    if (!sb.valid)
+        return FAILED;
+
+    buf->block_size = sb.block_size;
+    buf->blocks = sb.block_count;
+    buf->free_blocks = sb.free_blocks;
+    buf->inodes = sb.inode_count;
+    buf->free_inodes = sb.free_inodes;
+    return 0;
+}
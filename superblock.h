@@ -0,0 +1,98 @@
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#define SUPERBLOCK_BLOCK 0
+#define SUPERBLOCK_MAGIC 0x53494d46  // "SIMF"
+// version 2 replaced the inodes' block pointers with extents.
+// version 3 images have more than one allocation group. an image with
+// a single group is still written as version 2, older code reads it fine.
+// version 4 images use optional features, listed in the features word
+#define SUPERBLOCK_VERSION 4
+#define SUPERBLOCK_GROUPS_VERSION 3
+#define SUPERBLOCK_MIN_VERSION 2
+
+// on-disk layout of block 0
+#define SB_MAGIC_OFFSET 0
+#define SB_VERSION_OFFSET 4
+#define SB_BLOCK_SIZE_OFFSET 8
+#define SB_BLOCK_COUNT_OFFSET 12
+#define SB_INODE_COUNT_OFFSET 16
+#define SB_INODE_MAP_OFFSET 20
+#define SB_BLOCK_MAP_OFFSET 24
+#define SB_INODE_TABLE_OFFSET 28
+#define SB_INODE_TABLE_BLOCKS_OFFSET 32
+#define SB_FIRST_DATA_BLOCK_OFFSET 36
+#define SB_FREE_BLOCKS_OFFSET 40
+#define SB_FREE_INODES_OFFSET 44
+// images made before the journal have zeros here, meaning no journal
+#define SB_JOURNAL_START_OFFSET 48
+#define SB_JOURNAL_BLOCKS_OFFSET 52
+// zeros in images made before allocation groups, meaning a single group
+#define SB_GROUP_COUNT_OFFSET 56
+#define SB_BLOCKS_PER_GROUP_OFFSET 60
+#define SB_INODES_PER_GROUP_OFFSET 64
+// zeros before there were features, meaning none and INODE_SIZE records
+#define SB_FEATURES_OFFSET 68
+#define SB_INODE_SIZE_OFFSET 72
+
+// optional features. an image using one this code doesn't know of
+// isn't opened
+#define FEATURE_INLINE_DATA 1  // small directories live in their inode
+#define FEATURE_VARIABLE_DIRENTS 2  // variable length directory records
+#define FEATURES_SUPPORTED (FEATURE_INLINE_DATA | FEATURE_VARIABLE_DIRENTS)
+
+// allocation groups. group g holds blocks from g * blocks_per_group and
+// inodes from g * inodes_per_group on, and has a map block for each and
+// its slice of the inode table. group 0 is laid out the way images were
+// before there were groups: superblock, inode map, block map, inode
+// table, journal. the others start with their maps and table slice
+#define GROUP_INODE_MAP 0
+#define GROUP_BLOCK_MAP 1
+#define GROUP_INODE_TABLE 2
+
+struct superblock {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned int inode_count;
+    unsigned int inode_map;
+    unsigned int block_map;
+    unsigned int inode_table;
+    unsigned int inode_table_blocks;
+    unsigned int first_data_block;
+    unsigned int free_blocks;
+    unsigned int free_inodes;
+    unsigned int journal_start;
+    unsigned int journal_blocks;
+    unsigned int group_count;
+    unsigned int blocks_per_group;
+    unsigned int inodes_per_group;
+    unsigned int features;
+    unsigned int inode_size;  // bytes in an inode table record
+
+    int valid;  // in-core only, block 0 holds a superblock
+};
+
+// free space summary from simfs_statfs()
+struct simfs_statfs {
+    unsigned int block_size;
+    unsigned int blocks;
+    unsigned int free_blocks;
+    unsigned int inodes;
+    unsigned int free_inodes;
+};
+
+extern struct superblock sb;
+
+void superblock_defaults(void);
+int superblock_load(void);
+void superblock_sync(void);
+void superblock_recount(void);
+unsigned int group_first_block(int group);
+unsigned int group_inode_map(int group);
+unsigned int group_block_map(int group);
+unsigned int group_inode_table(int group);
+int simfs_statfs(struct simfs_statfs *buf);
+
+#endif
@@ -0,0 +1,284 @@
+// block access traces: recording them as the library runs, and reading
+// them back to measure or replay. records go into a shared buffer under
+// a lock so the file keeps the order accesses happened in
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "block.h"
+#include "pack.h"
+#include "trace.h"
+
+int trace_on = 0;
+
+static int trace_fd = FAILED;
+static long long trace_started;
+static unsigned char *trace_buffer = NULL;
+static int trace_buffered = 0;
+static int trace_threads = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int current_caller = TRACE_OP_NONE;
+static __thread int current_thread = 0;
+
+static const char *caller_names[TRACE_OP_COUNT] = {
+    "none",
+    "mkfs",
+    "ialloc",
+    "iget",
+    "inode_sync",
+    "directory_get",
+    "directory_lookup",
+    "directory_make",
+    "file_read",
+    "file_write",
+    "ls",
+    "journal",
+};
+
+const char *trace_caller_name(int caller)
+{
+    if (caller < 0 || caller >= TRACE_OP_COUNT)
+        return NULL;
+    return caller_names[caller];
+}
+
+static long long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// the operation this thread's block accesses are made for from now on.
+// returns the one it replaces, to hand back to trace_leave()
+int trace_enter(int caller)
+{
+    int saved = current_caller;
+
+    current_caller = caller;
+    return saved;
+}
+
+void trace_leave(int saved)
+{
+    current_caller = saved;
+}
+
+// write out the buffered records. called with trace_lock held
+static void trace_drain(void)
+{
+    ssize_t len = (ssize_t)trace_buffered * TRACE_RECORD_SIZE;
+
+    if (len > 0 && write(trace_fd, trace_buffer, len) != len)
+        exit(1);
+    trace_buffered = 0;
+}
+
+// record one access to block_num
+void trace_block(int op, int block_num)
+{
+    long long ns = trace_now();
+
+    pthread_mutex_lock(&trace_lock);
+    // the trace stopped while this thread was on its way in
+    if (!trace_on) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    if (current_thread == 0)
+        current_thread = ++trace_threads;
+    ns -= trace_started;
+    unsigned char *record = trace_buffer + trace_buffered * TRACE_RECORD_SIZE;
+    write_u32(record, block_num);
+    write_u8(record + 4, op);
+    write_u8(record + 5, current_caller);
+    write_u16(record + 6, current_thread);
+    write_u32(record + 8, ns & 0xffffffff);
+    write_u32(record + 12, ns >> 32);
+    if (++trace_buffered == TRACE_BUFFER_RECORDS)
+        trace_drain();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// start recording into filename, replacing whatever it held.
+// returns 0, or FAILED if the file can't be created
+int trace_start(char *filename)
+{
+    unsigned char header[TRACE_HEADER_SIZE] = {0};
+
+    trace_stop();
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == FAILED)
+        return FAILED;
+    write_u32(header, TRACE_MAGIC);
+    write_u32(header + 4, TRACE_VERSION);
+    write_u32(header + 8, TRACE_RECORD_SIZE);
+    if (write(fd, header, TRACE_HEADER_SIZE) != TRACE_HEADER_SIZE)
+        exit(1);
+    trace_buffer = malloc(TRACE_BUFFER_RECORDS * TRACE_RECORD_SIZE);
+    if (trace_buffer == NULL)
+        exit(1);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_fd = fd;
+    trace_buffered = 0;
+    trace_threads = 0;
+    trace_started = trace_now();
+    trace_on = 1;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+// stop recording and close the trace file
+void trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_on) {
+        trace_drain();
+        close(trace_fd);
+        trace_fd = FAILED;
+        free(trace_buffer);
+        trace_buffer = NULL;
+        trace_on = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// read a whole trace into memory. returns the number of records with
+// *out pointing at them, to be freed by the caller, or FAILED if the
+// file isn't a trace this version understands
+int trace_load(char *filename, struct trace_record **out)
+{
+    struct stat st;
+    unsigned char header[TRACE_HEADER_SIZE];
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == FAILED)
+        return FAILED;
+    if (fstat(fd, &st) == FAILED || st.st_size < TRACE_HEADER_SIZE ||
+        read(fd, header, TRACE_HEADER_SIZE) != TRACE_HEADER_SIZE ||
+        read_u32(header) != TRACE_MAGIC || read_u32(header + 4) != TRACE_VERSION ||
+        read_u32(header + 8) != TRACE_RECORD_SIZE) {
+        close(fd);
+        return FAILED;
+    }
+
+    int count = (st.st_size - TRACE_HEADER_SIZE) / TRACE_RECORD_SIZE;
+    size_t len = (size_t)count * TRACE_RECORD_SIZE;
+    unsigned char *raw = malloc(len + 1);
+    struct trace_record *records = malloc(sizeof(struct trace_record) * (count + 1));
+    if (raw == NULL || records == NULL)
+        exit(1);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, raw + done, len - done);
+        if (n <= 0)
+            exit(1);
+        done += n;
+    }
+    close(fd);
+
+    for (int i = 0; i < count; i++) {
+        unsigned char *record = raw + (size_t)i * TRACE_RECORD_SIZE;
+        records[i].block_num = read_u32(record);
+        records[i].op = read_u8(record + 4);
+        records[i].caller = read_u8(record + 5);
+        records[i].thread = read_u16(record + 6);
+        records[i].ns = read_u32(record + 8) | (unsigned long long)read_u32(record + 12) << 32;
+    }
+    free(raw);
+    *out = records;
+    return count;
+}
+
+static void count_run(struct trace_summary *s, unsigned long length)
+{
+    int bucket = 63 - __builtin_clzll(length);
+
+    if (bucket >= TRACE_RUN_BUCKETS)
+        bucket = TRACE_RUN_BUCKETS - 1;
+    s->runs++;
+    s->run_lengths[bucket]++;
+}
+
+// measure a trace: how many distinct blocks it touches, how often
+// blocks are read again, and how long its sequential runs are. a run
+// is a stretch of same-kind accesses each to the block after the last
+void trace_analyze(struct trace_record *records, int count, struct trace_summary *s)
+{
+    unsigned int highest = 0;
+
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < count; i++)
+        if (records[i].block_num > highest)
+            highest = records[i].block_num;
+    s->block_count = count > 0 ? highest + 1 : 0;
+    s->block_reads = calloc(s->block_count + 1, sizeof(unsigned int));
+    unsigned char *touched = calloc(s->block_count + 1, 1);
+    if (s->block_reads == NULL || touched == NULL)
+        exit(1);
+
+    unsigned long run = 0;
+    for (int i = 0; i < count; i++) {
+        struct trace_record *r = &records[i];
+        s->records++;
+        if (r->caller >= 0 && r->caller < TRACE_OP_COUNT)
+            s->by_caller[r->caller]++;
+        if (!touched[r->block_num]) {
+            touched[r->block_num] = 1;
+            s->working_set++;
+        }
+        if (r->op == TRACE_READ) {
+            s->reads++;
+            if (s->block_reads[r->block_num]++ == 0)
+                s->read_set++;
+            else
+                s->rereads++;
+        } else {
+            s->writes++;
+        }
+
+        if (i > 0 && r->op == records[i - 1].op &&
+            r->block_num == records[i - 1].block_num + 1) {
+            run++;
+        } else {
+            if (run > 0)
+                count_run(s, run);
+            run = 1;
+        }
+    }
+    if (run > 0)
+        count_run(s, run);
+    if (count > 0)
+        s->ns = records[count - 1].ns - records[0].ns;
+    free(touched);
+}
+
+void trace_summary_free(struct trace_summary *s)
+{
+    free(s->block_reads);
+    s->block_reads = NULL;
+    s->block_count = 0;
+}
+
+// issue a trace's accesses against the open image as fast as they'll
+// go. a trace doesn't keep what was written, so a write puts back the
+// block's current contents: the image is unchanged but it sees the same
+// reads and writes, in the same order, under the same caller tags
+void trace_replay(struct trace_record *records, int count)
+{
+    unsigned char block[BLOCK_SIZE];
+
+    for (int i = 0; i < count; i++) {
+        TRACE_ENTER(records[i].caller);
+        bread(records[i].block_num, block);
+        if (records[i].op == TRACE_WRITE)
+            bwrite(records[i].block_num, block);
+        TRACE_LEAVE();
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// block access tracing. while a trace is running every bread(),
+// bwrite(), bget() and bdirty() is appended to a file as a fixed size
+// record, tagged with the high-level operation it was made for.
+//
+// the file is a header block of TRACE_HEADER_SIZE bytes holding the
+// magic, the version and the record size, then the records, all little
+// endian:
+//   0  u32 block number
+//   4  u8  TRACE_READ or TRACE_WRITE
+//   5  u8  caller, one of the TRACE_OP_* below
+//   6  u16 thread, numbered from 1 in order of first access
+//   8  u32 ns since the trace started, low half
+//   12 u32 ns since the trace started, high half
+#define TRACE_MAGIC 0x53545243  // "STRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_RECORD_SIZE 16
+// records gathered in memory between writes to the trace file
+#define TRACE_BUFFER_RECORDS 4096
+
+#define TRACE_READ 0
+#define TRACE_WRITE 1
+
+// what a block was accessed for. nested operations are attributed to
+// the innermost one, so an inode table read made by iget() inside
+// directory_make() counts as iget
+#define TRACE_OP_NONE 0
+#define TRACE_OP_MKFS 1
+#define TRACE_OP_IALLOC 2
+#define TRACE_OP_IGET 3
+#define TRACE_OP_INODE_SYNC 4
+#define TRACE_OP_DIRECTORY_GET 5
+#define TRACE_OP_DIRECTORY_LOOKUP 6
+#define TRACE_OP_DIRECTORY_MAKE 7
+#define TRACE_OP_FILE_READ 8
+#define TRACE_OP_FILE_WRITE 9
+#define TRACE_OP_LS 10
+#define TRACE_OP_JOURNAL 11
+#define TRACE_OP_COUNT 12
+
+// runs of sequential accesses are counted in buckets by length,
+// bucket b holding runs of [2^b, 2^(b+1)) blocks
+#define TRACE_RUN_BUCKETS 16
+
+struct trace_record {
+    unsigned int block_num;
+    int op;
+    int caller;
+    int thread;
+    unsigned long long ns;
+};
+
+// what trace_analyze() makes of a trace
+struct trace_summary {
+    unsigned long records;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long working_set;       // distinct blocks touched
+    unsigned long read_set;          // distinct blocks read
+    unsigned long rereads;           // reads of a block read before
+    unsigned long runs;
+    unsigned long run_lengths[TRACE_RUN_BUCKETS];
+    unsigned long by_caller[TRACE_OP_COUNT];
+    unsigned long long ns;           // from the first record to the last
+    // reads of each block, indexed by block number up to block_count
+    unsigned int *block_reads;
+    unsigned int block_count;
+};
+
+// the hooks used by the library. with no trace running these cost one
+// test of trace_on
+#define TRACE_BLOCK(op, block_num) do { if (trace_on) trace_block((op), (block_num)); } while (0)
+#define TRACE_ENTER(caller) int trace_saved = trace_enter(caller)
+#define TRACE_LEAVE() trace_leave(trace_saved)
+
+extern int trace_on;
+
+void trace_block(int op, int block_num);
+int trace_enter(int caller);
+void trace_leave(int saved);
+
+int trace_start(char *filename);
+void trace_stop(void);
+const char *trace_caller_name(int caller);
+
+int trace_load(char *filename, struct trace_record **out);
+void trace_analyze(struct trace_record *records, int count, struct trace_summary *s);
+void trace_summary_free(struct trace_summary *s);
+void trace_replay(struct trace_record *records, int count);
+
+#endif